@@ -0,0 +1,1669 @@
+/*
+ * Checks the extra sections that update-mime-database adds to mime.cache
+ * (listed in the extension directory after the header) against the
+ * standard sections they are built from.
+ *
+ * Usage: test-mime-cache [--reference OTHER/mime.cache] MIME-DIR/mime.cache [FILE...]
+ *
+ * The magic sections are checked by sniffing the given files, as well as
+ * data made up from the magic rules themselves.
+ *
+ * With --reference, the magic rules must also sniff everything the same
+ * way as those of the other cache (written with --no-optimize-magic).
+ *
+ * Prints what is wrong and exits with status 1 on failure.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#ifndef G_OS_WIN32
+#include <fnmatch.h>
+#endif
+
+#define HEADER_SIZE 44
+#define EXTENSIONS_MAGIC 0xFF455854
+#define EXTENSION_TAG(a, b, c, d) \
+	((guint32) (a) << 24 | (guint32) (b) << 16 | (guint32) (c) << 8 | (guint32) (d))
+
+#define EXTENSION_LITERAL_HASH EXTENSION_TAG ('L', 'H', 'S', 'H')
+#define EXTENSION_ALIAS_HASH   EXTENSION_TAG ('A', 'H', 'S', 'H')
+#define EXTENSION_ANCESTORS    EXTENSION_TAG ('A', 'N', 'C', 'S')
+#define EXTENSION_DESCENDANTS  EXTENSION_TAG ('D', 'E', 'S', 'C')
+#define EXTENSION_PARENTS      EXTENSION_TAG ('P', 'R', 'N', 'T')
+#define EXTENSION_TYPE_IDS     EXTENSION_TAG ('T', 'I', 'D', 'S')
+#define EXTENSION_GLOB_DFA     EXTENSION_TAG ('G', 'D', 'F', 'A')
+#define EXTENSION_MAGIC_DISPATCH EXTENSION_TAG ('M', 'D', 'S', 'P')
+#define EXTENSION_MAGIC_STRINGS EXTENSION_TAG ('M', 'S', 'T', 'R')
+#define EXTENSION_MAGIC_TIERS  EXTENSION_TAG ('M', 'T', 'I', 'R')
+#define EXTENSION_MAGIC_PROGRAM EXTENSION_TAG ('M', 'P', 'R', 'G')
+
+/* The instructions of the magic programs */
+#define MAGIC_OP_FAIL   0x00
+#define MAGIC_OP_TEST   0x80
+#define MAGIC_OP_RANGE  0x01
+#define MAGIC_OP_MASK   0x02
+#define MAGIC_OP_INLINE 0x04
+#define MAGIC_OP_ACCEPT 0x08
+#define MAGIC_OP_WORD   0x10
+
+#define NO_TYPE 0xFFFFFFFF
+
+/* Offsets in the header of the standard sections */
+#define ALIAS_LIST_OFFSET    4
+#define PARENT_LIST_OFFSET   8
+#define LITERAL_LIST_OFFSET 12
+#define SUFFIX_TREE_OFFSET  16
+#define GLOB_LIST_OFFSET    20
+#define MAGIC_LIST_OFFSET   24
+#define NAMESPACE_LIST_OFFSET 28
+#define ICONS_LIST_OFFSET   32
+#define GENERIC_ICONS_LIST_OFFSET 36
+#define TYPES_LIST_OFFSET   40
+
+typedef struct
+{
+	const guchar *data;
+	gsize size;
+} Cache;
+
+/* The start of a file to sniff */
+typedef struct
+{
+	guchar *data;
+	gsize len;
+} Sample;
+
+static gboolean failed = FALSE;
+
+static void
+fail (const char *format, ...) G_GNUC_PRINTF (1, 2);
+
+static void
+fail (const char *format, ...)
+{
+	va_list args;
+
+	va_start (args, format);
+	vfprintf (stderr, format, args);
+	va_end (args);
+	fputc ('\n', stderr);
+
+	failed = TRUE;
+}
+
+static guint32
+card32 (Cache *cache, guint32 offset)
+{
+	guint32 n;
+
+	if (offset > cache->size || cache->size - offset < 4) {
+		fail ("Offset %u is outside the cache", offset);
+		exit (1);
+	}
+
+	memcpy (&n, cache->data + offset, 4);
+
+	return GUINT32_FROM_BE (n);
+}
+
+static const char *
+string_at (Cache *cache, guint32 offset)
+{
+	if (offset >= cache->size ||
+	    memchr (cache->data + offset, '\0', cache->size - offset) == NULL) {
+		fail ("No string at offset %u", offset);
+		exit (1);
+	}
+
+	return (const char *) cache->data + offset;
+}
+
+/* Returns the offset of the extension section with this tag, or 0 */
+static guint32
+find_extension (Cache *cache, guint32 tag)
+{
+	guint32 directory, n, i;
+
+	if (card32 (cache, HEADER_SIZE) != EXTENSIONS_MAGIC)
+		return 0;
+
+	directory = card32 (cache, HEADER_SIZE + 4);
+	n = card32 (cache, directory);
+	for (i = 0; i < n; i++) {
+		if (card32 (cache, directory + 4 + 8 * i) == tag)
+			return card32 (cache, directory + 8 + 8 * i);
+	}
+
+	return 0;
+}
+
+/* Must match cache_hash() in update-mime-database.c */
+static guint32
+cache_hash (const gchar *str, guint32 seed)
+{
+	guint32 h = 2166136261u ^ seed;
+
+	for (; *str; str++) {
+		h ^= (guchar) *str;
+		h *= 16777619u;
+	}
+
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+
+	return h;
+}
+
+/* Look 'key' up in the perfect hash index at 'index', over the map
+ * section at 'list' with records of 'record_size' bytes. Returns the
+ * index of the first record for 'key', or -1.
+ */
+static gint
+hash_lookup (Cache       *cache,
+	     guint32      index,
+	     guint32      list,
+	     guint32      record_size,
+	     const gchar *key)
+{
+	guint32 seed, n_buckets, n_keys, bucket, slot, record;
+
+	seed = card32 (cache, index);
+	n_buckets = card32 (cache, index + 4);
+	n_keys = card32 (cache, index + 8);
+	if (n_buckets == 0 || n_keys == 0)
+		return -1;
+
+	bucket = cache_hash (key, seed) % n_buckets;
+	slot = cache_hash (key, card32 (cache, index + 12 + 4 * bucket)) % n_keys;
+	record = card32 (cache, index + 12 + 4 * n_buckets + 4 * slot);
+
+	if (record >= card32 (cache, list))
+		return -1;
+	if (strcmp (string_at (cache, card32 (cache, list + 4 + record * record_size)), key) != 0)
+		return -1;
+
+	return record;
+}
+
+/* The same lookup, done by binary search as in the standard readers */
+static gint
+sorted_lookup (Cache       *cache,
+	       guint32      list,
+	       guint32      record_size,
+	       const gchar *key)
+{
+	gint lo = 0, hi = card32 (cache, list);
+
+	while (lo < hi) {
+		gint mid = (lo + hi) / 2;
+		const gchar *s;
+
+		s = string_at (cache, card32 (cache, list + 4 + mid * record_size));
+		if (strcmp (s, key) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < card32 (cache, list) &&
+	    strcmp (string_at (cache, card32 (cache, list + 4 + lo * record_size)), key) == 0)
+		return lo;
+
+	return -1;
+}
+
+/* Every key of the map section must be found at its first record, and
+ * keys that aren't there mustn't be found.
+ */
+static void
+check_hash_index (Cache       *cache,
+		  guint32      tag,
+		  guint32      header_offset,
+		  guint32      record_size,
+		  const gchar *name)
+{
+	guint32 index, list, n, i, n_keys = 0;
+	const gchar *previous = NULL;
+
+	index = find_extension (cache, tag);
+	if (index == 0) {
+		fail ("No %s hash index", name);
+		return;
+	}
+
+	list = card32 (cache, header_offset);
+	n = card32 (cache, list);
+	for (i = 0; i < n; i++) {
+		const gchar *key;
+		gchar *other;
+
+		key = string_at (cache, card32 (cache, list + 4 + i * record_size));
+		if (previous && strcmp (previous, key) == 0)
+			continue;
+		previous = key;
+		n_keys++;
+
+		if (hash_lookup (cache, index, list, record_size, key) != (gint) i)
+			fail ("%s '%s' not found at record %u", name, key, i);
+
+		other = g_strconcat (key, "~", NULL);
+		if (hash_lookup (cache, index, list, record_size, other) !=
+		    sorted_lookup (cache, list, record_size, other))
+			fail ("%s '%s' looked up wrongly", name, other);
+		g_free (other);
+	}
+
+	if (n_keys != card32 (cache, index + 8))
+		fail ("%s hash index has %u keys, expected %u",
+		      name, card32 (cache, index + 8), n_keys);
+}
+
+/* The ID of a type (its index in the types list), following aliases.
+ * -1 if there's no such type.
+ */
+static gint
+type_id (Cache *cache, const gchar *name)
+{
+	guint32 aliases = card32 (cache, ALIAS_LIST_OFFSET);
+	gint alias;
+
+	alias = sorted_lookup (cache, aliases, 8, name);
+	if (alias >= 0)
+		name = string_at (cache, card32 (cache, aliases + 8 + alias * 8));
+
+	return sorted_lookup (cache, card32 (cache, TYPES_LIST_OFFSET), 4, name);
+}
+
+static void add_ancestors (Cache *cache, const gchar *name, gboolean *seen);
+
+static void
+add_ancestor (Cache *cache, gint id, gboolean *seen)
+{
+	if (id < 0 || seen[id])
+		return;
+
+	seen[id] = TRUE;
+	add_ancestors (cache, string_at (cache,
+		card32 (cache, card32 (cache, TYPES_LIST_OFFSET) + 4 + 4 * id)),
+		seen);
+}
+
+/* Walk the parents list, as readers without the ancestors section do,
+ * including the parents they assume for every text type (text/plain)
+ * and every type but the inode ones (application/octet-stream).
+ */
+static void
+add_ancestors (Cache       *cache,
+	       const gchar *name,
+	       gboolean    *seen)
+{
+	guint32 parents = card32 (cache, PARENT_LIST_OFFSET);
+	guint32 list, n, i;
+	gint entry;
+
+	entry = sorted_lookup (cache, parents, 8, name);
+	if (entry >= 0) {
+		list = card32 (cache, parents + 8 + entry * 8);
+		n = card32 (cache, list);
+		for (i = 0; i < n; i++)
+			add_ancestor (cache, type_id (cache, string_at (cache,
+				card32 (cache, list + 4 + 4 * i))), seen);
+	}
+
+	if (g_str_has_prefix (name, "text/"))
+		add_ancestor (cache, type_id (cache, "text/plain"), seen);
+	if (!g_str_has_prefix (name, "inode/"))
+		add_ancestor (cache, type_id (cache, "application/octet-stream"),
+			      seen);
+}
+
+/* Check the set of IDs for type 'id' in the section at 'section' */
+static void
+check_id_set (Cache          *cache,
+	      guint32         section,
+	      guint32         id,
+	      const gboolean *expected,
+	      const gchar    *what)
+{
+	guint32 n_types, first, last, ids, i, count = 0;
+	const gchar *name;
+	gint previous = -1;
+
+	n_types = card32 (cache, section);
+	ids = section + 4 + 4 * (n_types + 1);
+	first = card32 (cache, section + 4 + 4 * id);
+	last = card32 (cache, section + 8 + 4 * id);
+	name = string_at (cache, card32 (cache,
+		card32 (cache, TYPES_LIST_OFFSET) + 4 + 4 * id));
+
+	for (i = 0; i < n_types; i++)
+		if (expected[i])
+			count++;
+
+	if (first > last || last - first != count) {
+		fail ("%s has %d %s, expected %u", name,
+		      (gint) (last - first), what, count);
+		return;
+	}
+
+	for (i = first; i < last; i++) {
+		guint32 other = card32 (cache, ids + 4 * i);
+
+		if ((gint) other <= previous || other >= n_types)
+			fail ("%s: %s out of order", name, what);
+		else if (!expected[other])
+			fail ("%s: unexpected entry %u in %s", name, other, what);
+		previous = other;
+	}
+}
+
+/* Whether 'ancestor' is in the set for 'id' in the ancestors section */
+static gboolean
+has_ancestor (Cache *cache, guint32 section, guint32 id, guint32 ancestor)
+{
+	guint32 n_types, ids, lo, hi;
+
+	n_types = card32 (cache, section);
+	ids = section + 4 + 4 * (n_types + 1);
+	lo = card32 (cache, section + 4 + 4 * id);
+	hi = card32 (cache, section + 8 + 4 * id);
+
+	while (lo < hi) {
+		guint32 mid = lo + (hi - lo) / 2;
+		guint32 other = card32 (cache, ids + 4 * mid);
+
+		if (other == ancestor)
+			return TRUE;
+		if (other < ancestor)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return FALSE;
+}
+
+/* The descendants of each type must be the types that have it as an
+ * ancestor (the ancestors have already been checked).
+ */
+static void
+check_descendants (Cache *cache, guint32 ancestors)
+{
+	guint32 section, n_types, i, j;
+	gint text_plain, octet_stream;
+	gboolean *expected;
+
+	section = find_extension (cache, EXTENSION_DESCENDANTS);
+	if (section == 0) {
+		fail ("No descendants section");
+		return;
+	}
+
+	n_types = card32 (cache, ancestors);
+	if (card32 (cache, section) != n_types) {
+		fail ("Descendants section has %u types, expected %u",
+		      card32 (cache, section), n_types);
+		return;
+	}
+
+	expected = g_new (gboolean, n_types);
+	for (i = 0; i < n_types; i++) {
+		for (j = 0; j < n_types; j++)
+			expected[j] = has_ancestor (cache, ancestors, j, i);
+
+		check_id_set (cache, section, i, expected, "descendants");
+	}
+	g_free (expected);
+
+	/* Whatever the parents list says, these have every text type and
+	 * every type but the inode ones as descendants.
+	 */
+	text_plain = type_id (cache, "text/plain");
+	octet_stream = type_id (cache, "application/octet-stream");
+	for (i = 0; i < n_types; i++) {
+		const gchar *name;
+
+		name = string_at (cache, card32 (cache,
+			card32 (cache, TYPES_LIST_OFFSET) + 4 + 4 * i));
+		if (text_plain >= 0 && i != text_plain &&
+		    g_str_has_prefix (name, "text/") &&
+		    !has_ancestor (cache, section, text_plain, i))
+			fail ("%s isn't a descendant of text/plain", name);
+		if (octet_stream >= 0 && i != octet_stream &&
+		    !g_str_has_prefix (name, "inode/") &&
+		    !has_ancestor (cache, section, octet_stream, i))
+			fail ("%s isn't a descendant of application/octet-stream",
+			      name);
+	}
+}
+
+/* The direct parents of each type must be those in the parents list */
+static void
+check_parents (Cache *cache)
+{
+	guint32 section, parents, n_types, i, j;
+	gboolean *expected;
+
+	section = find_extension (cache, EXTENSION_PARENTS);
+	if (section == 0) {
+		fail ("No parents section");
+		return;
+	}
+
+	n_types = card32 (cache, card32 (cache, TYPES_LIST_OFFSET));
+	if (card32 (cache, section) != n_types) {
+		fail ("Parents section has %u types, expected %u",
+		      card32 (cache, section), n_types);
+		return;
+	}
+
+	parents = card32 (cache, PARENT_LIST_OFFSET);
+	expected = g_new (gboolean, n_types);
+	for (i = 0; i < n_types; i++) {
+		const gchar *name;
+		gint entry;
+
+		name = string_at (cache, card32 (cache,
+			card32 (cache, TYPES_LIST_OFFSET) + 4 + 4 * i));
+		memset (expected, 0, n_types * sizeof (gboolean));
+
+		entry = sorted_lookup (cache, parents, 8, name);
+		if (entry >= 0) {
+			guint32 list = card32 (cache, parents + 8 + entry * 8);
+
+			for (j = 0; j < card32 (cache, list); j++) {
+				gint id = type_id (cache, string_at (cache,
+					card32 (cache, list + 4 + 4 * j)));
+
+				if (id >= 0 && id != (gint) i)
+					expected[id] = TRUE;
+			}
+		}
+
+		check_id_set (cache, section, i, expected, "parents");
+	}
+	g_free (expected);
+}
+
+/* Check one table of the type IDs section against the 'n' records at
+ * 'first', each naming a type at 'field'. If 'leaves_only', only records
+ * starting with 0 name a type.
+ */
+static void
+check_type_id_table (Cache       *cache,
+		     guint32      table,
+		     guint32      first,
+		     guint32      n,
+		     guint32      record_size,
+		     guint32      field,
+		     gboolean     leaves_only,
+		     const gchar *what)
+{
+	guint32 types, i;
+
+	if (card32 (cache, table) != n) {
+		fail ("Type IDs for %s have %u records, expected %u",
+		      what, card32 (cache, table), n);
+		return;
+	}
+
+	types = card32 (cache, TYPES_LIST_OFFSET);
+	for (i = 0; i < n; i++) {
+		guint32 record = first + i * record_size;
+		guint32 id = card32 (cache, table + 4 + 4 * i);
+		gint expected = -1;
+
+		if (!leaves_only || card32 (cache, record) == 0)
+			expected = type_id (cache, string_at (cache,
+				card32 (cache, record + field)));
+
+		/* An alias isn't a type */
+		if (expected >= 0 &&
+		    card32 (cache, types + 4 + 4 * expected) !=
+		    card32 (cache, record + field))
+			expected = -1;
+
+		if (id != (expected < 0 ? NO_TYPE : (guint32) expected))
+			fail ("Record %u of %s has type ID %d, expected %d",
+			      i, what, (gint) id, expected);
+	}
+}
+
+static void
+check_type_ids (Cache *cache)
+{
+	guint32 section, suffix_first, section_offset;
+
+	section = find_extension (cache, EXTENSION_TYPE_IDS);
+	if (section == 0) {
+		fail ("No type IDs section");
+		return;
+	}
+
+	if (card32 (cache, section) != 9) {
+		fail ("Type IDs section has %u tables, expected 9",
+		      card32 (cache, section));
+		return;
+	}
+
+#define CHECK_MAP(i, header_offset, record_size, field, what) \
+	section_offset = card32 (cache, header_offset); \
+	check_type_id_table (cache, card32 (cache, section + 4 + 4 * (i)), \
+			     section_offset + 4, card32 (cache, section_offset), \
+			     record_size, field, FALSE, what)
+
+	CHECK_MAP (0, ALIAS_LIST_OFFSET, 8, 4, "aliases");
+	CHECK_MAP (1, PARENT_LIST_OFFSET, 8, 0, "parents");
+	CHECK_MAP (2, LITERAL_LIST_OFFSET, 12, 4, "literal globs");
+	CHECK_MAP (4, GLOB_LIST_OFFSET, 12, 4, "full globs");
+	CHECK_MAP (6, NAMESPACE_LIST_OFFSET, 12, 8, "namespaces");
+	CHECK_MAP (7, ICONS_LIST_OFFSET, 8, 0, "icons");
+	CHECK_MAP (8, GENERIC_ICONS_LIST_OFFSET, 8, 0, "generic icons");
+
+#undef CHECK_MAP
+
+	suffix_first = card32 (cache, card32 (cache, SUFFIX_TREE_OFFSET) + 4);
+	check_type_id_table (cache, card32 (cache, section + 16),
+			     suffix_first,
+			     (card32 (cache, GLOB_LIST_OFFSET) - suffix_first) / 12,
+			     12, 4, TRUE, "suffix tree");
+
+	section_offset = card32 (cache, MAGIC_LIST_OFFSET);
+	check_type_id_table (cache, card32 (cache, section + 24),
+			     card32 (cache, section_offset + 8),
+			     card32 (cache, section_offset),
+			     16, 4, FALSE, "magic");
+}
+
+#ifndef G_OS_WIN32
+/* Run the full globs automaton at 'section' over 'name', setting
+ * matched[i] for each glob i that it accepts.
+ */
+static void
+run_glob_dfa (Cache       *cache,
+	      guint32      section,
+	      const gchar *name,
+	      gboolean    *matched)
+{
+	guint32 n_globs, n_states, n_classes, transitions, accept_first;
+	guint32 accepts, state = 1, i;
+	const guchar *p;
+
+	n_globs = card32 (cache, section);
+	n_states = card32 (cache, section + 4);
+	n_classes = card32 (cache, section + 8);
+	transitions = section + 12 + 256;
+	accept_first = transitions + 4 * n_states * n_classes;
+	accepts = accept_first + 4 * (n_states + 1);
+
+	memset (matched, 0, n_globs * sizeof (gboolean));
+
+	for (p = (const guchar *) name; *p && state != 0; p++) {
+		guchar class = cache->data[section + 12 + *p];
+
+		state = card32 (cache, transitions + 4 * (state * n_classes + class));
+		if (state >= n_states) {
+			fail ("Bad state %u in the full globs automaton", state);
+			return;
+		}
+	}
+
+	for (i = card32 (cache, accept_first + 4 * state);
+	     i < card32 (cache, accept_first + 4 * state + 4); i++) {
+		guint32 glob = card32 (cache, accepts + 12 * i);
+
+		if (glob < n_globs)
+			matched[glob] = TRUE;
+	}
+}
+
+/* Replace the wildcards in a glob by something they match */
+static gchar *
+expand_glob (const gchar *glob, const gchar *star)
+{
+	GString *name = g_string_new (NULL);
+	const gchar *p;
+
+	for (p = glob; *p; p++) {
+		if (*p == '*')
+			g_string_append (name, star);
+		else if (*p == '?')
+			g_string_append_c (name, 'q');
+		else if (*p == '[' && strchr (p, ']')) {
+			if (p[1] == '!' || p[1] == '^')
+				g_string_append_c (name, '~');
+			else
+				g_string_append_c (name, p[1]);
+			p = strchr (p + 2, ']');
+		} else if (*p == '\\' && p[1])
+			g_string_append_c (name, *++p);
+		else
+			g_string_append_c (name, *p);
+	}
+
+	return g_string_free (name, FALSE);
+}
+
+static void
+check_glob_name (Cache       *cache,
+		 guint32      section,
+		 guint32      globs,
+		 const gchar *name,
+		 gboolean    *matched)
+{
+	gchar *lower;
+	guint32 i;
+
+	/* What fnmatch() does with other characters depends on the locale */
+	for (i = 0; name[i]; i++)
+		if ((guchar) name[i] >= 0x80)
+			return;
+
+	lower = g_ascii_strdown (name, -1);
+	run_glob_dfa (cache, section, name, matched);
+
+	for (i = 0; i < card32 (cache, globs); i++) {
+		const gchar *pattern;
+		gboolean expected;
+
+		pattern = string_at (cache, card32 (cache, globs + 4 + 12 * i));
+		if (card32 (cache, globs + 12 + 12 * i) & 0x100)
+			expected = fnmatch (pattern, name, 0) == 0;
+		else
+			expected = fnmatch (pattern, lower, 0) == 0;
+
+		if (matched[i] != expected)
+			fail ("Full glob '%s' %s '%s' in the automaton", pattern,
+			      matched[i] ? "matches" : "doesn't match", name);
+	}
+
+	g_free (lower);
+}
+
+/* The full globs automaton must agree with fnmatch() on the names the
+ * globs are meant to match, and on random names made of the characters
+ * they use. Only ASCII names are checked.
+ */
+static void
+check_glob_dfa (Cache *cache)
+{
+	guint32 section, globs, n_globs, i, j;
+	GString *alphabet;
+	gboolean *matched;
+	guint32 seed = 1;
+
+	section = find_extension (cache, EXTENSION_GLOB_DFA);
+	if (section == 0) {
+		fail ("No full globs automaton");
+		return;
+	}
+
+	globs = card32 (cache, GLOB_LIST_OFFSET);
+	n_globs = card32 (cache, globs);
+	if (card32 (cache, section) != n_globs) {
+		fail ("Full globs automaton has %u globs, expected %u",
+		      card32 (cache, section), n_globs);
+		return;
+	}
+
+	matched = g_new (gboolean, n_globs);
+	alphabet = g_string_new ("aZ.~");
+
+	for (i = 0; i < n_globs; i++) {
+		const gchar *pattern;
+		const gchar *stars[] = { "", "x", "Ab.c" };
+		guint32 accepts, entry;
+
+		pattern = string_at (cache, card32 (cache, globs + 4 + 12 * i));
+		for (j = 0; pattern[j]; j++)
+			if ((guchar) pattern[j] < 0x80 &&
+			    !strchr (alphabet->str, pattern[j]))
+				g_string_append_c (alphabet, pattern[j]);
+
+		for (j = 0; j < G_N_ELEMENTS (stars); j++) {
+			gchar *name = expand_glob (pattern, stars[j]);
+			gchar *upper = g_ascii_strup (name, -1);
+
+			check_glob_name (cache, section, globs, name, matched);
+			check_glob_name (cache, section, globs, upper, matched);
+			g_free (name);
+			g_free (upper);
+		}
+
+		/* The type and weight of each accepted glob must be those
+		 * of its record
+		 */
+		accepts = section + 12 + 256 +
+			4 * card32 (cache, section + 4) * card32 (cache, section + 8) +
+			4 * (card32 (cache, section + 4) + 1);
+		for (entry = 0; entry < card32 (cache, accepts - 4); entry++) {
+			guint32 glob = card32 (cache, accepts + 12 * entry);
+			gint id;
+
+			if (glob != i)
+				continue;
+			id = type_id (cache, string_at (cache,
+				card32 (cache, globs + 8 + 12 * i)));
+			if (card32 (cache, accepts + 12 * entry + 4) != (guint32) id ||
+			    card32 (cache, accepts + 12 * entry + 8) !=
+			    card32 (cache, globs + 12 + 12 * i))
+				fail ("Wrong type or weight for full glob '%s'",
+				      pattern);
+		}
+	}
+
+	for (i = 0; i < 20000; i++) {
+		GString *name = g_string_new (NULL);
+		guint32 len;
+
+		seed = seed * 1103515245 + 12345;
+		len = (seed >> 16) % 16;
+		for (j = 0; j < len; j++) {
+			seed = seed * 1103515245 + 12345;
+			g_string_append_c (name,
+				alphabet->str[(seed >> 16) % alphabet->len]);
+		}
+
+		check_glob_name (cache, section, globs, name->str, matched);
+		g_string_free (name, TRUE);
+	}
+
+	g_string_free (alphabet, TRUE);
+	g_free (matched);
+}
+#endif
+
+/* Where byte 'i' of some data is in the cache, when the data is made of
+ * 'word_size' byte words in the host's byte order: the cache has them
+ * big-endian, as in the XML, so little-endian hosts swap each of them.
+ */
+static guint32
+host_order_index (guint32 word_size, guint32 data_length, guint32 i)
+{
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+	if (word_size > 1 && i - i % word_size + word_size <= data_length)
+		return i - i % word_size + word_size - 1 - i % word_size;
+#endif
+	return i;
+}
+
+/* Write the data of the matchlet at 'matchlet' as it is found in a file */
+static void
+copy_matchlet_data (Cache *cache, guint32 matchlet, guchar *dest)
+{
+	guint32 word_size, data_length, data, j;
+
+	word_size = card32 (cache, matchlet + 8);
+	data_length = card32 (cache, matchlet + 12);
+	data = card32 (cache, matchlet + 16);
+
+	for (j = 0; j < data_length; j++)
+		dest[j] = cache->data[data + host_order_index (word_size,
+							       data_length, j)];
+}
+
+/* Whether the data of the matchlet at 'matchlet' is found in 'sample',
+ * ignoring its children, in the same way as the standard readers.
+ */
+static gboolean
+matchlet_data_matches (Cache *cache, guint32 matchlet, const Sample *sample)
+{
+	guint32 range_start, range_length, word_size, data_length, data, mask;
+	guint32 i, j;
+
+	range_start = card32 (cache, matchlet);
+	range_length = card32 (cache, matchlet + 4);
+	word_size = card32 (cache, matchlet + 8);
+	data_length = card32 (cache, matchlet + 12);
+	data = card32 (cache, matchlet + 16);
+	mask = card32 (cache, matchlet + 20);
+
+	if (data + data_length > cache->size ||
+	    (mask && mask + data_length > cache->size)) {
+		fail ("Matchlet data outside the cache");
+		return FALSE;
+	}
+
+	for (i = range_start; i < range_start + range_length; i++) {
+		const guchar *p = sample->data + i;
+
+		if (i + data_length > sample->len)
+			return FALSE;
+
+		for (j = 0; j < data_length; j++) {
+			guint32 k = host_order_index (word_size, data_length, j);
+			guchar m = mask ? cache->data[mask + k] : 0xff;
+
+			if ((cache->data[data + k] & m) != (p[j] & m))
+				break;
+		}
+		if (j == data_length)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Whether the matchlet at 'matchlet' and one of its children (if it has
+ * any) match 'sample'
+ */
+static gboolean
+matchlet_matches (Cache *cache, guint32 matchlet, const Sample *sample)
+{
+	guint32 n_children, first_child, i;
+
+	if (!matchlet_data_matches (cache, matchlet, sample))
+		return FALSE;
+
+	n_children = card32 (cache, matchlet + 24);
+	first_child = card32 (cache, matchlet + 28);
+	if (n_children == 0)
+		return TRUE;
+
+	for (i = 0; i < n_children; i++)
+		if (matchlet_matches (cache, first_child + 32 * i, sample))
+			return TRUE;
+
+	return FALSE;
+}
+
+/* Whether entry 'i' of the magic section matches 'sample' */
+static gboolean
+magic_matches (Cache *cache, guint32 i, const Sample *sample)
+{
+	guint32 magic, entry, n_matchlets, first, j;
+
+	magic = card32 (cache, MAGIC_LIST_OFFSET);
+	entry = card32 (cache, magic + 8) + 16 * i;
+	n_matchlets = card32 (cache, entry + 8);
+	first = card32 (cache, entry + 12);
+
+	for (j = 0; j < n_matchlets; j++)
+		if (matchlet_matches (cache, first + 32 * j, sample))
+			return TRUE;
+
+	return FALSE;
+}
+
+/* Make up some data that each top-level matchlet matches, at both ends
+ * of its range, so that every magic rule is exercised even without
+ * sample files.
+ */
+static void
+add_magic_samples (Cache *cache, GArray *samples)
+{
+	guint32 magic, n_entries, max_extent, i, j;
+
+	magic = card32 (cache, MAGIC_LIST_OFFSET);
+	n_entries = card32 (cache, magic);
+	max_extent = card32 (cache, magic + 4);
+
+	for (i = 0; i < n_entries; i++) {
+		guint32 entry = card32 (cache, magic + 8) + 16 * i;
+		guint32 first = card32 (cache, entry + 12);
+
+		for (j = 0; j < 2 * card32 (cache, entry + 8); j++) {
+			guint32 matchlet = first + 32 * (j / 2);
+			guint32 start = card32 (cache, matchlet);
+			guint32 data_length = card32 (cache, matchlet + 12);
+			Sample sample;
+
+			if (j % 2) {
+				if (card32 (cache, matchlet + 4) < 2)
+					continue;
+				start += card32 (cache, matchlet + 4) - 1;
+			}
+
+			if (start + data_length > max_extent)
+				continue;
+
+			sample.len = max_extent;
+			sample.data = g_malloc0 (max_extent);
+			copy_matchlet_data (cache, matchlet, sample.data + start);
+			g_array_append_val (samples, sample);
+		}
+	}
+}
+
+/* Every magic entry that matches a sample must be a candidate for its
+ * first byte.
+ */
+static void
+check_magic_dispatch (Cache *cache, GArray *samples)
+{
+	guint32 section, magic, n_entries, n_always, first, i, j;
+	gboolean *candidate;
+
+	section = find_extension (cache, EXTENSION_MAGIC_DISPATCH);
+	if (section == 0) {
+		fail ("No magic dispatch section");
+		return;
+	}
+
+	magic = card32 (cache, MAGIC_LIST_OFFSET);
+	n_entries = card32 (cache, magic);
+	if (card32 (cache, section) != n_entries) {
+		fail ("Magic dispatch has %u entries, expected %u",
+		      card32 (cache, section), n_entries);
+		return;
+	}
+
+	n_always = card32 (cache, section + 4);
+	first = section + 8 + 4 * n_always;
+	candidate = g_new (gboolean, n_entries);
+
+	for (i = 0; i < samples->len; i++) {
+		Sample *sample = &g_array_index (samples, Sample, i);
+		guint32 entry, end;
+		gint previous = -1;
+
+		if (sample->len == 0)
+			continue;
+
+		memset (candidate, 0, n_entries * sizeof (gboolean));
+		for (j = 0; j < n_always; j++)
+			candidate[card32 (cache, section + 8 + 4 * j) % n_entries] = TRUE;
+
+		end = card32 (cache, first + 4 * sample->data[0] + 4);
+		for (j = card32 (cache, first + 4 * sample->data[0]); j < end; j++) {
+			entry = card32 (cache, first + 4 * 257 + 4 * j);
+			if ((gint) entry <= previous || entry >= n_entries) {
+				fail ("Magic dispatch for byte %d out of order",
+				      sample->data[0]);
+				break;
+			}
+			candidate[entry] = TRUE;
+			previous = entry;
+		}
+
+		for (j = 0; j < n_entries; j++)
+			if (!candidate[j] && magic_matches (cache, j, sample))
+				fail ("Magic entry %u matches sample %u but isn't "
+				      "a candidate for byte %d", j, i, sample->data[0]);
+	}
+
+	g_free (candidate);
+}
+
+/* Adds the matchlets at 'first' and their children that should be in the
+ * magic strings automaton to 'matchlets'
+ */
+static void
+collect_ranged_strings (Cache   *cache,
+			guint32  first,
+			guint32  n_matchlets,
+			GArray  *matchlets)
+{
+	guint32 i;
+
+	for (i = 0; i < n_matchlets; i++) {
+		guint32 matchlet = first + 32 * i;
+
+		if (card32 (cache, matchlet + 4) > 1 &&
+		    card32 (cache, matchlet + 8) <= 1 &&
+		    card32 (cache, matchlet + 12) > 0 &&
+		    card32 (cache, matchlet + 20) == 0)
+			g_array_append_val (matchlets, matchlet);
+
+		collect_ranged_strings (cache, card32 (cache, matchlet + 28),
+					card32 (cache, matchlet + 24), matchlets);
+	}
+}
+
+static gint
+cmp_card32 (gconstpointer a, gconstpointer b)
+{
+	guint32 aa = *(const guint32 *) a;
+	guint32 bb = *(const guint32 *) b;
+
+	return aa < bb ? -1 : aa > bb;
+}
+
+/* Scan 'sample' with the magic strings automaton at 'section', setting
+ * found[i] for each matchlet i of its list whose data is in range.
+ */
+static void
+run_magic_strings (Cache        *cache,
+		   guint32       section,
+		   const Sample *sample,
+		   gboolean     *found)
+{
+	guint32 n_nodes, n_edges, n_patterns, n_matchlets, scan_extent;
+	guint32 nodes, edges, lengths, firsts, matchlets;
+	guint32 node = 0, end;
+
+	n_nodes = card32 (cache, section);
+	n_edges = card32 (cache, section + 4);
+	n_patterns = card32 (cache, section + 8);
+	n_matchlets = card32 (cache, section + 12);
+	scan_extent = card32 (cache, section + 16);
+	nodes = section + 20;
+	edges = nodes + 20 * n_nodes;
+	lengths = edges + 4 * n_edges;
+	firsts = lengths + 4 * n_patterns;
+	matchlets = firsts + 4 * (n_patterns + 1);
+
+	memset (found, 0, n_matchlets * sizeof (gboolean));
+
+	for (end = 0; end < MIN (sample->len, scan_extent); end++) {
+		guchar c = sample->data[end];
+		guint32 hit;
+
+		/* Follow the failure links until there's an edge for 'c' */
+		for (;;) {
+			guint32 first = card32 (cache, nodes + 20 * node + 12);
+			guint32 n = card32 (cache, nodes + 20 * node + 16);
+			guint32 i, next = 0;
+
+			for (i = first; i < first + n; i++) {
+				guint32 edge = card32 (cache, edges + 4 * i);
+
+				if (edge >> 24 == c) {
+					next = edge & 0xffffff;
+					break;
+				}
+			}
+
+			if (next != 0 || node == 0) {
+				node = next;
+				break;
+			}
+			node = card32 (cache, nodes + 20 * node);
+		}
+
+		if (node >= n_nodes) {
+			fail ("Bad node in the magic strings automaton");
+			return;
+		}
+
+		hit = card32 (cache, nodes + 20 * node + 4) != NO_TYPE ?
+			node : card32 (cache, nodes + 20 * node + 8);
+		while (hit != 0) {
+			guint32 pattern = card32 (cache, nodes + 20 * hit + 4);
+			guint32 length = card32 (cache, lengths + 4 * pattern);
+			guint32 start = end + 1 - length;
+			guint32 i;
+
+			for (i = card32 (cache, firsts + 4 * pattern);
+			     i < card32 (cache, firsts + 4 * pattern + 4); i++) {
+				guint32 matchlet = card32 (cache, matchlets + 4 * i);
+				guint32 range_start = card32 (cache, matchlet);
+
+				if (start >= range_start &&
+				    start - range_start < card32 (cache, matchlet + 4))
+					found[i] = TRUE;
+			}
+
+			hit = card32 (cache, nodes + 20 * hit + 8);
+		}
+	}
+}
+
+/* The magic strings automaton must list every ranged string matchlet,
+ * and find each one in exactly the samples that it matches.
+ */
+static void
+check_magic_strings (Cache *cache, GArray *samples)
+{
+	guint32 section, magic, entries, n_matchlets, list, i, j;
+	GArray *expected, *listed;
+	gboolean *found;
+
+	section = find_extension (cache, EXTENSION_MAGIC_STRINGS);
+	if (section == 0) {
+		fail ("No magic strings section");
+		return;
+	}
+
+	magic = card32 (cache, MAGIC_LIST_OFFSET);
+	entries = card32 (cache, magic + 8);
+	expected = g_array_new (FALSE, FALSE, sizeof (guint32));
+	for (i = 0; i < card32 (cache, magic); i++)
+		collect_ranged_strings (cache, card32 (cache, entries + 16 * i + 12),
+					card32 (cache, entries + 16 * i + 8),
+					expected);
+	g_array_sort (expected, cmp_card32);
+	for (i = j = 0; i < expected->len; i++)
+		if (j == 0 || g_array_index (expected, guint32, i) !=
+			      g_array_index (expected, guint32, j - 1))
+			g_array_index (expected, guint32, j++) =
+				g_array_index (expected, guint32, i);
+	g_array_set_size (expected, j);
+
+	n_matchlets = card32 (cache, section + 12);
+	list = section + 20 + 20 * card32 (cache, section) +
+		4 * card32 (cache, section + 4) +
+		4 * (2 * card32 (cache, section + 8) + 1);
+	listed = g_array_new (FALSE, FALSE, sizeof (guint32));
+	for (i = 0; i < n_matchlets; i++) {
+		guint32 matchlet = card32 (cache, list + 4 * i);
+
+		g_array_append_val (listed, matchlet);
+	}
+	g_array_sort (listed, cmp_card32);
+
+	if (listed->len != expected->len ||
+	    memcmp (listed->data, expected->data, 4 * listed->len) != 0) {
+		fail ("Magic strings automaton has %u matchlets, expected %u",
+		      listed->len, expected->len);
+		goto out;
+	}
+
+	found = g_new (gboolean, n_matchlets);
+	for (i = 0; i < samples->len; i++) {
+		Sample *sample = &g_array_index (samples, Sample, i);
+
+		run_magic_strings (cache, section, sample, found);
+
+		for (j = 0; j < n_matchlets; j++) {
+			guint32 matchlet = card32 (cache, list + 4 * j);
+
+			if (found[j] != matchlet_data_matches (cache, matchlet, sample))
+				fail ("Magic strings automaton %s matchlet %x in "
+				      "sample %u", found[j] ? "wrongly finds" : "misses",
+				      matchlet, i);
+		}
+	}
+	g_free (found);
+
+out:
+	g_array_free (expected, TRUE);
+	g_array_free (listed, TRUE);
+}
+
+/* The most data needed by the matchlets at 'first' and their children */
+static guint32
+matchlets_extent (Cache *cache, guint32 first, guint32 n_matchlets)
+{
+	guint32 extent = 0, i;
+
+	for (i = 0; i < n_matchlets; i++) {
+		guint32 matchlet = first + 32 * i;
+
+		extent = MAX (extent, card32 (cache, matchlet) +
+			      card32 (cache, matchlet + 4) +
+			      card32 (cache, matchlet + 12));
+		extent = MAX (extent, matchlets_extent (cache,
+			card32 (cache, matchlet + 28),
+			card32 (cache, matchlet + 24)));
+	}
+
+	return extent;
+}
+
+/* Each entry must be in one tier, with the extent of its rules, and give
+ * the same result on each sample when only given that much of it.
+ */
+static void
+check_magic_tiers (Cache *cache, GArray *samples)
+{
+	guint32 section, magic, entries, n_entries, n_tiers, tiers, list;
+	guint32 previous_extent = 0, i, j;
+	guint32 *extents;
+	gboolean *seen;
+
+	section = find_extension (cache, EXTENSION_MAGIC_TIERS);
+	if (section == 0) {
+		fail ("No magic tiers section");
+		return;
+	}
+
+	magic = card32 (cache, MAGIC_LIST_OFFSET);
+	entries = card32 (cache, magic + 8);
+	n_entries = card32 (cache, magic);
+	if (card32 (cache, section) != n_entries) {
+		fail ("Magic tiers have %u entries, expected %u",
+		      card32 (cache, section), n_entries);
+		return;
+	}
+
+	extents = g_new (guint32, n_entries);
+	seen = g_new0 (gboolean, n_entries);
+	for (i = 0; i < n_entries; i++) {
+		guint32 expected;
+
+		extents[i] = card32 (cache, section + 4 + 4 * i);
+		expected = matchlets_extent (cache,
+					     card32 (cache, entries + 16 * i + 12),
+					     card32 (cache, entries + 16 * i + 8));
+		if (extents[i] != expected)
+			fail ("Magic entry %u has extent %u, expected %u",
+			      i, extents[i], expected);
+	}
+
+	tiers = section + 4 + 4 * n_entries;
+	n_tiers = card32 (cache, tiers);
+	list = tiers + 4 + 12 * n_tiers;
+	for (i = 0; i < n_tiers; i++) {
+		guint32 extent = card32 (cache, tiers + 4 + 12 * i);
+		guint32 n = card32 (cache, tiers + 8 + 12 * i);
+		guint32 first = card32 (cache, tiers + 12 + 12 * i);
+		guint32 largest = 0;
+		gint previous = -1;
+
+		for (j = first; j < first + n; j++) {
+			guint32 entry = card32 (cache, list + 4 * j);
+
+			if ((gint) entry <= previous || entry >= n_entries ||
+			    seen[entry]) {
+				fail ("Bad entry %u in magic tier %u", entry, i);
+				continue;
+			}
+			seen[entry] = TRUE;
+			previous = entry;
+			largest = MAX (largest, extents[entry]);
+		}
+
+		if (extent != largest || extent <= previous_extent)
+			fail ("Magic tier %u has extent %u, expected %u",
+			      i, extent, largest);
+		previous_extent = extent;
+	}
+
+	for (i = 0; i < n_entries; i++)
+		if (!seen[i])
+			fail ("Magic entry %u isn't in any tier", i);
+
+	for (i = 0; i < samples->len; i++) {
+		Sample *sample = &g_array_index (samples, Sample, i);
+
+		for (j = 0; j < n_entries; j++) {
+			Sample start = *sample;
+
+			start.len = MIN (start.len, extents[j]);
+			if (magic_matches (cache, j, &start) !=
+			    magic_matches (cache, j, sample))
+				fail ("Magic entry %u needs more than %u bytes "
+				      "of sample %u", j, extents[j], i);
+		}
+	}
+
+	g_free (extents);
+	g_free (seen);
+}
+
+/* The byte at 'i' of the data (or mask) given by 'word' in an instruction */
+static guchar
+program_byte (Cache *cache, guint32 op, guint32 word, guint32 i)
+{
+	if (op & MAGIC_OP_INLINE)
+		return word >> (24 - 8 * i);
+
+	return cache->data[word + i];
+}
+
+/* Run the program of entry 'i' over 'sample'. Returns -1 if the program
+ * is invalid, otherwise whether the entry matches.
+ */
+static gint
+run_magic_program (Cache *cache, guint32 section, guint32 i,
+		   const Sample *sample)
+{
+	guint32 n_code, code, pc;
+
+	n_code = card32 (cache, section + 4);
+	code = section + 8 + 4 * card32 (cache, section);
+	pc = card32 (cache, section + 8 + 4 * i);
+
+	for (;;) {
+		guint32 op, data_length, start, range_length = 1, word_size = 1;
+		guint32 data, mask = 0;
+		guint32 fail, next, pos, j;
+		gboolean found = FALSE;
+
+		if (pc >= n_code)
+			return -1;
+		op = card32 (cache, code + 4 * pc) >> 24;
+		data_length = card32 (cache, code + 4 * pc) & 0xffffff;
+		if (op == MAGIC_OP_FAIL)
+			return FALSE;
+		if ((op & ~(MAGIC_OP_RANGE | MAGIC_OP_MASK | MAGIC_OP_INLINE |
+			    MAGIC_OP_ACCEPT | MAGIC_OP_WORD)) != MAGIC_OP_TEST ||
+		    ((op & MAGIC_OP_INLINE) && data_length > 4))
+			return -1;
+
+		next = pc + 1;
+		if (next + 3 + !!(op & MAGIC_OP_RANGE) + !!(op & MAGIC_OP_WORD) +
+		    !!(op & MAGIC_OP_MASK) > n_code)
+			return -1;
+		start = card32 (cache, code + 4 * next++);
+		if (op & MAGIC_OP_RANGE)
+			range_length = card32 (cache, code + 4 * next++);
+		if (op & MAGIC_OP_WORD)
+			word_size = card32 (cache, code + 4 * next++);
+		data = card32 (cache, code + 4 * next++);
+		if (op & MAGIC_OP_MASK)
+			mask = card32 (cache, code + 4 * next++);
+		fail = card32 (cache, code + 4 * next++);
+
+		/* Only going forwards, the program always ends */
+		if (fail != 0 && fail <= pc)
+			return -1;
+		if (!(op & MAGIC_OP_INLINE) &&
+		    (data + data_length > cache->size ||
+		     ((op & MAGIC_OP_MASK) && mask + data_length > cache->size)))
+			return -1;
+
+		for (pos = start; pos < start + range_length && !found; pos++) {
+			if (pos + data_length > sample->len)
+				break;
+
+			for (j = 0; j < data_length; j++) {
+				guint32 k = host_order_index (word_size,
+							      data_length, j);
+				guchar m = 0xff;
+
+				if (op & MAGIC_OP_MASK)
+					m = program_byte (cache, op, mask, k);
+				if ((program_byte (cache, op, data, k) & m) !=
+				    (sample->data[pos + j] & m))
+					break;
+			}
+			found = j == data_length;
+		}
+
+		if (found && (op & MAGIC_OP_ACCEPT))
+			return TRUE;
+		pc = found ? next : fail;
+	}
+}
+
+/* The magic programs must match exactly the samples that the magic
+ * entries do.
+ */
+static void
+check_magic_program (Cache *cache, GArray *samples)
+{
+	guint32 section, magic, n_entries, i, j;
+
+	section = find_extension (cache, EXTENSION_MAGIC_PROGRAM);
+	if (section == 0) {
+		fail ("No magic program section");
+		return;
+	}
+
+	magic = card32 (cache, MAGIC_LIST_OFFSET);
+	n_entries = card32 (cache, magic);
+	if (card32 (cache, section) != n_entries) {
+		fail ("Magic program section has %u entries, expected %u",
+		      card32 (cache, section), n_entries);
+		return;
+	}
+	if (card32 (cache, section + 4) == 0 ||
+	    card32 (cache, section + 8 + 4 * n_entries) >> 24 != MAGIC_OP_FAIL) {
+		fail ("Magic program code doesn't start with a fail");
+		return;
+	}
+
+	for (i = 0; i < samples->len; i++) {
+		const Sample *sample = &g_array_index (samples, Sample, i);
+
+		for (j = 0; j < n_entries; j++) {
+			gint res = run_magic_program (cache, section, j, sample);
+
+			if (res < 0) {
+				fail ("Invalid magic program for entry %u", j);
+				return;
+			}
+			if (res != magic_matches (cache, j, sample))
+				fail ("Magic program for entry %u %s sample %u, "
+				      "but the matchlets %s", j,
+				      res ? "matches" : "doesn't match", i,
+				      res ? "don't" : "do");
+		}
+	}
+}
+
+/* Add data matching each path from a top-level matchlet to a matchlet
+ * without children, starting from 'base'.
+ */
+static void
+add_matchlet_path_samples (Cache        *cache,
+			   guint32       matchlet,
+			   const guchar *base,
+			   guint32       max_extent,
+			   GArray       *samples)
+{
+	guint32 start, data_length, n_children, i;
+	Sample sample;
+
+	start = card32 (cache, matchlet);
+	data_length = card32 (cache, matchlet + 12);
+	if (start + data_length > max_extent)
+		return;
+
+	sample.len = max_extent;
+	sample.data = g_malloc (max_extent);
+	memcpy (sample.data, base, max_extent);
+	copy_matchlet_data (cache, matchlet, sample.data + start);
+
+	n_children = card32 (cache, matchlet + 24);
+	for (i = 0; i < n_children; i++)
+		add_matchlet_path_samples (cache,
+					   card32 (cache, matchlet + 28) + 32 * i,
+					   sample.data, max_extent, samples);
+
+	if (n_children == 0)
+		g_array_append_val (samples, sample);
+	else
+		g_free (sample.data);
+}
+
+static void
+add_path_samples (Cache *cache, GArray *samples)
+{
+	guint32 magic, n_entries, max_extent, i, j;
+	guchar *zeros;
+
+	magic = card32 (cache, MAGIC_LIST_OFFSET);
+	n_entries = card32 (cache, magic);
+	max_extent = card32 (cache, magic + 4);
+	zeros = g_malloc0 (max_extent);
+
+	for (i = 0; i < n_entries; i++) {
+		guint32 entry = card32 (cache, magic + 8) + 16 * i;
+
+		for (j = 0; j < card32 (cache, entry + 8); j++)
+			add_matchlet_path_samples (cache,
+						   card32 (cache, entry + 12) + 32 * j,
+						   zeros, max_extent, samples);
+	}
+
+	g_free (zeros);
+}
+
+/* Each magic entry must match the same samples as in 'reference', needing
+ * no more of the data to do so.
+ */
+static void
+check_reference_magic (Cache *cache, Cache *reference, GArray *samples)
+{
+	guint32 magic, other, n_entries, i, j;
+
+	magic = card32 (cache, MAGIC_LIST_OFFSET);
+	other = card32 (reference, MAGIC_LIST_OFFSET);
+	n_entries = card32 (cache, magic);
+	if (card32 (reference, other) != n_entries) {
+		fail ("Magic section has %u entries, reference has %u",
+		      n_entries, card32 (reference, other));
+		return;
+	}
+	if (card32 (cache, magic + 4) > card32 (reference, other + 4))
+		fail ("Magic section needs %u bytes, reference only needs %u",
+		      card32 (cache, magic + 4), card32 (reference, other + 4));
+
+	for (i = 0; i < n_entries; i++) {
+		guint32 entry = card32 (cache, magic + 8) + 16 * i;
+		guint32 other_entry = card32 (reference, other + 8) + 16 * i;
+
+		if (card32 (cache, entry) != card32 (reference, other_entry) ||
+		    strcmp (string_at (cache, card32 (cache, entry + 4)),
+			    string_at (reference, card32 (reference, other_entry + 4))) != 0) {
+			fail ("Magic entry %u is for %s, reference is for %s", i,
+			      string_at (cache, card32 (cache, entry + 4)),
+			      string_at (reference, card32 (reference, other_entry + 4)));
+			return;
+		}
+	}
+
+	for (i = 0; i < samples->len; i++) {
+		const Sample *sample = &g_array_index (samples, Sample, i);
+
+		for (j = 0; j < n_entries; j++)
+			if (magic_matches (cache, j, sample) !=
+			    magic_matches (reference, j, sample))
+				fail ("Magic entry %u (%s) %s sample %u, "
+				      "but not in the reference", j,
+				      string_at (cache, card32 (cache,
+					card32 (cache, magic + 8) + 16 * j + 4)),
+				      magic_matches (cache, j, sample) ?
+				      "matches" : "doesn't match", i);
+	}
+}
+
+/* The ancestors of each type must be exactly those found by following
+ * the parents list.
+ */
+static void
+check_ancestors (Cache *cache)
+{
+	guint32 section, n_types, i;
+	gboolean *seen;
+
+	section = find_extension (cache, EXTENSION_ANCESTORS);
+	if (section == 0) {
+		fail ("No ancestors section");
+		return;
+	}
+
+	n_types = card32 (cache, card32 (cache, TYPES_LIST_OFFSET));
+	if (card32 (cache, section) != n_types) {
+		fail ("Ancestors section has %u types, expected %u",
+		      card32 (cache, section), n_types);
+		return;
+	}
+
+	seen = g_new (gboolean, n_types);
+	for (i = 0; i < n_types; i++) {
+		const gchar *name;
+
+		name = string_at (cache, card32 (cache,
+			card32 (cache, TYPES_LIST_OFFSET) + 4 + 4 * i));
+		memset (seen, 0, n_types * sizeof (gboolean));
+		seen[i] = TRUE;
+		add_ancestors (cache, name, seen);
+		seen[i] = FALSE;
+
+		check_id_set (cache, section, i, seen, "ancestors");
+	}
+	g_free (seen);
+
+	check_descendants (cache, section);
+}
+
+int
+main (int argc, char **argv)
+{
+	GError *error = NULL;
+	gchar *contents, *reference_contents = NULL;
+	GArray *samples, *path_samples, *reference_samples;
+	Cache cache, reference;
+	int i;
+
+	if (argc > 2 && strcmp (argv[1], "--reference") == 0) {
+		if (!g_file_get_contents (argv[2], &reference_contents,
+					  &reference.size, &error)) {
+			g_printerr ("Failed to load %s: %s\n", argv[2], error->message);
+			g_error_free (error);
+			return 1;
+		}
+		reference.data = (const guchar *) reference_contents;
+		argc -= 2;
+		argv += 2;
+	}
+
+	if (argc < 2) {
+		g_printerr ("Usage: %s [--reference OTHER/mime.cache] "
+			    "MIME-DIR/mime.cache [FILE...]\n", argv[0]);
+		return 1;
+	}
+
+	if (!g_file_get_contents (argv[1], &contents, &cache.size, &error)) {
+		g_printerr ("Failed to load %s: %s\n", argv[1], error->message);
+		g_error_free (error);
+		return 1;
+	}
+	cache.data = (const guchar *) contents;
+
+	if (card32 (&cache, HEADER_SIZE) != EXTENSIONS_MAGIC)
+		fail ("No extension directory");
+	else {
+		check_hash_index (&cache, EXTENSION_ALIAS_HASH,
+				  ALIAS_LIST_OFFSET, 8, "Alias");
+		check_hash_index (&cache, EXTENSION_LITERAL_HASH,
+				  LITERAL_LIST_OFFSET, 12, "Literal");
+		check_ancestors (&cache);
+		check_parents (&cache);
+		check_type_ids (&cache);
+#ifndef G_OS_WIN32
+		check_glob_dfa (&cache);
+#endif
+
+		samples = g_array_new (FALSE, FALSE, sizeof (Sample));
+		add_magic_samples (&cache, samples);
+		for (i = 2; i < argc; i++) {
+			Sample sample;
+			guint32 max_extent;
+
+			/* Directories are skipped */
+			if (!g_file_get_contents (argv[i], (gchar **) &sample.data,
+						  &sample.len, NULL))
+				continue;
+
+			max_extent = card32 (&cache, card32 (&cache, MAGIC_LIST_OFFSET) + 4);
+			sample.len = MIN (sample.len, max_extent);
+			g_array_append_val (samples, sample);
+		}
+
+		check_magic_dispatch (&cache, samples);
+		check_magic_strings (&cache, samples);
+		check_magic_tiers (&cache, samples);
+		check_magic_program (&cache, samples);
+
+		/* The programs follow the children of each matchlet too */
+		path_samples = g_array_new (FALSE, FALSE, sizeof (Sample));
+		add_path_samples (&cache, path_samples);
+		check_magic_program (&cache, path_samples);
+		for (i = 0; i < path_samples->len; i++)
+			g_free (g_array_index (path_samples, Sample, i).data);
+		g_array_free (path_samples, TRUE);
+
+		if (reference_contents) {
+			check_reference_magic (&cache, &reference, samples);
+
+			/* Also exercise the rules as they were written */
+			reference_samples = g_array_new (FALSE, FALSE, sizeof (Sample));
+			add_path_samples (&reference, reference_samples);
+			check_reference_magic (&cache, &reference, reference_samples);
+			for (i = 0; i < reference_samples->len; i++)
+				g_free (g_array_index (reference_samples, Sample, i).data);
+			g_array_free (reference_samples, TRUE);
+		}
+
+		for (i = 0; i < samples->len; i++)
+			g_free (g_array_index (samples, Sample, i).data);
+		g_array_free (samples, TRUE);
+	}
+
+	g_free (contents);
+	g_free (reference_contents);
+
+	return failed ? 1 : 0;
+}
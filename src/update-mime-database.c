@@ -1,5 +1,9 @@
 #include <config.h>
 
+#ifdef HAVE_SYNCFS
+#define _GNU_SOURCE	/* for syncfs() */
+#endif
+
 #define N_(x) x
 #define _(x) (x)
 
@@ -7,6 +11,7 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <glib.h>
 #include <glib/gprintf.h>
@@ -15,6 +20,7 @@
 #include <dirent.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
+#include <libxml/xmlreader.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
@@ -37,6 +43,9 @@
 #define NOGLOBS "__NOGLOBS__"
 #define NOMAGIC "__NOMAGIC__"
 
+/* The most threads that --jobs may ask for */
+#define MAX_JOBS 1024
+
 #ifndef PATH_SEPARATOR
 # ifdef _WIN32
 #  define PATH_SEPARATOR ";"
@@ -85,10 +94,26 @@ typedef struct _TreeMatch TreeMatch;
 /* A parsed <glob> element */
 typedef struct _Glob Glob;
 
+/* What we know about one file in the packages directory */
+typedef struct _PackageStat PackageStat;
+
 struct _Type {
 	char *media;
 	char *subtype;
 
+	/* The full name ("media/subtype"), also the key in 'types' */
+	char *name;
+
+	/* Offset of 'name' in the string pool of mime.cache, set by
+	 * write_cache()
+	 */
+	guint cache_offset;
+
+	/* Index of the type in the types list of mime.cache, which the
+	 * extension sections use to refer to it. Set by write_cache().
+	 */
+	guint id;
+
 	/* Contains xmlNodes for elements that are being copied to the output.
 	 * That is, <comment>, <sub-class-of> and <alias> nodes, and anything
 	 * with an unknown namespace.
@@ -104,10 +129,15 @@ struct _Glob {
 	gboolean case_sensitive;
 };
 
+/* Magic, Match, TreeMagic and TreeMatch structures, and everything they
+ * point to, are allocated from the arena (see arena_alloc()). The children
+ * of each element are stored contiguously.
+ */
 struct _Magic {
 	int priority;
 	Type *type;
-	GList *matches;
+	Match *matches;
+	int n_matches;
 	gboolean nomagic;
 };
 
@@ -118,13 +148,15 @@ struct _Match {
 	int data_length;
 	char *data;
 	char *mask;
-	GList *matches;
+	Match *matches;
+	int n_matches;
 };
 
 struct _TreeMagic {
 	int priority;
 	Type *type;
-	GList *matches;
+	TreeMatch *matches;
+	int n_matches;
 };
 
 struct _TreeMatch {
@@ -135,7 +167,19 @@ struct _TreeMatch {
 	gint type;
 	char *mimetype;
 
-	GList *matches;
+	TreeMatch *matches;
+	int n_matches;
+};
+
+/* The stat fields are only used to avoid recomputing 'digest' for files
+ * that haven't been touched since the manifest was written.
+ */
+struct _PackageStat {
+	gint64 size;
+	gint64 mtime;
+	glong mtime_nsec;
+	guint64 inode;
+	gchar *digest;
 };
 
 /* Maps MIME type names to Types */
@@ -144,7 +188,7 @@ static GHashTable *types = NULL;
 /* Maps "namespaceURI localName" strings to Types */
 static GHashTable *namespace_hash = NULL;
 
-/* Maps glob patterns to Types */
+/* Maps glob patterns to GArrays of Globs */
 static GHashTable *globs_hash = NULL;
 
 /* 'magic' nodes */
@@ -165,15 +209,75 @@ static GHashTable *icon_hash = NULL;
 /* Maps MIME type names to icon names */
 static GHashTable *generic_icon_hash = NULL;
 
+/* The blocks of memory used by arena_alloc(), newest first, and the free
+ * space left at the end of the current one.
+ */
+static GSList *arena_blocks = NULL;
+static char *arena_next = NULL;
+static gsize arena_left = 0;
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct
+{
+	GSList *blocks;
+	char *next;
+	gsize left;
+} ArenaMark;
+
+/* While loading a source file, everything it adds to the tables above is
+ * also recorded here, so it can be saved in the package cache. NULL if
+ * we're not recording.
+ */
+static GString *recording = NULL;
+
+/* Set if the file being recorded can't be cached (e.g. it has errors) */
+static gboolean recording_failed = FALSE;
+
+/* Maps the strings already in 'recording' to their index */
+static GHashTable *recorded_strings = NULL;
+
+/* The kinds of record in the package cache. Each record applies to the type
+ * given by the last RECORD_TYPE.
+ */
+enum {
+	RECORD_TYPE = 1,
+	RECORD_GLOB,
+	RECORD_GLOB_DELETEALL,
+	RECORD_MAGIC,
+	RECORD_TREE_MAGIC,
+	RECORD_ALIAS,
+	RECORD_SUBCLASS,
+	RECORD_NAMESPACE,
+	RECORD_ICON,
+	RECORD_GENERIC_ICON,
+	RECORD_FIELD
+};
+
 /* Lists enabled log levels */
 static GLogLevelFlags enabled_log_levels = G_LOG_LEVEL_ERROR | G_LOG_LEVEL_CRITICAL | G_LOG_LEVEL_WARNING;
 
+/* Whether to simplify the magic rules written to mime.cache */
+static gboolean optimize_magic = TRUE;
+
 /* Static prototypes */
 static Magic *magic_new(xmlNode *node, Type *type, GError **error);
-static Match *match_new(void);
+static void match_init(Match *match);
 
 static TreeMagic *tree_magic_new(xmlNode *node, Type *type, GError **error);
 
+static FILE *fopen_gerror(const char *filename, GError **error);
+static gboolean fclose_gerror(FILE *f, GError **error);
+
+static void record_card32(guint32 n);
+static void record_string(const char *str);
+static void record_node(guint32 tag, xmlNode *node);
+static void record_magic(Magic *magic);
+static void record_tree_magic(TreeMagic *magic);
+static gboolean replay_package(const char *filename, GString *data);
+static gboolean package_unchanged(const char *filename, PackageStat *stat);
+static void free_cache_entry(gpointer data);
+
 static void g_log_handler (const gchar   *log_domain,
 			   GLogLevelFlags log_level,
 			   const gchar   *message,
@@ -198,7 +302,93 @@ fatal_gerror (GError *error)
 
 static void usage(const char *name)
 {
-	g_fprintf(stderr, _("Usage: %s [-hvVn] MIME-DIR\n"), name);
+	g_fprintf(stderr, _("Usage: %s [-hvVn] [-j JOBS] [--no-optimize-magic] "
+			    "MIME-DIR\n"), name);
+}
+
+/* Returns 'size' bytes of zeroed memory, which stays valid until
+ * arena_free_all() (or arena_reset() to an earlier mark).
+ */
+static gpointer arena_alloc(gsize size)
+{
+	char *mem;
+
+	size = (size + 7) & ~(gsize) 7;
+
+	if (size > ARENA_BLOCK_SIZE / 4)
+	{
+		/* Big allocations get a block to themselves */
+		mem = g_malloc0(size);
+		arena_blocks = g_slist_prepend(arena_blocks, mem);
+		return mem;
+	}
+
+	if (size > arena_left)
+	{
+		arena_next = g_malloc(ARENA_BLOCK_SIZE);
+		arena_left = ARENA_BLOCK_SIZE;
+		arena_blocks = g_slist_prepend(arena_blocks, arena_next);
+	}
+
+	mem = arena_next;
+	arena_next += size;
+	arena_left -= size;
+	memset(mem, 0, size);
+
+	return mem;
+}
+
+/* Copies 'len' bytes of 'data' into the arena */
+static gpointer arena_memdup(gconstpointer data, gsize len)
+{
+	gpointer mem;
+
+	mem = arena_alloc(len);
+	memcpy(mem, data, len);
+
+	return mem;
+}
+
+/* Like arena_memdup(), but adds a nul terminator */
+static char *arena_dup0(const char *data, gsize len)
+{
+	char *mem;
+
+	mem = arena_alloc(len + 1);
+	memcpy(mem, data, len);
+
+	return mem;
+}
+
+static char *arena_strdup(const char *str)
+{
+	return str ? arena_dup0(str, strlen(str)) : NULL;
+}
+
+static void arena_mark(ArenaMark *mark)
+{
+	mark->blocks = arena_blocks;
+	mark->next = arena_next;
+	mark->left = arena_left;
+}
+
+/* Frees everything allocated since arena_mark() set 'mark' */
+static void arena_reset(ArenaMark *mark)
+{
+	while (arena_blocks != mark->blocks)
+	{
+		g_free(arena_blocks->data);
+		arena_blocks = g_slist_delete_link(arena_blocks, arena_blocks);
+	}
+	arena_next = mark->next;
+	arena_left = mark->left;
+}
+
+static void arena_free_all(void)
+{
+	ArenaMark empty = { NULL, NULL, 0 };
+
+	arena_reset(&empty);
 }
 
 static void free_type(gpointer data)
@@ -207,6 +397,7 @@ static void free_type(gpointer data)
 
 	g_free(type->media);
 	g_free(type->subtype);
+	g_free(type->name);
 
 	xmlFreeDoc(type->output);
 
@@ -251,7 +442,9 @@ static Type *get_type(const char *name, GError **error)
 	type = g_new(Type, 1);
 	type->media = g_strndup(name, slash - name);
 	type->subtype = g_strdup(slash + 1);
-	g_hash_table_insert(types, g_strdup(name), type);
+	type->name = g_strdup(name);
+	type->cache_offset = 0;
+	g_hash_table_insert(types, type->name, type);
 
 	type->output = xmlNewDoc((xmlChar *)"1.0");
 	root = xmlNewDocNode(type->output, NULL, (xmlChar *)"mime-type", NULL);
@@ -344,6 +537,111 @@ static gboolean get_boolean_attribute(xmlNode *node, const char* name)
 	return FALSE;
 }
 
+static void free_glob_array(gpointer data)
+{
+	g_array_free((GArray *) data, TRUE);
+}
+
+/* Add a glob for 'type'. Takes ownership of 'pattern' */
+static void add_glob(Type *type, char *pattern, int weight,
+		     gboolean case_sensitive, gboolean noglob)
+{
+	Glob glob;
+	GArray *globs;
+	char *key;
+
+	if (recording)
+	{
+		record_card32(noglob ? RECORD_GLOB_DELETEALL : RECORD_GLOB);
+		if (!noglob)
+		{
+			record_string(pattern);
+			record_card32(weight);
+			record_card32(case_sensitive);
+		}
+	}
+
+	/* The Globs for a pattern share the hash table's key */
+	if (g_hash_table_lookup_extended(globs_hash, pattern,
+					 (gpointer *) &key, (gpointer *) &globs))
+	{
+		g_free(pattern);
+	}
+	else
+	{
+		key = pattern;
+		globs = g_array_sized_new(FALSE, FALSE, sizeof(Glob), 1);
+		g_hash_table_insert(globs_hash, key, globs);
+	}
+
+	glob.pattern = key;
+	glob.type = type;
+	glob.weight = weight;
+	glob.noglob = noglob;
+	glob.case_sensitive = case_sensitive;
+	g_array_append_val(globs, glob);
+}
+
+/* Add a rule to magic_array. Takes ownership of 'magic' */
+static void add_magic(Magic *magic)
+{
+	g_ptr_array_add(magic_array, magic);
+
+	if (recording)
+		record_magic(magic);
+}
+
+/* Add a rule to tree_magic_array. Takes ownership of 'magic' */
+static void add_tree_magic(TreeMagic *magic)
+{
+	g_ptr_array_add(tree_magic_array, magic);
+
+	if (recording)
+		record_tree_magic(magic);
+}
+
+/* Make 'alias' an alias for 'type' */
+static void add_type_alias(Type *type, const char *alias)
+{
+	g_hash_table_insert(alias_hash, g_strdup(alias), type);
+
+	if (recording)
+	{
+		record_card32(RECORD_ALIAS);
+		record_string(alias);
+	}
+}
+
+/* Make 'type' a subclass of 'parent' */
+static void add_subclass(Type *type, const char *parent)
+{
+	GSList *list, *nlist;
+
+	list = g_hash_table_lookup(subclass_hash, type->name);
+	nlist = g_slist_append (list, g_strdup(parent));
+	if (list == NULL)
+		g_hash_table_insert(subclass_hash, g_strdup(type->name), nlist);
+
+	if (recording)
+	{
+		record_card32(RECORD_SUBCLASS);
+		record_string(parent);
+	}
+}
+
+/* Set the icon (or the generic icon) for 'type' */
+static void add_icon(Type *type, const char *icon, gboolean generic)
+{
+	g_hash_table_insert(generic ? generic_icon_hash : icon_hash,
+			    g_strdup (type->name), g_strdup (icon));
+
+	if (recording)
+	{
+		record_card32(generic ? RECORD_GENERIC_ICON : RECORD_ICON);
+		record_string(icon);
+	}
+}
+
 /* Process a <root-XML> element by adding a rule to namespace_hash */
 static void add_namespace(Type *type, const char *namespaceURI,
 			  const char *localName, GError **error)
@@ -383,6 +681,13 @@ static void add_namespace(Type *type, const char *namespaceURI,
 	g_hash_table_insert(namespace_hash,
 			g_strconcat(namespaceURI, " ", localName, NULL),
 			type);
+
+	if (recording)
+	{
+		record_card32(RECORD_NAMESPACE);
+		record_string(namespaceURI);
+		record_string(localName);
+	}
 }
 
 /* 'field' was found in the definition of 'type' and has the freedesktop.org
@@ -414,17 +719,9 @@ static gboolean process_freedesktop_node(Type *type, xmlNode *field,
 
 		if (pattern && *pattern)
 		{
-			Glob *glob;
 			char *pat = case_sensitive ? g_strdup (pattern) : g_ascii_strdown (pattern, -1);
-			GList *list = g_hash_table_lookup (globs_hash, pat);
-			
-			glob = g_new0 (Glob, 1);
-			glob->pattern = pat;
-			glob->type = type;
-			glob->weight = weight;
-			glob->case_sensitive = case_sensitive;
-			list = g_list_append (list, glob);
-			g_hash_table_insert(globs_hash, g_strdup (glob->pattern), list);
+
+			add_glob(type, pat, weight, case_sensitive, FALSE);
 			xmlFree(pattern);
 			copy_to_xml = TRUE;
 		}
@@ -439,17 +736,7 @@ static gboolean process_freedesktop_node(Type *type, xmlNode *field,
 	}
 	else if (strcmp((char *)field->name, "glob-deleteall") == 0)
 	{
-		Glob *glob;
-		GList *list = g_hash_table_lookup (globs_hash, NOGLOBS);
-
-		glob = g_new0 (Glob, 1);
-		glob->pattern = g_strdup (NOGLOBS);
-		glob->type = type;
-		glob->weight = 0;
-		glob->noglob = TRUE;
-		glob->case_sensitive = FALSE;
-		list = g_list_append (list, glob);
-		g_hash_table_insert(globs_hash, g_strdup (glob->pattern), list);
+		add_glob(type, g_strdup (NOGLOBS), 0, FALSE, TRUE);
 		copy_to_xml = TRUE;
 	}
 	else if (strcmp((char *)field->name, "magic") == 0)
@@ -461,7 +748,7 @@ static gboolean process_freedesktop_node(Type *type, xmlNode *field,
 		if (!*error)
 		{
 			g_return_val_if_fail(magic != NULL, FALSE);
-			g_ptr_array_add(magic_array, magic);
+			add_magic(magic);
 		}
 		else
 			g_return_val_if_fail(magic == NULL, FALSE);
@@ -471,16 +758,18 @@ static gboolean process_freedesktop_node(Type *type, xmlNode *field,
 		Magic *magic;
 		Match *match;
 
-		magic = g_new0(Magic, 1);
+		magic = arena_alloc(sizeof(Magic));
 		magic->priority = 0;
 		magic->type = type;
 		magic->nomagic = TRUE;
-		match = match_new ();
-		match->data = g_strdup (NOMAGIC);
+		match = arena_alloc(sizeof(Match));
+		match_init (match);
+		match->data = arena_strdup (NOMAGIC);
 		match->data_length = strlen (NOMAGIC);
-		magic->matches = g_list_prepend (NULL, match);
+		magic->matches = match;
+		magic->n_matches = 1;
 
-		g_ptr_array_add(magic_array, magic);
+		add_magic(magic);
 	}
 	else if (strcmp((char *)field->name, "treemagic") == 0)
 	{
@@ -491,7 +780,7 @@ static gboolean process_freedesktop_node(Type *type, xmlNode *field,
 		if (!*error)
 		{
 			g_return_val_if_fail(magic != NULL, FALSE);
-			g_ptr_array_add(tree_magic_array, magic);
+			add_tree_magic(magic);
 		}
 		else
 			g_return_val_if_fail(magic == NULL, FALSE);
@@ -505,31 +794,15 @@ static gboolean process_freedesktop_node(Type *type, xmlNode *field,
 	{
 		char *other_type;
 		gboolean valid;
-		GSList *list, *nlist;
 
 		other_type = my_xmlGetNsProp(field, "type", NULL);
 		valid = other_type && strchr(other_type, '/');
 		if (valid)
 		{
-			char *typename;
-
-			typename = g_strdup_printf("%s/%s", 
-						   type->media,
-						   type->subtype);
-			
 			if (strcmp((char *)field->name, "alias") == 0)
-				g_hash_table_insert(alias_hash,
-						    g_strdup(other_type), type);
-				
+				add_type_alias(type, other_type);
 			else
-			{
-				list = g_hash_table_lookup(subclass_hash, typename);
-				nlist = g_slist_append (list, g_strdup(other_type));
-				if (list == NULL)
-					g_hash_table_insert(subclass_hash, 
-							    g_strdup(typename), nlist);
-			}
-			g_free(typename);
+				add_subclass(type, other_type);
 			xmlFree(other_type);
 
 			copy_to_xml = TRUE; /* Copy through */
@@ -560,23 +833,13 @@ static gboolean process_freedesktop_node(Type *type, xmlNode *field,
 		 strcmp((char *)field->name, "icon") == 0) 
 	{
 		char *icon;
-		char *typename;
 
 		icon = my_xmlGetNsProp(field, "name", NULL);
 
 		if (icon) 
 		{
-			typename = g_strdup_printf("%s/%s",
-						   type->media,
-						   type->subtype);
-
-			if (strcmp((char *)field->name, "icon") == 0)
-				g_hash_table_insert(icon_hash,
-						    typename, g_strdup (icon));
-			else
-				g_hash_table_insert(generic_icon_hash,
-						    typename, g_strdup (icon));
-
+			add_icon(type, icon,
+				 strcmp((char *)field->name, "icon") != 0);
 			xmlFree (icon);
 
 			copy_to_xml = TRUE; /* Copy through */
@@ -639,6 +902,20 @@ static void remove_old(Type *type, xmlNode *new)
 	xmlFree(lang);
 }
 
+/* Add 'copy', a copy of an element from a source file that is being copied
+ * to the output, to the XML file for 'type'. It replaces any older node
+ * with the same meaning.
+ */
+static void add_field(Type *type, xmlNode *copy)
+{
+	if (recording)
+		record_node(RECORD_FIELD, copy);
+
+	remove_old(type, copy);
+
+	xmlAddChild(xmlDocGetRootElement(type->output), copy);
+}
+
 /* 'node' is a <mime-type> node from a source file, whose type is 'type'.
  * Process all the child elements, setting 'error' if anything goes wrong.
  */
@@ -686,25 +963,97 @@ static void load_type(Type *type, xmlNode *node, GError **error)
 			}
 		}
 
-		remove_old(type, field);
+		add_field(type, copy);
+	}
+}
+
+/* Check that 'root' is a <mime-info> element in the freedesktop.org
+ * namespace. If not, warns and returns FALSE.
+ */
+static gboolean check_source_root(const char *filename, xmlNode *root)
+{
+	if (root->ns == NULL || xmlStrcmp(root->ns->href, FREE_NS) != 0)
+	{
+		g_warning("Wrong namespace on document element in '%s' (should be %s)", filename, FREE_NS);
+		return FALSE;
+	}
+
+	if (strcmp((char *)root->name, "mime-info") != 0)
+	{
+		g_warning("Root element <%s> is not <mime-info> (in '%s')", root->name, filename);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* 'node' is a child element of the <mime-info> element of 'filename'.
+ * Adds the type it defines to the database.
+ */
+static void load_source_node(const char *filename, xmlNode *node)
+{
+	Type *type = NULL;
+	char *type_name = NULL;
+	GError *error = NULL;
+
+	if (!match_node(node, (char *)FREE_NS, "mime-type"))
+		g_set_error(&error, MIME_ERROR, 0,
+			_("Excepted <mime-type>, but got wrong name "
+			  "or namespace"));
+
+	if (!error)
+	{
+		type_name = my_xmlGetNsProp(node, "type", NULL);
+
+		if (!type_name)
+			g_set_error(&error, MIME_ERROR, 0,
+				_("<mime-type> element has no 'type' "
+				  "attribute"));
+	}
+
+	if (type_name)
+	{
+		type = get_type(type_name, &error);
+		if (type && recording)
+		{
+			record_card32(RECORD_TYPE);
+			record_string(type_name);
+		}
+		xmlFree(type_name);
+	}
+
+	if (!error)
+	{
+		g_return_if_fail(type != NULL);
+		load_type(type, node, &error);
+	}
+	else
+		g_return_if_fail(type == NULL);
 
-		xmlAddChild(xmlDocGetRootElement(type->output), copy);
+	if (error)
+	{
+		g_warning("Error in type '%s/%s' (in %s): %s.",
+			  type ? type->media : _("unknown"),
+			  type ? type->subtype : _("unknown"),
+			  filename, error->message);
+		g_error_free(error);
+		/* Don't cache the file, so the error is reported again */
+		recording_failed = TRUE;
 	}
 }
 
-/* Parse 'filename' as an XML file and add all the information to the
+/* Add all the information in 'doc', which was parsed from 'filename', to the
  * database. If called more than once, information read in later calls
- * overrides information read previously.
+ * overrides information read previously. Frees 'doc'.
  */
-static void load_source_file(const char *filename)
+static void load_source_doc(const char *filename, xmlDoc *doc)
 {
-	xmlDoc *doc;
 	xmlNode *root, *node;
 
-	doc = xmlParseFile(filename);
 	if (!doc)
 	{
 		g_warning(_("Failed to parse '%s'"), filename);
+		recording_failed = TRUE;
 		return;
 	}
 
@@ -712,187 +1061,353 @@ static void load_source_file(const char *filename)
 
 	root = xmlDocGetRootElement(doc);
 
-	if (root->ns == NULL || xmlStrcmp(root->ns->href, FREE_NS) != 0)
+	if (!check_source_root(filename, root))
 	{
-		g_warning("Wrong namespace on document element in '%s' (should be %s)", filename, FREE_NS);
+		recording_failed = TRUE;
 		goto out;
 	}
 
-	if (strcmp((char *)root->name, "mime-info") != 0)
+	for (node = root->xmlChildrenNode; node; node = node->next)
 	{
-		g_warning("Root element <%s> is not <mime-info> (in '%s')", root->name, filename);
-		goto out;
+		if (node->type == XML_ELEMENT_NODE)
+			load_source_node(filename, node);
 	}
+out:
+	xmlFreeDoc(doc);
+}
 
-	for (node = root->xmlChildrenNode; node; node = node->next)
+/* Parse 'filename' as an XML file and add all the information to the
+ * database, like load_source_doc(). The file is read with a streaming
+ * parser: only the <mime-type> element currently being loaded is kept in
+ * memory, and it is freed again before the next one is read.
+ * If the file turns out not to be well-formed, the types before the
+ * error have already been loaded.
+ */
+static void load_source_file(const char *filename)
+{
+	xmlTextReader *reader;
+	int ret;
+
+	reader = xmlReaderForFile(filename, NULL, 0);
+	if (!reader)
 	{
-		Type *type = NULL;
-		char *type_name = NULL;
-		GError *error = NULL;
+		g_warning(_("Failed to parse '%s'"), filename);
+		recording_failed = TRUE;
+		return;
+	}
 
-		if (node->type != XML_ELEMENT_NODE)
-			continue;
+	/* Skip to the document element */
+	while ((ret = xmlTextReaderRead(reader)) == 1 &&
+	       xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT)
+		;
 
-		if (!match_node(node, (char *)FREE_NS, "mime-type"))
-			g_set_error(&error, MIME_ERROR, 0,
-				_("Excepted <mime-type>, but got wrong name "
-				  "or namespace"));
+	if (ret != 1)
+	{
+		g_warning(_("Failed to parse '%s'"), filename);
+		recording_failed = TRUE;
+		goto out;
+	}
 
-		if (!error)
-		{
-			type_name = my_xmlGetNsProp(node, "type", NULL);
+	g_message("Parsing source file %s...", filename);
 
-			if (!type_name)
-				g_set_error(&error, MIME_ERROR, 0,
-					_("<mime-type> element has no 'type' "
-					  "attribute"));
-		}
+	if (!check_source_root(filename, xmlTextReaderCurrentNode(reader)))
+	{
+		recording_failed = TRUE;
+		goto out;
+	}
 
-		if (type_name)
-		{
-			type = get_type(type_name, &error);
-			xmlFree(type_name);
-		}
+	if (xmlTextReaderIsEmptyElement(reader))
+		goto out;
+
+	ret = xmlTextReaderRead(reader);
+	while (ret == 1 && xmlTextReaderDepth(reader) > 0)
+	{
+		xmlNode *node;
 
-		if (!error)
+		if (xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT)
 		{
-			g_return_if_fail(type != NULL);
-			load_type(type, node, &error);
+			ret = xmlTextReaderRead(reader);
+			continue;
 		}
-		else
-			g_return_if_fail(type == NULL);
 
-		if (error)
+		node = xmlTextReaderExpand(reader);
+		if (!node)
 		{
-			g_warning("Error in type '%s/%s' (in %s): %s.",
-				  type ? type->media : _("unknown"),
-				  type ? type->subtype : _("unknown"),
-				  filename, error->message);
-			g_error_free(error);
+			ret = -1;
+			break;
 		}
+
+		load_source_node(filename, node);
+
+		/* Skip past (and free) the subtree we just loaded */
+		ret = xmlTextReaderNext(reader);
 	}
-out:
-	xmlFreeDoc(doc);
-}
 
-/* Used as the sort function for sorting GPtrArrays */
-static gint strcmp2(gconstpointer a, gconstpointer b)
-{
-	const char *aa = *(char **) a;
-	const char *bb = *(char **) b;
+	/* Check the rest of the file is well-formed too */
+	while (ret == 1)
+		ret = xmlTextReaderRead(reader);
 
-	return strcmp(aa, bb);
+	if (ret == -1)
+	{
+		g_warning(_("Failed to parse '%s'"), filename);
+		recording_failed = TRUE;
+	}
+out:
+	xmlFreeTextReader(reader);
 }
 
-/* 'path' should be a 'packages' directory. Loads the information from
- * every file in the directory.
+/* A source file to be loaded. If the package cache has an entry for its
+ * contents, that is used instead of parsing it again.
  */
-static void scan_source_dir(const char *path)
+typedef struct
 {
-	DIR *dir;
-	struct dirent *ent;
 	char *filename;
-	GPtrArray *files;
-	int i;
-	gboolean have_override = FALSE;
+	PackageStat *stat;	/* NULL if the file couldn't be read */
+	GString *cached;	/* Entry from the old package cache, or NULL */
+	GString *recorded;	/* Entry for the new package cache, or NULL */
 
-	dir = opendir(path);
-	if (!dir)
+	/* Used when the file is parsed by a worker thread (--jobs) */
+	xmlDoc *doc;
+	gboolean done;
+} ParseJob;
+
+static GMutex parse_lock;
+static GCond parse_cond;
+
+/* Load 'job' into the database. Uses the cached entry if there is a valid
+ * one. Otherwise, loads the document parsed by a worker thread, or parses
+ * the file now, recording the result for the new package cache.
+ */
+static void load_job(ParseJob *job)
+{
+	if (job->cached && replay_package(job->filename, job->cached))
 	{
-		perror("scan_source_dir");
-		exit(EXIT_FAILURE);
+		job->recorded = g_string_new_len(job->cached->str,
+						 job->cached->len);
+		return;
 	}
 
-	files = g_ptr_array_new();
-	while ((ent = readdir(dir)))
+	if (job->stat)
 	{
-		int l;
-		l = strlen(ent->d_name);
-		if (l < 4 || strcmp(ent->d_name + l - 4, ".xml") != 0)
-			continue;
-		if (strcmp(ent->d_name, "Override.xml") == 0)
-		{
-			have_override = TRUE;
-			continue;
-		}
-		g_ptr_array_add(files, g_strdup(ent->d_name));
+		recording = g_string_new(NULL);
+		recorded_strings = g_hash_table_new_full(g_str_hash,
+							 g_str_equal,
+							 g_free, NULL);
+		recording_failed = FALSE;
 	}
-	closedir(dir);
 
-	g_ptr_array_sort(files, strcmp2);
+	if (job->done)
+		load_source_doc(job->filename, job->doc);
+	else
+		load_source_file(job->filename);
 
-	if (have_override)
-		g_ptr_array_add(files, g_strdup("Override.xml"));
+	if (recording)
+	{
+		/* Only cache what we read if the file wasn't changed since
+		 * we took its digest.
+		 */
+		if (!recording_failed &&
+		    package_unchanged(job->filename, job->stat))
+			job->recorded = recording;
+		else
+			g_string_free(recording, TRUE);
+		recording = NULL;
+		g_hash_table_destroy(recorded_strings);
+		recorded_strings = NULL;
+	}
+}
 
-	for (i = 0; i < files->len; i++)
+/* Thread pool function: parse one source file, without touching any of
+ * the global tables. The result is merged later by the main thread.
+ */
+static void parse_source_file(gpointer data, gpointer user_data)
+{
+	ParseJob *job = (ParseJob *) data;
+	xmlDoc *doc;
+
+	doc = xmlParseFile(job->filename);
+
+	g_mutex_lock(&parse_lock);
+	job->doc = doc;
+	job->done = TRUE;
+	g_cond_broadcast(&parse_cond);
+	g_mutex_unlock(&parse_lock);
+}
+
+/* Parse the 'n' files in 'jobs' using 'n_jobs' threads. The parsed
+ * documents are loaded into the database in the same order as the files are
+ * given, as soon as each one becomes available, so the result is the same as
+ * calling load_job() on each file in turn. Files with a cached entry aren't
+ * parsed at all.
+ */
+static void load_source_files_parallel(ParseJob *jobs, int n, int n_jobs)
+{
+	GThreadPool *pool;
+	GError *error = NULL;
+	int i;
+
+	/* Must be done before libxml is used from several threads */
+	xmlInitParser();
+
+	pool = g_thread_pool_new(parse_source_file, NULL, n_jobs, TRUE, &error);
+	if (!pool)
+		fatal_gerror(error);
+
+	for (i = 0; i < n; i++)
 	{
-		gchar *leaf = (gchar *) files->pdata[i];
+		if (!jobs[i].cached)
+			g_thread_pool_push(pool, &jobs[i], NULL);
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		if (!jobs[i].cached)
+		{
+			g_mutex_lock(&parse_lock);
+			while (!jobs[i].done)
+				g_cond_wait(&parse_cond, &parse_lock);
+			g_mutex_unlock(&parse_lock);
+		}
 
-		filename = g_strconcat(path, "/", leaf, NULL);
-		load_source_file(filename);
-		g_free(filename);
+		load_job(&jobs[i]);
 	}
 
-	for (i = 0; i < files->len; i++)
-		g_free(files->pdata[i]);
-	g_ptr_array_free(files, TRUE);
+	g_thread_pool_free(pool, FALSE, TRUE);
 }
 
-static gboolean save_xml_file(xmlDocPtr doc, const gchar *filename, GError **error)
+/* Used as the sort function for sorting GPtrArrays */
+static gint strcmp2(gconstpointer a, gconstpointer b)
+{
+	const char *aa = *(char **) a;
+	const char *bb = *(char **) b;
+
+	return strcmp(aa, bb);
+}
+
+/* Sorts a GPtrArray of Types by name */
+static gint cmp_type_name(gconstpointer a, gconstpointer b)
+{
+	const Type *aa = *(Type **) a;
+	const Type *bb = *(Type **) b;
+
+	return strcmp(aa->name, bb->name);
+}
+
+/* 'path' should be a 'packages' directory. Loads the information from
+ * every file in the directory. If 'n_jobs' is greater than one, the files
+ * are parsed concurrently using that many threads.
+ * 'stats' gives the digest of each file, as returned by
+ * scan_package_stats(). Files whose digest has an entry in 'old_cache'
+ * are loaded from there instead of being parsed. Returns the entries
+ * for the new package cache.
+ */
+static GHashTable *scan_source_dir(const char *path, int n_jobs,
+				   GHashTable *stats, GHashTable *old_cache)
 {
-#if LIBXML_VERSION > 20400
-	if (xmlSaveFormatFileEnc(filename, doc, "utf-8", 1) < 0)
+	DIR *dir;
+	struct dirent *ent;
+	GPtrArray *files;
+	ParseJob *jobs;
+	GHashTable *new_cache;
+	int i;
+	gboolean have_override = FALSE;
+
+	dir = opendir(path);
+	if (!dir)
 	{
-		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
-			    "Failed to write XML file; For permission problems, try rerunning as root");
-		return FALSE;
+		perror("scan_source_dir");
+		exit(EXIT_FAILURE);
 	}
-#else
-	FILE *out;
-	
-	out = fopen_gerror(filename, error);
-	if (!out)
-		return FALSE;
 
-	xmlDocDump(out, doc);  /* Some versions return void */
+	files = g_ptr_array_new();
+	while ((ent = readdir(dir)))
+	{
+		int l;
+		l = strlen(ent->d_name);
+		if (l < 4 || strcmp(ent->d_name + l - 4, ".xml") != 0)
+			continue;
+		if (strcmp(ent->d_name, "Override.xml") == 0)
+		{
+			have_override = TRUE;
+			continue;
+		}
+		g_ptr_array_add(files, g_strdup(ent->d_name));
+	}
+	closedir(dir);
+
+	g_ptr_array_sort(files, strcmp2);
 
-	if (!fclose_gerror(out, error))
-		return FALSE;
-#endif
+	if (have_override)
+		g_ptr_array_add(files, g_strdup("Override.xml"));
 
-	return TRUE;
+	jobs = g_new0(ParseJob, files->len);
+	for (i = 0; i < files->len; i++)
+	{
+		gchar *leaf = (gchar *) files->pdata[i];
+
+		jobs[i].filename = g_strconcat(path, "/", leaf, NULL);
+		jobs[i].stat = g_hash_table_lookup(stats, leaf);
+		if (jobs[i].stat && old_cache)
+			jobs[i].cached = g_hash_table_lookup(old_cache,
+							jobs[i].stat->digest);
+	}
+
+	if (n_jobs > 1 && files->len > 1)
+		load_source_files_parallel(jobs, files->len, n_jobs);
+	else
+	{
+		for (i = 0; i < files->len; i++)
+			load_job(&jobs[i]);
+	}
+
+	new_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+					  g_free, free_cache_entry);
+	for (i = 0; i < files->len; i++)
+	{
+		if (jobs[i].recorded)
+			g_hash_table_replace(new_cache,
+					     g_strdup(jobs[i].stat->digest),
+					     jobs[i].recorded);
+		g_free(jobs[i].filename);
+		g_free(files->pdata[i]);
+	}
+	g_free(jobs);
+	g_ptr_array_free(files, TRUE);
+
+	return new_cache;
 }
 
-/* Write out globs for one pattern to the 'globs' file */
-static void write_out_glob(GList *globs, FILE *stream)
+
+/* Write out the globs in 'globs' to the 'globs' file */
+static void write_out_glob(GPtrArray *globs, GString *out)
 {
-	GList *list;
 	Glob *glob;
 	Type *type;
+	int i;
 
-	for (list = globs; list; list = list->next) {
-		glob = (Glob *)list->data;
+	for (i = 0; i < globs->len; i++) {
+		glob = (Glob *)globs->pdata[i];
 		type = glob->type;
 		if (strchr(glob->pattern, '\n'))
 			g_warning("Glob patterns can't contain literal newlines "
 				  "(%s in type %s/%s)", glob->pattern,
 				  type->media, type->subtype);
 		else
-			g_fprintf(stream, "%s/%s:%s\n",
+			g_string_append_printf(out, "%s/%s:%s\n",
 				type->media, type->subtype, glob->pattern);
 	}
 }
 
-/* Write out globs and weights for one pattern to the 'globs2' file */
-static void write_out_glob2(GList *globs, FILE *stream)
+/* Write out the globs in 'globs', with weights, to the 'globs2' file */
+static void write_out_glob2(GPtrArray *globs, GString *out)
 {
-	GList *list;
 	Glob *glob;
 	Type *type;
 	gboolean need_flags;
+	int i;
 
-	for (list = globs ; list; list = list->next) {
-		glob = (Glob *)list->data;
+	for (i = 0; i < globs->len; i++) {
+		glob = (Glob *)globs->pdata[i];
 		type = glob->type;
 		if (strchr(glob->pattern, '\n'))
 			g_warning("Glob patterns can't contain literal newlines "
@@ -905,13 +1420,13 @@ static void write_out_glob2(GList *globs, FILE *stream)
 				need_flags = TRUE;
 
 			if (need_flags) {
-				g_fprintf(stream, "%d:%s/%s:%s%s\n",
+				g_string_append_printf(out, "%d:%s/%s:%s%s\n",
 						  glob->weight, type->media, type->subtype, glob->pattern,
 						  glob->case_sensitive ? ":cs" : "");
 			}
 
 			/* Always write the line without the flags, for older parsers */
-			g_fprintf(stream, "%d:%s/%s:%s\n",
+			g_string_append_printf(out, "%d:%s/%s:%s\n",
 					  glob->weight, type->media, type->subtype, glob->pattern);
 		}
 	}
@@ -919,15 +1434,18 @@ static void write_out_glob2(GList *globs, FILE *stream)
 
 static void collect_glob2(gpointer key, gpointer value, gpointer data)
 {
-	GList **listp = data;
+	GArray *globs = value;
+	GPtrArray *all = data;
+	int i;
 
-	*listp = g_list_concat (*listp, g_list_copy ((GList *)value));
+	for (i = 0; i < globs->len; i++)
+		g_ptr_array_add(all, &g_array_index(globs, Glob, i));
 }
 
-static int compare_glob_by_weight (gpointer a, gpointer b)
+static int compare_glob_by_weight (gconstpointer a, gconstpointer b)
 {
-	Glob *ag = (Glob *)a;
-	Glob *bg = (Glob *)b;
+	Glob *ag = *(Glob **)a;
+	Glob *bg = *(Glob **)b;
 
 	if (ag->noglob || bg->noglob)
 		return bg->noglob - ag->noglob;
@@ -943,18 +1461,38 @@ set_error_from_errno (GError **error)
 			    g_strerror(errsv));
 }
 
-#ifdef HAVE_FDATASYNC
-static gboolean
-sync_enabled(void)
+/* How the new files are made durable before they replace the old ones.
+ * Set with PKGSYSTEM_ENABLE_FSYNC: "0" for no syncing at all, "batch" to
+ * write every file first, sync them all at once and then rename them,
+ * anything else (or unset) to sync each file as it is replaced.
+ */
+typedef enum
+{
+	SYNC_NONE,
+	SYNC_EACH_FILE,
+	SYNC_BATCH,
+} SyncMode;
+
+/* In SYNC_BATCH mode, the '.new' files waiting for flush_updates() */
+static GPtrArray *pending_updates = NULL;
+static GMutex pending_updates_lock;
+
+static SyncMode
+sync_mode(void)
 {
+#ifdef HAVE_FDATASYNC
 	const char *env;
 
 	env = g_getenv("PKGSYSTEM_ENABLE_FSYNC");
 	if (!env)
-		return TRUE;
-	return atoi(env);
-}
+		return SYNC_EACH_FILE;
+	if (strcmp(env, "batch") == 0)
+		return SYNC_BATCH;
+	return atoi(env) ? SYNC_EACH_FILE : SYNC_NONE;
+#else
+	return SYNC_NONE;
 #endif
+}
 
 static int
 sync_file(const gchar *pathname, GError **error)
@@ -962,9 +1500,6 @@ sync_file(const gchar *pathname, GError **error)
 #ifdef HAVE_FDATASYNC
 	int fd;
 
-	if (!sync_enabled())
-		return 0;
-
 	fd = open(pathname, O_RDWR);
 	if (fd == -1)
 	{
@@ -987,8 +1522,37 @@ sync_file(const gchar *pathname, GError **error)
 	return 0;
 }
 
+/* Make the entries of directory 'path' durable (e.g. after renames) */
+static int
+sync_dir(const gchar *path, GError **error)
+{
+#ifdef HAVE_FDATASYNC
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+	{
+		set_error_from_errno(error);
+		return -1;
+	}
+	if (fsync(fd) == -1)
+	{
+		set_error_from_errno(error);
+		close(fd);
+		return -1;
+	}
+	if (close(fd) == -1)
+	{
+		set_error_from_errno(error);
+		return -1;
+	}
+#endif
+
+	return 0;
+}
+
 /* Renames pathname by removing the .new extension */
-static gboolean atomic_update(const gchar *pathname, GError **error)
+static gboolean rename_new_file(const gchar *pathname, GError **error)
 {
 	gboolean ret = FALSE;
 	gchar *new_name = NULL;
@@ -1000,9 +1564,6 @@ static gboolean atomic_update(const gchar *pathname, GError **error)
 
 	new_name = g_strndup(pathname, len - 4);
 
-	if (sync_file(pathname, error) == -1)
-		goto out;
-
 #ifdef _WIN32
 	/* we need to remove the old file first! */
 	remove(new_name);
@@ -1022,14 +1583,202 @@ out:
 	return ret;
 }
 
+/* Replaces the file 'pathname' without its .new extension with 'pathname'.
+ * In SYNC_BATCH mode, this only happens in the next flush_updates().
+ */
+static gboolean atomic_update(const gchar *pathname, GError **error)
+{
+	g_return_val_if_fail(g_str_has_suffix(pathname, ".new"), FALSE);
+
+	switch (sync_mode())
+	{
+		case SYNC_BATCH:
+			/* May be called from several threads */
+			g_mutex_lock(&pending_updates_lock);
+			if (!pending_updates)
+				pending_updates = g_ptr_array_new();
+			g_ptr_array_add(pending_updates, g_strdup(pathname));
+			g_mutex_unlock(&pending_updates_lock);
+			return TRUE;
+		case SYNC_EACH_FILE:
+			if (sync_file(pathname, error) == -1)
+				return FALSE;
+			break;
+		case SYNC_NONE:
+			break;
+	}
+
+	return rename_new_file(pathname, error);
+}
+
+/* Complete the updates queued by atomic_update() in SYNC_BATCH mode, in the
+ * order they were made: sync the contents of all the new files (with a
+ * single syncfs() of the file system containing 'mime_dir' where
+ * available), then rename them all, and finally sync each directory
+ * containing one of them. Whatever fails, the queue is emptied; the files
+ * that weren't renamed yet are left as they are.
+ */
+static gboolean flush_updates(const char *mime_dir, GError **error)
+{
+	GHashTable *dirs;
+	GPtrArray *dir_list;
+	GHashTableIter iter;
+	gpointer key;
+	gboolean ret = FALSE;
+	int i;
+
+	if (!pending_updates || pending_updates->len == 0)
+		return TRUE;
+
+	dirs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	{
+#ifdef HAVE_SYNCFS
+		int fd;
+
+		fd = open(mime_dir, O_RDONLY);
+		if (fd == -1)
+		{
+			set_error_from_errno(error);
+			goto out;
+		}
+		if (syncfs(fd) == -1)
+		{
+			set_error_from_errno(error);
+			close(fd);
+			goto out;
+		}
+		close(fd);
+#else
+		for (i = 0; i < pending_updates->len; i++)
+		{
+			if (sync_file(pending_updates->pdata[i], error) == -1)
+				goto out;
+		}
+#endif
+	}
+
+	for (i = 0; i < pending_updates->len; i++)
+	{
+		gchar *path = (gchar *) pending_updates->pdata[i];
+
+		if (!rename_new_file(path, error))
+			goto out;
+		g_hash_table_add(dirs, g_path_get_dirname(path));
+	}
+
+	/* The top-level directory goes last, so that none of its files
+	 * can appear to be updated before the ones below it.
+	 */
+	dir_list = g_ptr_array_new();
+	g_hash_table_iter_init(&iter, dirs);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+		g_ptr_array_add(dir_list, key);
+	g_ptr_array_sort(dir_list, strcmp2);
+	ret = TRUE;
+	for (i = dir_list->len - 1; ret && i >= 0; i--)
+		ret = sync_dir(dir_list->pdata[i], error) == 0;
+	g_ptr_array_free(dir_list, TRUE);
+out:
+	g_hash_table_destroy(dirs);
+	for (i = 0; i < pending_updates->len; i++)
+		g_free(pending_updates->pdata[i]);
+	g_ptr_array_set_size(pending_updates, 0);
+	return ret;
+}
+
+/* Replace 'filename' with the 'len' bytes at 'data', by writing them to a
+ * '.new' file and calling atomic_update(). If the file already has exactly
+ * these contents it is left alone, so that it keeps its inode and
+ * timestamp, and nothing has to be written or synced.
+ */
+static gboolean update_file(const gchar *filename, const char *data,
+			    gsize len, GError **error)
+{
+	GStatBuf statbuf;
+	gchar *new_path;
+	FILE *stream;
+	gboolean ret = FALSE;
+
+	if (g_stat(filename, &statbuf) == 0 && statbuf.st_size == len)
+	{
+		gchar *old_data;
+		gsize old_len;
+		gboolean same;
+
+		if (g_file_get_contents(filename, &old_data, &old_len, NULL))
+		{
+			same = old_len == len &&
+			       memcmp(old_data, data, len) == 0;
+			g_free(old_data);
+			if (same)
+				return TRUE;
+		}
+	}
+
+	new_path = g_strconcat(filename, ".new", NULL);
+	stream = fopen_gerror(new_path, error);
+	if (!stream)
+		goto out;
+	if (len > 0 && fwrite(data, len, 1, stream) != 1)
+	{
+		set_error_from_errno(error);
+		fclose(stream);
+		goto out;
+	}
+	if (!fclose_gerror(stream, error))
+		goto out;
+	ret = atomic_update(new_path, error);
+out:
+	g_free(new_path);
+	return ret;
+}
+
+/* Replace the file 'name' in 'mime_dir' with 'contents', which is freed */
+static gboolean save_generated_file(const char *mime_dir, const char *name,
+				    GString *contents, GError **error)
+{
+	gchar *path;
+	gboolean ret;
+
+	path = g_build_filename(mime_dir, name, NULL);
+	ret = update_file(path, contents->str, contents->len, error);
+	g_free(path);
+	g_string_free(contents, TRUE);
+
+	return ret;
+}
+
+/* Replace 'filename' with 'doc', unless it's the same already */
+static gboolean save_xml_file(xmlDocPtr doc, const gchar *filename, GError **error)
+{
+	xmlChar *data = NULL;
+	int len;
+	gboolean ret;
+
+	xmlDocDumpFormatMemoryEnc(doc, &data, &len, "utf-8", 1);
+	if (!data)
+	{
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+			    "Failed to write XML file");
+		return FALSE;
+	}
+
+	ret = update_file(filename, (char *) data, len, error);
+	xmlFree(data);
+	if (!ret)
+		g_prefix_error(error, "Failed to write XML file; For permission "
+			       "problems, try rerunning as root: ");
+
+	return ret;
+}
+
 /* Write out an XML file for one type */
-static void write_out_type(gpointer key, gpointer value, gpointer data)
+static gboolean save_type(Type *type, const char *mime_dir, GError **error)
 {
-	Type *type = (Type *) value;
-	const char *mime_dir = (char *) data;
 	char *media, *filename;
-	GError *local_error = NULL;
 	char *lower;
+	gboolean ret;
 
 	lower = g_ascii_strdown(type->media, -1);
 	media = g_strconcat(mime_dir, "/", lower, NULL);
@@ -1041,35 +1790,103 @@ static void write_out_type(gpointer key, gpointer value, gpointer data)
 #endif
 
 	lower = g_ascii_strdown(type->subtype, -1);
-	filename = g_strconcat(media, "/", lower, ".xml.new", NULL);
+	filename = g_strconcat(media, "/", lower, ".xml", NULL);
 	g_free(lower);
 	g_free(media);
 	media = NULL;
 
-	if (!save_xml_file(type->output, filename, &local_error))
-		fatal_gerror(local_error);
-
-	if (!atomic_update(filename, &local_error))
-		fatal_gerror(local_error);
+	ret = save_xml_file(type->output, filename, error);
 
 	g_free(filename);
+
+	return ret;
 }
 
-/* Comparison function to get the magic rules in priority order */
-static gint cmp_magic(gconstpointer a, gconstpointer b)
+static void write_out_type(gpointer key, gpointer value, gpointer data)
 {
-	Magic *aa = *(Magic **) a;
-	Magic *bb = *(Magic **) b;
-	int retval;
+	GError *local_error = NULL;
 
-	/* Sort nomagic items at start */
-	if (aa->nomagic || bb->nomagic)
-		return bb->nomagic - aa->nomagic;
+	if (!save_type((Type *) value, (char *) data, &local_error))
+		fatal_gerror(local_error);
+}
 
-	if (aa->priority > bb->priority)
-		return -1;
-	else if (aa->priority < bb->priority)
-		return 1;
+/* Shared by the threads writing the XML files when running with --jobs */
+typedef struct
+{
+	const char *mime_dir;
+	GError *error;		/* The first error, if any */
+} TypeWriter;
+
+static GMutex type_writer_lock;
+
+/* Thread pool function: write the XML file for one type */
+static void write_out_type_job(gpointer data, gpointer user_data)
+{
+	TypeWriter *writer = (TypeWriter *) user_data;
+	GError *local_error = NULL;
+
+	if (save_type((Type *) data, writer->mime_dir, &local_error))
+		return;
+
+	g_mutex_lock(&type_writer_lock);
+	if (writer->error)
+		g_error_free(local_error);
+	else
+		writer->error = local_error;
+	g_mutex_unlock(&type_writer_lock);
+}
+
+/* Write out the XML files for all the types, using 'n_jobs' threads */
+static void write_out_types(const char *mime_dir, int n_jobs)
+{
+	GThreadPool *pool;
+	GHashTableIter iter;
+	gpointer value;
+	TypeWriter writer;
+	GError *error = NULL;
+
+	if (n_jobs <= 1)
+	{
+		g_hash_table_foreach(types, write_out_type, (gpointer) mime_dir);
+		return;
+	}
+
+	/* Must be done before libxml is used from several threads */
+	xmlInitParser();
+
+	writer.mime_dir = mime_dir;
+	writer.error = NULL;
+
+	pool = g_thread_pool_new(write_out_type_job, &writer, n_jobs, TRUE,
+				 &error);
+	if (!pool)
+		fatal_gerror(error);
+
+	g_hash_table_iter_init(&iter, types);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+		g_thread_pool_push(pool, value, NULL);
+
+	g_thread_pool_free(pool, FALSE, TRUE);
+
+	if (writer.error)
+		fatal_gerror(writer.error);
+}
+
+/* Comparison function to get the magic rules in priority order */
+static gint cmp_magic(gconstpointer a, gconstpointer b)
+{
+	Magic *aa = *(Magic **) a;
+	Magic *bb = *(Magic **) b;
+	int retval;
+
+	/* Sort nomagic items at start */
+	if (aa->nomagic || bb->nomagic)
+		return bb->nomagic - aa->nomagic;
+
+	if (aa->priority > bb->priority)
+		return -1;
+	else if (aa->priority < bb->priority)
+		return 1;
 
 	retval = strcmp(aa->type->media, bb->type->media);
 	if (!retval)
@@ -1097,14 +1914,14 @@ static gint cmp_tree_magic(gconstpointer a, gconstpointer b)
 	return retval;
 }
 
-/* Write out 'n' as a two-byte big-endian number to 'stream' */
-static void write16(FILE *stream, guint32 n)
+/* Write out 'n' as a two-byte big-endian number to 'out' */
+static void write16(GString *out, guint32 n)
 {
 	guint16 big = GUINT16_TO_BE(n);
 
 	g_return_if_fail(n <= 0xffff);
 
-	fwrite(&big, sizeof(big), 1, stream);
+	g_string_append_len(out, (char *) &big, sizeof(big));
 }
 
 /* Single hex char to int; -1 if not a hex char.
@@ -1377,11 +2194,8 @@ static void parse_value(const char *type, const char *in, const char *in_mask,
 		g_assert_not_reached();
 }
 
-static Match *match_new(void)
+static void match_init(Match *match)
 {
-	Match *match;
-
-	match = g_new(Match, 1);
 	match->range_start = 0;
 	match->range_length = 1;
 	match->word_size = 1;
@@ -1389,25 +2203,7 @@ static Match *match_new(void)
 	match->data = NULL;
 	match->mask = NULL;
 	match->matches = NULL;
-
-	return match;
-}
-
-static void match_free(Match *match)
-{
-	GList *next;
-
-	g_return_if_fail(match != NULL);
-
-	for (next = match->matches; next; next = next->next)
-		match_free((Match *) next->data);
-
-	g_list_free(match->matches);
-
-	g_free(match->data);
-	g_free(match->mask);
-
-	g_free(match);
+	match->n_matches = 0;
 }
 
 /* Sets match->range_start and match->range_length */
@@ -1489,11 +2285,14 @@ static void match_value_and_mask(Match *match, xmlNode *node, GError **error)
 	}
 	else
 	{
-		match->data = parsed_value->str;
+		match->data = arena_dup0(parsed_value->str, parsed_value->len);
 		match->data_length = parsed_value->len;
-		match->mask = parsed_mask;
+		if (parsed_mask)
+			match->mask = arena_memdup(parsed_mask,
+						   parsed_value->len);
 
-		g_string_free(parsed_value, FALSE);
+		g_string_free(parsed_value, TRUE);
+		g_free(parsed_mask);
 	}
 
 	if (mask)
@@ -1533,17 +2332,22 @@ static void match_word_size(Match *match, xmlNode *node, GError **error)
 	xmlFree(type);
 }
 
-/* Turn the list of child nodes of 'parent' into a list of Matches */
-static GList *build_matches(xmlNode *parent, GError **error)
+/* Turn the list of child nodes of 'parent' into an array of Matches,
+ * storing its length in 'n_matches'.
+ */
+static Match *build_matches(xmlNode *parent, int *n_matches, GError **error)
 {
 	xmlNode *node;
-	GList *out = NULL;
+	GArray *out = NULL;
+	Match *matches = NULL;
+
+	*n_matches = 0;
 
 	g_return_val_if_fail(error != NULL, NULL);
 
 	for (node = parent->xmlChildrenNode; node; node = node->next)
 	{
-		Match *match;
+		Match match;
 
 		if (node->type != XML_ELEMENT_NODE)
 			continue;
@@ -1564,40 +2368,34 @@ static GList *build_matches(xmlNode *parent, GError **error)
 			break;
 		}
 
-		match = match_new();
-		match_offset(match, node, error);
+		match_init(&match);
+		match_offset(&match, node, error);
 		if (!*error)
-			match_word_size(match, node, error);
+			match_word_size(&match, node, error);
 		if (!*error)
-			match_value_and_mask(match, node, error);
+			match_value_and_mask(&match, node, error);
 
 		if (*error)
-		{
-			match_free(match);
 			break;
-		}
 
-		out = g_list_append(out, match);
+		match.matches = build_matches(node, &match.n_matches, error);
+
+		if (!out)
+			out = g_array_new(FALSE, FALSE, sizeof(Match));
+		g_array_append_val(out, match);
 
-		match->matches = build_matches(node, error);
 		if (*error)
 			break;
 	}
 
-	return out;
-}
-
-static void magic_free(Magic *magic)
-{
-	GList *next;
-
-	g_return_if_fail(magic != NULL);
-
-	for (next = magic->matches; next; next = next->next)
-		match_free((Match *) next->data);
-	g_list_free(magic->matches);
+	if (out)
+	{
+		*n_matches = out->len;
+		matches = arena_memdup(out->data, out->len * sizeof(Match));
+		g_array_free(out, TRUE);
+	}
 
-	g_free(magic);
+	return matches;
 }
 
 /* Create a new Magic object by parsing 'node' (a <magic> element) */
@@ -1619,22 +2417,20 @@ static Magic *magic_new(xmlNode *node, Type *type, GError **error)
 	}
 	else
 	{
-		magic = g_new0(Magic, 1);
+		magic = arena_alloc(sizeof(Magic));
 		magic->priority = prio;
 		magic->type = type;
-		magic->matches = build_matches(node, error);
+		magic->matches = build_matches(node, &magic->n_matches, error);
 
 
 		if (*error)
 		{
 			gchar *old = (*error)->message;
-			magic_free(magic);
 			magic = NULL;
 			(*error)->message = g_strconcat(
 				_("Error in <match> element: "), old, NULL);
 			g_free(old);
-		} else if (magic->matches == NULL) {
-			magic_free(magic);
+		} else if (magic->n_matches == 0) {
 			magic = NULL;
 			g_set_error(error, MIME_ERROR, 0,
 				    _("Incomplete <magic> element"));
@@ -1644,11 +2440,8 @@ static Magic *magic_new(xmlNode *node, Type *type, GError **error)
 	return magic;
 }
 
-static TreeMatch *tree_match_new(void)
+static void tree_match_init(TreeMatch *match)
 {
-	TreeMatch *match;
-
-	match = g_new(TreeMatch, 1);
 	match->path = NULL;
 	match->match_case = 0;
 	match->executable = 0;
@@ -1656,39 +2449,28 @@ static TreeMatch *tree_match_new(void)
 	match->type = 0;
 	match->mimetype = NULL;
 	match->matches = NULL;
-
-	return match;
-}
-
-static void tree_match_free(TreeMatch *match)
-{
-	GList *next;
-
-	g_return_if_fail(match != NULL);
-
-	for (next = match->matches; next; next = next->next)
-		tree_match_free((TreeMatch *) next->data);
-
-	g_list_free(match->matches);
-
-	g_free(match->path);
-	g_free(match->mimetype);
-
-	g_free(match);
+	match->n_matches = 0;
 }
 
-/* Turn the list of child nodes of 'parent' into a list of TreeMatches */
-static GList *build_tree_matches(xmlNode *parent, GError **error)
+/* Turn the list of child nodes of 'parent' into an array of TreeMatches,
+ * storing its length in 'n_matches'.
+ */
+static TreeMatch *build_tree_matches(xmlNode *parent, int *n_matches,
+				     GError **error)
 {
 	xmlNode *node;
-	GList *out = NULL;
+	GArray *out = NULL;
+	TreeMatch *matches = NULL;
 	char *attr;
 
+	*n_matches = 0;
+
 	g_return_val_if_fail(error != NULL, NULL);
 
 	for (node = parent->xmlChildrenNode; node; node = node->next)
 	{
-		TreeMatch *match;
+		TreeMatch match_buf;
+		TreeMatch *match = &match_buf;
 
 		if (node->type != XML_ELEMENT_NODE)
 			continue;
@@ -1709,12 +2491,12 @@ static GList *build_tree_matches(xmlNode *parent, GError **error)
 			break;
 		}
 
-		match = tree_match_new();
+		tree_match_init(match);
 
 		attr = my_xmlGetNsProp(node, "path", NULL);
 		if (attr)
 		{
-			match->path = g_strdup (attr);
+			match->path = arena_strdup (attr);
 			xmlFree (attr);
 		}
 		else 
@@ -1788,38 +2570,34 @@ static GList *build_tree_matches(xmlNode *parent, GError **error)
 			attr = my_xmlGetNsProp(node, "mimetype", NULL);
 			if (attr)
 			{
-				match->mimetype = g_strdup (attr);
+				match->mimetype = arena_strdup (attr);
 				xmlFree(attr);
 			}
 		}
 
 		if (*error)
-		{
-			tree_match_free(match);
 			break;
-		}
 
-		out = g_list_append(out, match);
+		match->matches = build_tree_matches(node, &match->n_matches,
+						    error);
+
+		if (!out)
+			out = g_array_new(FALSE, FALSE, sizeof(TreeMatch));
+		g_array_append_val(out, match_buf);
 
-		match->matches = build_tree_matches(node, error);
 		if (*error)
 			break;
 	}
 
-	return out;
-}
-
-static void tree_magic_free(TreeMagic *magic)
-{
-	GList *next;
-
-	g_return_if_fail(magic != NULL);
-
-	for (next = magic->matches; next; next = next->next)
-		tree_match_free((TreeMatch *) next->data);
-	g_list_free(magic->matches);
+	if (out)
+	{
+		*n_matches = out->len;
+		matches = arena_memdup(out->data,
+				       out->len * sizeof(TreeMatch));
+		g_array_free(out, TRUE);
+	}
 
-	g_free(magic);
+	return matches;
 }
 
 /* Create a new TreeMagic object by parsing 'node' (a <treemagic> element) */
@@ -1841,15 +2619,15 @@ static TreeMagic *tree_magic_new(xmlNode *node, Type *type, GError **error)
 	}
 	else
 	{
-		magic = g_new(TreeMagic, 1);
+		magic = arena_alloc(sizeof(TreeMagic));
 		magic->priority = prio;
 		magic->type = type;
-		magic->matches = build_tree_matches(node, error);
+		magic->matches = build_tree_matches(node, &magic->n_matches,
+						    error);
 
 		if (*error)
 		{
 			gchar *old = (*error)->message;
-			tree_magic_free(magic);
 			magic = NULL;
 			(*error)->message = g_strconcat(
 				_("Error in <treematch> element: "), old, NULL);
@@ -1860,104 +2638,108 @@ static TreeMagic *tree_magic_new(xmlNode *node, Type *type, GError **error)
 	return magic;
 }
 
-/* Write a list of Match elements (and their children) to the 'magic' file */
-static void write_magic_children(FILE *stream, GList *matches, int indent)
+/* Write an array of Match elements (and their children) to the 'magic' file */
+static void write_magic_children(GString *out, Match *matches, int n_matches,
+				 int indent)
 {
-	GList *next;
+	int i;
 
-	for (next = matches; next; next = next->next)
+	for (i = 0; i < n_matches; i++)
 	{
-		Match *match = (Match *) next->data;
+		Match *match = &matches[i];
 
 		if (indent)
-			g_fprintf(stream,
+			g_string_append_printf(out,
 				  "%d>%ld=",
 				  indent,
 				  match->range_start);
 		else
-			g_fprintf(stream, ">%ld=", match->range_start);
+			g_string_append_printf(out, ">%ld=", match->range_start);
 
-		write16(stream, match->data_length);
-		fwrite(match->data, match->data_length, 1, stream);
+		write16(out, match->data_length);
+		g_string_append_len(out, match->data, match->data_length);
 		if (match->mask)
 		{
-			fputc('&', stream);
-			fwrite(match->mask, match->data_length, 1, stream);
+			g_string_append_c(out, '&');
+			g_string_append_len(out, match->mask, match->data_length);
 		}
 		if (match->word_size != 1)
-			g_fprintf(stream, "~%d", match->word_size);
+			g_string_append_printf(out, "~%d", match->word_size);
 		if (match->range_length != 1)
-			g_fprintf(stream, "+%d", match->range_length);
+			g_string_append_printf(out, "+%d", match->range_length);
 
-		fputc('\n', stream);
+		g_string_append_c(out, '\n');
 
-		write_magic_children(stream, match->matches, indent + 1);
+		write_magic_children(out, match->matches, match->n_matches,
+				     indent + 1);
 	}
 }
 
 /* Write a whole Magic element to the 'magic' file */
-static void write_magic(FILE *stream, Magic *magic)
+static void write_magic(GString *out, Magic *magic)
 {
-	g_fprintf(stream, "[%d:%s/%s]\n", magic->priority,
+	g_string_append_printf(out, "[%d:%s/%s]\n", magic->priority,
 		magic->type->media, magic->type->subtype);
 
-	write_magic_children(stream, magic->matches, 0);
+	write_magic_children(out, magic->matches, magic->n_matches, 0);
 }
 
-/* Write a list of TreeMatch elements (and their children) to the 'treemagic' file */
-static void write_tree_magic_children(FILE *stream, GList *matches, int indent)
+/* Write an array of TreeMatch elements (and their children) to the 'treemagic' file */
+static void write_tree_magic_children(GString *out, TreeMatch *matches,
+				      int n_matches, int indent)
 {
-	GList *next;
+	int i;
 
-	for (next = matches; next; next = next->next)
+	for (i = 0; i < n_matches; i++)
 	{
-		TreeMatch *match = (TreeMatch *) next->data;
+		TreeMatch *match = &matches[i];
 
 		if (indent)
-			g_fprintf(stream,
+			g_string_append_printf(out,
 				  "%d>\"%s\"=",
 				  indent,
 				  match->path);
 		else
-			g_fprintf(stream, ">\"%s\"=", match->path);
+			g_string_append_printf(out, ">\"%s\"=", match->path);
 
 		switch (match->type)
 		{
 		default:
 		case 0: 
-			fputs("any", stream);
+			g_string_append(out, "any");
 			break;
 		case 1: 
-			fputs("file", stream);
+			g_string_append(out, "file");
 			break;
 		case 2: 
-			fputs("directory", stream);
+			g_string_append(out, "directory");
 			break;
 		case 3: 
-			fputs("link", stream);
+			g_string_append(out, "link");
 			break;
 		}
 		if (match->match_case)
-			fputs (",match-case", stream);
+			g_string_append(out, ",match-case");
 		if (match->executable)
-			fputs (",executable", stream);
+			g_string_append(out, ",executable");
 		if (match->non_empty)
-			fputs (",non-empty", stream);
+			g_string_append(out, ",non-empty");
 		if (match->mimetype)
-			g_fprintf (stream, ",%s", match->mimetype);
+			g_string_append_printf(out, ",%s", match->mimetype);
 
-		fputc('\n', stream);
+		g_string_append_c(out, '\n');
 
-		write_tree_magic_children(stream, match->matches, indent + 1);
+		write_tree_magic_children(out, match->matches,
+					  match->n_matches, indent + 1);
 	}
 }
 /* Write a whole TreeMagic element to the 'treemagic' file */
-static void write_tree_magic(FILE *stream, TreeMagic *magic)
+static void write_tree_magic(GString *out, TreeMagic *magic)
 {
-	g_fprintf(stream, "[%d:%s/%s]\n", magic->priority,
+	g_string_append_printf(out, "[%d:%s/%s]\n", magic->priority,
 		magic->type->media, magic->type->subtype);
 
-	write_tree_magic_children(stream, magic->matches, 0);
+	write_tree_magic_children(out, magic->matches, magic->n_matches, 0);
 }
 
 /* Check each of the directories with generated XML files, looking for types
@@ -1965,8 +2747,21 @@ static void write_tree_magic(FILE *stream, TreeMagic *magic)
  */
 static void delete_old_types(const gchar *mime_dir)
 {
+	GHashTable *names;
+	GHashTableIter iter;
+	gpointer key;
 	int i;
 
+	/* The files are named after the lowercase type names (see
+	 * save_type()), so compare them with those. Otherwise the files
+	 * for types with capitals in their names would be deleted and
+	 * written again every time.
+	 */
+	names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	g_hash_table_iter_init(&iter, types);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+		g_hash_table_add(names, g_ascii_strdown((char *) key, -1));
+
 	for (i = 0; i < G_N_ELEMENTS(media_types); i++)
 	{
 		gchar *media_dir;
@@ -1990,7 +2785,7 @@ static void delete_old_types(const gchar *mime_dir)
 			type_name = g_strconcat(media_types[i], "/",
 						ent->d_name, NULL);
 			type_name[strlen(type_name) - 4] = '\0';
-			if (!g_hash_table_lookup(types, type_name))
+			if (!g_hash_table_contains(names, type_name))
 			{
 				char *path;
 				path = g_strconcat(mime_dir, "/",
@@ -2007,6 +2802,8 @@ static void delete_old_types(const gchar *mime_dir)
 		
 		closedir(dir);
 	}
+
+	g_hash_table_destroy(names);
 }
 
 /* Extract one entry from namespace_hash and put it in the GPtrArray so
@@ -2023,7 +2820,7 @@ static void add_ns(gpointer key, gpointer value, gpointer data)
 }
 
 /* Write all the collected namespace rules to 'XMLnamespaces' */
-static void write_namespaces(FILE *stream)
+static void write_namespaces(GString *out)
 {
 	GPtrArray *lines;
 	int i;
@@ -2038,7 +2835,7 @@ static void write_namespaces(FILE *stream)
 	{
 		char *line = (char *) lines->pdata[i];
 
-		fwrite(line, 1, strlen(line), stream);
+		g_string_append(out, line);
 
 		g_free(line);
 	}
@@ -2049,22 +2846,22 @@ static void write_namespaces(FILE *stream)
 static void write_subclass(gpointer key, gpointer value, gpointer data)
 {
 	GSList *list = value;
-	FILE *stream = data;
+	GString *out = data;
 	GSList *l;
 	char *line;
 
 	for (l = list; l; l = l->next)
 	{
 		line = g_strconcat (key, " ", l->data, "\n", NULL);
-		fwrite(line, 1, strlen(line), stream);
+		g_string_append(out, line);
 		g_free (line);
 	}
 }
 
 /* Write all the collected subclass information to 'subclasses' */
-static void write_subclasses(FILE *stream)
+static void write_subclasses(GString *out)
 {
-	g_hash_table_foreach(subclass_hash, write_subclass, stream);
+	g_hash_table_foreach(subclass_hash, write_subclass, out);
 }
 
 /* Extract one entry from alias_hash and put it in the GPtrArray so
@@ -2082,7 +2879,7 @@ static void add_alias(gpointer key, gpointer value, gpointer data)
 }
 
 /* Write all the collected aliases */
-static void write_aliases(FILE *stream)
+static void write_aliases(GString *out)
 {
 	GPtrArray *lines;
 	int i;
@@ -2097,7 +2894,7 @@ static void write_aliases(FILE *stream)
 	{
 		char *line = (char *) lines->pdata[i];
 
-		fwrite(line, 1, strlen(line), stream);
+		g_string_append(out, line);
 
 		g_free(line);
 	}
@@ -2113,7 +2910,7 @@ static void add_type(gpointer key, gpointer value, gpointer data)
 }
 
 /* Write all the collected types */
-static void write_types(FILE *stream)
+static void write_types(GString *out)
 {
 	GPtrArray *lines;
 	int i;
@@ -2128,7 +2925,7 @@ static void write_types(FILE *stream)
 	{
 		char *line = (char *) lines->pdata[i];
 
-		fwrite(line, 1, strlen(line), stream);
+		g_string_append(out, line);
 
 		g_free(line);
 	}
@@ -2141,17 +2938,17 @@ static void write_one_icon(gpointer key, gpointer value, gpointer data)
 {
 	char *mimetype = (char *)key;
 	char *iconname = (char *)value;
-	FILE *stream = (FILE *)data;
+	GString *out = data;
 	char *line;
 
 	line = g_strconcat (mimetype, ":", iconname, "\n", NULL);
-	fwrite(line, 1, strlen(line), stream);
+	g_string_append(out, line);
 	g_free (line);
 }
 
-static void write_icons(GHashTable *icons, FILE *stream)
+static void write_icons(GHashTable *icons, GString *out)
 {
-	g_hash_table_foreach(icons, write_one_icon, stream);
+	g_hash_table_foreach(icons, write_one_icon, out);
 }
 
 /* Issue a warning if 'path' won't be found by applications */
@@ -2227,60 +3024,45 @@ static void free_string_list(gpointer data)
   (( ((unsigned long)(this)) + (((unsigned long)(boundary)) -1)) & (~(((unsigned long)(boundary))-1)))
 
 
-static gint
-write_data (FILE *cache, const gchar *n, gint len)
+/* The cache is assembled in memory and written out in one go, so none
+ * of these can fail.
+ */
+static void
+write_data (GString *cache, const gchar *n, gint len)
 {
-  gchar *s;
-  int i, l;
-  
-  l = ALIGN_VALUE (len, 4);
-  
-  s = g_malloc0 (l);
-  memcpy (s, n, len);
+  static const gchar padding[4] = { 0, 0, 0, 0 };
 
-  i = fwrite (s, l, 1, cache);
-
-  g_free(s);
-
-  return i == 1;
-  
+  g_string_append_len (cache, n, len);
+  g_string_append_len (cache, padding, ALIGN_VALUE (len, 4) - len);
 }
 
-static gint
-write_string (FILE *cache, const gchar *n)
+static void
+write_string (GString *cache, const gchar *n)
 {
-  return write_data (cache, n, strlen (n) + 1);
+  write_data (cache, n, strlen (n) + 1);
 }
 
-static gboolean
-write_card16 (FILE *cache, guint16 n)
+static void
+write_card16 (GString *cache, guint16 n)
 {
-  int i;
-
   n = GUINT16_TO_BE (n);
   
-  i = fwrite ((char *)&n, 2, 1, cache);
-
-  return i == 1;
+  g_string_append_len (cache, (char *)&n, 2);
 }
 
-static gboolean
-write_card32 (FILE *cache, guint32 n)
+static void
+write_card32 (GString *cache, guint32 n)
 {
-  int i;
-
   n = GUINT32_TO_BE (n);
   
-  i = fwrite ((char *)&n, 4, 1, cache);
-
-  return i == 1;
+  g_string_append_len (cache, (char *)&n, 4);
 }
 
 #define MAJOR_VERSION 1
 #define MINOR_VERSION 2
 
-static gboolean
-write_header (FILE *cache,   
+static void
+write_header (GString *cache,   
 	      gint  alias_offset,
 	      gint  parent_offset,
 	      gint  literal_offset,
@@ -2295,71 +3077,74 @@ write_header (FILE *cache,
 {
   *offset = 44;
 
-  return (write_card16 (cache, MAJOR_VERSION) &&
-	  write_card16 (cache, MINOR_VERSION) &&
-	  write_card32 (cache, alias_offset) &&
-	  write_card32 (cache, parent_offset) &&
-	  write_card32 (cache, literal_offset) &&
-	  write_card32 (cache, suffix_offset) &&
-	  write_card32 (cache, glob_offset) &&
-	  write_card32 (cache, magic_offset) &&
-	  write_card32 (cache, namespace_offset) &&
-	  write_card32 (cache, icons_list_offset) &&
-	  write_card32 (cache, generic_icons_list_offset) &&
-	  write_card32 (cache, type_offset));
+  write_card16 (cache, MAJOR_VERSION);
+  write_card16 (cache, MINOR_VERSION);
+  write_card32 (cache, alias_offset);
+  write_card32 (cache, parent_offset);
+  write_card32 (cache, literal_offset);
+  write_card32 (cache, suffix_offset);
+  write_card32 (cache, glob_offset);
+  write_card32 (cache, magic_offset);
+  write_card32 (cache, namespace_offset);
+  write_card32 (cache, icons_list_offset);
+  write_card32 (cache, generic_icons_list_offset);
+  write_card32 (cache, type_offset);
 }
 
 
 typedef gboolean (FilterFunc) (gpointer key);
-typedef gchar ** (GetValueFunc) (gpointer data, gchar *key);
 
 typedef struct
 {
-  FILE         *cache;
+  GString      *cache;
   GHashTable   *pool;
-  guint         offset;
-  GetValueFunc *get_value;
-  gpointer      data;
-  gboolean      weighted;
   gboolean      error;
 } MapData;
 
+/* Writes the records for 'key' of a map section, returning how many */
+typedef guint (WriteEntriesFunc) (MapData *map_data, GHashTable *map, gchar *key);
+
+/* The keys of a map section in the order they were written, and the
+ * index of the first record for each, for building an index over it.
+ */
+typedef struct
+{
+  GPtrArray *keys;
+  GArray    *first;
+} MapKeys;
+
+/* Writes the offset of 'str' in the string pool */
 static void
-write_map_entry (gpointer key,
-		 gpointer data)
+write_string_offset (MapData     *map_data,
+		     const gchar *str)
 {
-  MapData *map_data = (MapData *)data;
-  gchar **values;
-  guint offset, i;
-  guint weight;
+  guint offset;
 
-  values = (* map_data->get_value) (map_data->data, key);
-  for (i = 0; values[i]; i++)
+  offset = GPOINTER_TO_UINT (g_hash_table_lookup (map_data->pool, str));
+  if (offset == 0)
     {
-      if (map_data->weighted && (i % 3 == 2)) 
-        {
-          weight = atoi (values[i]);
+      g_warning ("Missing string: '%s'", str);
+      map_data->error = TRUE;
+    }
+  write_card32 (map_data->cache, offset);
+}
+
+static void
+set_card32 (GString *cache, gsize pos, guint32 n)
+{
+  n = GUINT32_TO_BE (n);
 
-          if (!write_card32 (map_data->cache, weight))
-            map_data->error = TRUE;
+  memcpy (cache->str + pos, &n, 4);
+}
 
-          map_data->offset += 4;
-        }
-      else 
-        {
-          offset = GPOINTER_TO_UINT (g_hash_table_lookup (map_data->pool, values[i]));
-          if (offset == 0)
-            {
-              g_warning ("Missing string: '%s'", values[i]);
-              map_data->error = TRUE;
-            }
-          if (!write_card32 (map_data->cache, offset))
-          map_data->error = TRUE;
-          map_data->offset += 4;
-        }
-    }
+static guint32
+get_card32 (GString *cache, gsize pos)
+{
+  guint32 n;
+
+  memcpy (&n, cache->str + pos, 4);
 
-  g_strfreev (values);
+  return GUINT32_FROM_BE (n);
 }
 
 typedef struct 
@@ -2379,39 +3164,25 @@ add_key (gpointer key,
     g_ptr_array_add (filter_data->keys, key);
 }
 
-typedef struct
-{
-  GetValueFunc *get_value;
-  gpointer      data;
-  guint count;
-  gboolean weighted;
-} CountData;
-
-static void
-count_map_entry (gpointer key,
-		 gpointer data)
-{
-  CountData *count_data = (CountData *)data;
-  gchar **values;
-
-  values = (* count_data->get_value) (count_data->data, key);
-  count_data->count += g_strv_length (values) / (count_data->weighted ? 3 : 2);
-  g_strfreev (values);
-}
-
+/* Write the keys of 'map' that pass 'filter', in sorted order, preceded
+ * by the number of records written for them. The count is filled in at
+ * the end, so each key is only visited once. If 'map_keys' isn't NULL,
+ * the keys are also added to it.
+ */
 static gboolean
-write_map (FILE         *cache,
-	   GHashTable   *strings,
-	   GHashTable   *map,
-	   FilterFunc   *filter,
-           GetValueFunc *get_value,
-           gboolean      weighted,
-	   guint        *offset)
+write_map (GString          *cache,
+	   GHashTable       *strings,
+	   GHashTable       *map,
+	   FilterFunc       *filter,
+	   WriteEntriesFunc *write_entries,
+	   MapKeys          *map_keys,
+	   guint            *offset)
 {
   GPtrArray *keys;
   MapData map_data;
   FilterData filter_data;
-  CountData count_data;
+  gsize count_pos, start;
+  guint count, i;
 
   keys = g_ptr_array_new ();
   
@@ -2421,45 +3192,47 @@ write_map (FILE         *cache,
 
   g_ptr_array_sort (keys, strcmp2);
 
-  count_data.data = map;
-  count_data.count = 0;
-  count_data.get_value = get_value;
-  count_data.weighted = weighted;
-
-  g_ptr_array_foreach (keys, count_map_entry, &count_data);
-
-  if (!write_card32 (cache, count_data.count))
-    return FALSE;
+  start = cache->len;
+  count_pos = cache->len;
+  write_card32 (cache, 0);
 
   map_data.cache = cache;
   map_data.pool = strings;
-  map_data.get_value = get_value;
-  map_data.data = map;
-  map_data.weighted = weighted;
-  map_data.offset = *offset + 4;
   map_data.error = FALSE;
 
-  g_ptr_array_foreach (keys, write_map_entry, &map_data);
+  count = 0;
+  for (i = 0; i < keys->len; i++)
+    {
+      if (map_keys)
+	{
+	  g_ptr_array_add (map_keys->keys, keys->pdata[i]);
+	  g_array_append_val (map_keys->first, count);
+	}
+      count += (* write_entries) (&map_data, map, keys->pdata[i]);
+    }
+
+  set_card32 (cache, count_pos, count);
 
-  *offset = map_data.offset;
+  *offset += cache->len - start;
+
+  g_ptr_array_free (keys, TRUE);
 
   return !map_data.error;
 }
 
-static gchar **
-get_type_value (gpointer  data, 
-		gchar    *key)
+static guint
+write_type_entry (MapData    *map_data,
+		  GHashTable *map,
+		  gchar      *key)
 {
   Type *type;
-  gchar **result;
 
-  type = (Type *)g_hash_table_lookup ((GHashTable *)data, key);
+  type = (Type *)g_hash_table_lookup (map, key);
   
-  result = g_new0 (gchar *, 3);
-  result[0] = g_strdup (key);
-  result[1] = g_strdup_printf ("%s/%s", type->media, type->subtype);
+  write_string_offset (map_data, key);
+  write_card32 (map_data->cache, type->cache_offset);
 
-  return result;
+  return 1;
 }
 
 static guint32
@@ -2473,106 +3246,51 @@ get_glob_weight_and_flags (Glob *glob)
   return res;
 }
 
-static gchar **
-get_glob_list_value (gpointer  data, 
-		     gchar    *key)
+static guint
+write_glob_entries (MapData    *map_data,
+		    GHashTable *map,
+		    gchar      *key)
 {
-  GList *list;
+  GArray *globs;
   Glob *glob;
-  Type *type;
-  gchar **result;
-  gint i;
+  guint i;
 
-  list = (GList *)g_hash_table_lookup ((GHashTable *)data, key);
-  
-  result = g_new0 (gchar *, 1 + 3 * g_list_length (list));
+  globs = (GArray *)g_hash_table_lookup (map, key);
   
-  i = 0;
-  for (; list; list = list->next)
+  for (i = 0; i < globs->len; i++)
     {
-      glob = (Glob *)list->data;
-      type = glob->type;
+      glob = &g_array_index (globs, Glob, i);
 
-      result[i++] = g_strdup (glob->pattern);
-      result[i++] = g_strdup_printf ("%s/%s", type->media, type->subtype);
-      result[i++] = g_strdup_printf ("%ud", get_glob_weight_and_flags (glob));
+      write_string_offset (map_data, glob->pattern);
+      write_card32 (map_data->cache, glob->type->cache_offset);
+      write_card32 (map_data->cache, get_glob_weight_and_flags (glob));
     }
-  return result;
+
+  return globs->len;
 }
 
 static gboolean
-write_alias_cache (FILE       *cache, 
+write_alias_cache (GString    *cache, 
 		   GHashTable *strings,
+		   MapKeys    *map_keys,
 		   guint      *offset)
 {
-  return write_map (cache, strings, alias_hash, NULL, get_type_value, FALSE, offset);
+  return write_map (cache, strings, alias_hash, NULL, write_type_entry,
+		    map_keys, offset);
 }
 		   
-static void
-write_parent_entry (gpointer key,
-		    gpointer data)
-{
-  gchar *mimetype = (gchar *)key;
-  MapData *map_data = (MapData *)data;
-  guint parents_offset, offset;
-  GList *parents;
-
-  parents = (GList *)g_hash_table_lookup (subclass_hash, mimetype);
-  offset = GPOINTER_TO_UINT (g_hash_table_lookup (map_data->pool, mimetype));
-  if (offset == 0)
-    {
-      g_warning ("Missing string: '%s'", (gchar *)key);
-      map_data->error = TRUE;
-    }
-
-  parents_offset = map_data->offset;
-  map_data->offset += 4 + 4 * g_list_length (parents);
-
-  if (!write_card32 (map_data->cache, offset) ||
-      !write_card32 (map_data->cache, parents_offset))
-    map_data->error = TRUE;
-}
-
-static void
-write_parent_list (gpointer key,
-		   gpointer data)
-{
-  gchar *mimetype = (gchar *)key;
-  MapData *map_data = (MapData *)data;
-  guint offset;
-  GList *parents, *p;
-
-  parents = (GList *)g_hash_table_lookup (subclass_hash, mimetype);
-
-  if (!write_card32 (map_data->cache, g_list_length (parents)))
-    map_data->error = TRUE;
-
-  for (p = parents; p; p = p->next)
-    {
-      gchar *parent = (gchar *)p->data;
-      
-      offset = GPOINTER_TO_UINT (g_hash_table_lookup (map_data->pool, parent));
-      if (offset == 0)
-	{
-	  g_warning ("Missing string: '%s'", parent);
-	  map_data->error = TRUE;
-	}
-      
-      if (!write_card32 (map_data->cache, offset))
-	map_data->error = TRUE;
-    }
-
-  map_data->offset += 4 + 4 * g_list_length (parents);
-}
-
+/* Write the parents list: for each type with parents, its name and the
+ * offset of the list of its parents, then those lists.
+ */
 static gboolean
-write_parent_cache (FILE       *cache,
+write_parent_cache (GString    *cache,
 		    GHashTable *strings,
 		    guint      *offset)
 {
   GPtrArray *keys;
   MapData map_data;
   FilterData filter_data;
+  guint list_offset, i;
 
   keys = g_ptr_array_new ();
 
@@ -2582,20 +3300,35 @@ write_parent_cache (FILE       *cache,
 
   g_ptr_array_sort (keys, strcmp2);
 
-  if (!write_card32 (cache, keys->len))
-    return FALSE;
+  write_card32 (cache, keys->len);
 
   map_data.cache = cache;
   map_data.pool = strings;
-  map_data.offset = *offset + 4 + keys->len * 8;
   map_data.error = FALSE;
 
-  g_ptr_array_foreach (keys, write_parent_entry, &map_data);
+  list_offset = *offset + 4 + keys->len * 8;
+  for (i = 0; i < keys->len; i++)
+    {
+      GList *parents = g_hash_table_lookup (subclass_hash, keys->pdata[i]);
+
+      write_string_offset (&map_data, keys->pdata[i]);
+      write_card32 (cache, list_offset);
+      list_offset += 4 + 4 * g_list_length (parents);
+    }
+
+  for (i = 0; i < keys->len; i++)
+    {
+      GList *parents = g_hash_table_lookup (subclass_hash, keys->pdata[i]);
+      GList *p;
+
+      write_card32 (cache, g_list_length (parents));
+      for (p = parents; p; p = p->next)
+	write_string_offset (&map_data, p->data);
+    }
 
-  map_data.offset = *offset + 4 + keys->len * 8;
-  g_ptr_array_foreach (keys, write_parent_list, &map_data);
+  *offset = list_offset;
 
-  *offset = map_data.offset;
+  g_ptr_array_free (keys, TRUE);
 
   return !map_data.error;
 }
@@ -2652,108 +3385,120 @@ is_full_glob (gpointer key)
 }
 
 static gboolean
-write_literal_cache (FILE       *cache,
+write_literal_cache (GString    *cache,
 		     GHashTable *strings,
+		     MapKeys    *map_keys,
 		     guint      *offset)
 {
   return write_map (cache, strings, globs_hash, is_literal_glob, 
-		    get_glob_list_value, TRUE, offset); 
+		    write_glob_entries, map_keys, offset); 
 }
 
 static gboolean
-write_glob_cache (FILE       *cache,
+write_glob_cache (GString    *cache,
 		  GHashTable *strings,
 		  guint      *offset)
 {
   return write_map (cache, strings, globs_hash, is_full_glob, 
-		    get_glob_list_value, TRUE, offset); 
+		    write_glob_entries, NULL, offset); 
 }
 
-typedef struct _SuffixEntry SuffixEntry;
-
-struct _SuffixEntry
+/* A node of the reversed-suffix trie. The nodes live in one GArray and
+ * refer to each other by index; node 0 is the root.
+ */
+typedef struct
 {
   gunichar character;
-  gchar *mimetype;
+  Type *type;		/* for the leaves */
   gint weight;
   guint32 flags;
-  GList *children;
-  guint size;
-  guint depth;
-};
+  GArray *children;	/* node indices, sorted by character */
+} SuffixEntry;
 
-static GList *
-insert_suffix (gunichar *suffix, 
-	       gchar    *mimetype,
-	       gint      weight,
-	       guint32   flags,
-	       GList    *suffixes)
+#define SUFFIX_ENTRY(nodes, i) (&g_array_index ((nodes), SuffixEntry, (i)))
+
+static guint
+add_suffix_entry (GArray   *nodes,
+		  guint     parent,
+		  guint     pos,
+		  gunichar  character)
 {
-  GList *l;
-  SuffixEntry *s = NULL;
+  SuffixEntry *s;
+  SuffixEntry entry = { 0, };
+  guint index = nodes->len;
 
-  for (l = suffixes; l; l = l->next)
-    {
-      s = (SuffixEntry *)l->data;
+  entry.character = character;
+  g_array_append_val (nodes, entry);
 
-      if (s->character > suffix[0])
-	{
-	  s = g_new0 (SuffixEntry, 1);
-	  s->character = suffix[0];
-	  s->mimetype = NULL;
-	  s->children = NULL;
+  s = SUFFIX_ENTRY (nodes, parent);
+  if (!s->children)
+    s->children = g_array_new (FALSE, FALSE, sizeof (guint));
+  g_array_insert_val (s->children, pos, index);
 
-	  suffixes = g_list_insert_before (suffixes, l, s);
-	}
+  return index;
+}
 
-      if (s->character == suffix[0])
-	break;
-    }
+/* Returns the child of 'parent' for 'character', adding it if needed */
+static guint
+get_suffix_child (GArray   *nodes,
+		  guint     parent,
+		  gunichar  character)
+{
+  GArray *children = SUFFIX_ENTRY (nodes, parent)->children;
+  guint lo = 0, hi = children ? children->len : 0;
 
-  if (!s || s->character != suffix[0])
+  while (lo < hi)
     {
-      s = g_new0 (SuffixEntry, 1);
-      s->character = suffix[0];
-      s->mimetype = NULL;
-      s->children = NULL;
-
-      suffixes = g_list_append (suffixes, s);
+      guint mid = (lo + hi) / 2;
+      guint child = g_array_index (children, guint, mid);
+      gunichar c = SUFFIX_ENTRY (nodes, child)->character;
+
+      if (c == character)
+	return child;
+      if (c < character)
+	lo = mid + 1;
+      else
+	hi = mid;
     }
 
-  if (suffix[1] == 0)
-    {
-      GList *l2;
-      SuffixEntry *s2;
-      gboolean found = FALSE;
+  return add_suffix_entry (nodes, parent, lo, character);
+}
 
-      for (l2 = s->children; l2; l2 = l2->next)
-	{
-	  s2 = (SuffixEntry *)l2->data;
-	  if (s2->character != 0)
-	    break;
-	  if (strcmp (s2->mimetype, mimetype) == 0)
-	    {
-	      if (s2->weight < weight)
-		s2->weight = weight;
-	      found = TRUE;
-	      break;
-	    }
-	}
-      if (!found)
+static void
+insert_suffix (GArray      *nodes,
+	       gunichar    *suffix, 
+	       Type        *type,
+	       gint         weight,
+	       guint32      flags)
+{
+  GArray *children;
+  SuffixEntry *s2;
+  guint node = 0;
+  guint i;
+
+  for ( ; *suffix; suffix++)
+    node = get_suffix_child (nodes, node, *suffix);
+
+  /* The leaves (character 0) come first, in the order they were added */
+  children = SUFFIX_ENTRY (nodes, node)->children;
+  for (i = 0; children && i < children->len; i++)
+    {
+      s2 = SUFFIX_ENTRY (nodes, g_array_index (children, guint, i));
+      if (s2->character != 0)
+	break;
+      if (s2->type == type)
 	{
-	  s2 = g_new0 (SuffixEntry, 1);
-	  s2->character = 0;
-	  s2->mimetype = mimetype;
-	  s2->weight = weight;
-	  s2->flags = flags;
-	  s2->children = NULL;
-	  s->children = g_list_insert_before (s->children, l2, s2);
+	  if (s2->weight < weight)
+	    s2->weight = weight;
+	  return;
 	}
     }
-  else
-    s->children = insert_suffix (suffix + 1, mimetype, weight, flags, s->children);
 
-  return suffixes;
+  node = add_suffix_entry (nodes, node, i, 0);
+  s2 = SUFFIX_ENTRY (nodes, node);
+  s2->type = type;
+  s2->weight = weight;
+  s2->flags = flags;
 }
 
 static void
@@ -2776,14 +3521,13 @@ build_suffixes (gpointer key,
 		gpointer data)
 {
   gchar *pattern = (gchar *)key;
-  GList *list = (GList *)value;
-  GList **suffixes = (GList **)data;
+  GArray *globs = (GArray *)value;
+  GArray *nodes = (GArray *)data;
   gunichar *suffix;
-  gchar *mimetype;
   Glob *glob;
-  Type *type;
   glong len;
   guint32 flags;
+  guint i;
   
   if (is_simple_glob (pattern))
     {
@@ -2796,16 +3540,14 @@ build_suffixes (gpointer key,
 	}
 
       ucs4_reverse (suffix, len);
-      for ( ; list; list = list->next)
+      for (i = 0; i < globs->len; i++)
         {
-          glob = (Glob *)list->data;
-          type = glob->type;
-          mimetype = g_strdup_printf ("%s/%s", type->media, type->subtype);
+          glob = &g_array_index (globs, Glob, i);
 
 	  flags = 0;
 	  if (glob->case_sensitive)
 	    flags |= 0x100;
-          *suffixes = insert_suffix (suffix, mimetype, glob->weight, flags, *suffixes);
+          insert_suffix (nodes, suffix, glob->type, glob->weight, flags);
         }
 
       g_free (suffix);
@@ -2813,828 +3555,3929 @@ build_suffixes (gpointer key,
 }
 
 static void
-calculate_size (SuffixEntry *entry)
+write_suffix_entry (GString     *cache, 
+		    SuffixEntry *entry,
+		    guint        child_offset)
 {
-  GList *s;
-
-  entry->size = 0;
-  entry->depth = 0;
-  for (s = entry->children; s; s= s->next)
+  if (entry->character == 0)
     {
-      SuffixEntry *child = (SuffixEntry *)s->data;
-
-      calculate_size (child);
-      entry->size += 1 + child->size;
-      entry->depth = MAX (entry->depth, child->depth + 1);
+      write_card32 (cache, entry->character);
+      write_card32 (cache, entry->type->cache_offset);
+      write_card32 (cache, (entry->weight & 0xff) | entry->flags);
+    }
+  else
+    {
+      write_card32 (cache, entry->character);
+      write_card32 (cache, entry->children ? entry->children->len : 0);
+      write_card32 (cache, child_offset);
     }
 }
 
-static gboolean 
-write_suffix_entries (FILE        *cache, 
-		      guint        depth,
-		      SuffixEntry *entry,
-		      GHashTable *strings, 
-		      guint      *child_offset)
+/* The children of each node are written consecutively, breadth first,
+ * so the nodes are simply written in the order they are queued.
+ * Returns the number of nodes written.
+ */
+static guint
+write_suffix_cache (GString     *cache, 
+		    GHashTable *strings, 
+		    guint      *offset)
 {
-  GList *c;
-  guint offset;
+  GArray *nodes, *queue;
+  SuffixEntry root = { 0, };
+  guint n_entries;
+  guint n_nodes;
+  guint child_offset;
+  guint i;
 
-  if (depth > 0)
-    {
-      gboolean error = FALSE;
+  nodes = g_array_new (FALSE, FALSE, sizeof (SuffixEntry));
+  g_array_append_val (nodes, root);
 
-      for (c = entry->children; c; c = c->next)
-	{
-	  SuffixEntry *child = (SuffixEntry *)c->data;
-	  if (!write_suffix_entries (cache, depth - 1, child, strings, child_offset))
-	    error = TRUE;
-	}
+  g_hash_table_foreach (globs_hash, build_suffixes, nodes);
 
-      return !error;
-    }
-    
-  if (entry->mimetype)
+  queue = g_array_sized_new (FALSE, FALSE, sizeof (guint), nodes->len);
+  if (SUFFIX_ENTRY (nodes, 0)->children)
+    g_array_append_vals (queue, SUFFIX_ENTRY (nodes, 0)->children->data,
+			 SUFFIX_ENTRY (nodes, 0)->children->len);
+  n_entries = queue->len;
+
+  *offset += 8;
+  child_offset = *offset + 12 * n_entries;
+
+  write_card32 (cache, n_entries);
+  write_card32 (cache, *offset);
+
+  for (i = 0; i < queue->len; i++)
     {
-      offset = GPOINTER_TO_UINT(g_hash_table_lookup (strings, entry->mimetype));
-      if (offset == 0)
+      SuffixEntry *entry = SUFFIX_ENTRY (nodes, g_array_index (queue, guint, i));
+
+      write_suffix_entry (cache, entry, child_offset);
+
+      if (entry->children)
 	{
-	  g_warning ("Missing string: '%s'", entry->mimetype);
-	  return FALSE;
+	  g_array_append_vals (queue, entry->children->data, entry->children->len);
+	  child_offset += 12 * entry->children->len;
 	}
     }
-  else
-    offset = 0;
 
-  if (entry->character == 0)
+  *offset = child_offset;
+  n_nodes = queue->len;
+
+  for (i = 0; i < nodes->len; i++)
     {
-      if (!write_card32 (cache, entry->character))
-        return FALSE;
+      SuffixEntry *entry = SUFFIX_ENTRY (nodes, i);
+
+      if (entry->children)
+	g_array_free (entry->children, TRUE);
+    }
+  g_array_free (nodes, TRUE);
+  g_array_free (queue, TRUE);
+
+  return n_nodes;
+}
+
+/* All the matchlets of the magic section, in the order they are
+ * written: the children of a matchlet are consecutive, so each
+ * matchlet and each Magic only needs the index of its first child.
+ */
+typedef struct {
+  GPtrArray  *matches;
+  GArray     *first_child;   /* index of each matchlet's first child */
+  GArray     *first_match;   /* index of each Magic's first matchlet */
+  GHashTable *lists;         /* index of the first matchlet of each list */
+} MatchList;
+
+static void
+write_match (GString    *cache,
+	     Magic      *magic,
+	     guint       first_match,
+	     guint       offset)
+{
+  write_card32 (cache, magic->priority);
+  write_card32 (cache, magic->type->cache_offset);
+  write_card32 (cache, magic->n_matches);
+  write_card32 (cache, offset + 32 * first_match);
+}
 
-      if (!write_card32 (cache, offset))
-        return FALSE;
+static void
+write_matchlet (GString        *cache,
+		Match          *match,
+		guint           first_child,
+		gint            offset,
+		gint           *offset2)
+{
+  write_card32 (cache, match->range_start);
+  write_card32 (cache, match->range_length);
+  write_card32 (cache, match->word_size);
+  write_card32 (cache, match->data_length);
+  write_card32 (cache, *offset2);
+  
+  *offset2 = ALIGN_VALUE (*offset2 + match->data_length, 4);
+      
+  if (match->mask)
+    {
+      write_card32 (cache, *offset2);
+      
+      *offset2 = ALIGN_VALUE (*offset2 + match->data_length, 4);
+    }
+  else
+    write_card32 (cache, 0);
 
-      if (!write_card32 (cache, (entry->weight & 0xff) | entry->flags))
-        return FALSE;
+  if (match->n_matches)
+    {
+      write_card32 (cache, match->n_matches);
+      write_card32 (cache, offset + 32 * first_child);
     }
   else
     {
-      if (!write_card32 (cache, entry->character))
-        return FALSE;
+      write_card32 (cache, 0);
+      write_card32 (cache, 0);
+    }
+}  
 
-      if (!write_card32 (cache, g_list_length (entry->children)))
-        return FALSE;
+static void
+write_matchlet_data (GString        *cache,
+		     Match          *match,
+		     gint           *offset2)
+{
+  write_data (cache, match->data, match->data_length);
   
-      if (!write_card32 (cache, *child_offset))
-        return FALSE;
-    }
+  *offset2 = ALIGN_VALUE (*offset2 + match->data_length, 4);
 
-  *child_offset += 12 * g_list_length (entry->children);
+  if (match->mask)
+    {
+      write_data (cache, match->mask, match->data_length);
 
-  return TRUE;
+      *offset2 = ALIGN_VALUE (*offset2 + match->data_length, 4);
+    }
 }
 
-static gboolean
-write_suffix_cache (FILE        *cache, 
-		    GHashTable *strings, 
-		    guint      *offset)
+/* Returns the index of the first matchlet of 'list'. A list shared by
+ * several parents (see optimize_magic_rules()) is only written once.
+ */
+static guint
+collect_matches_list (Match *list, gint n_matches, MatchList *matches)
 {
-  GList *suffixes, *s;
-  guint n_entries;
-  guint child_offset;
-  guint depth, d;
-
-  suffixes = NULL;
+  guint first, none = 0;
+  gpointer found;
+  gint i;
 
-  g_hash_table_foreach (globs_hash, build_suffixes, &suffixes);
+  if (n_matches == 0)
+    return matches->matches->len;
 
-  n_entries = g_list_length (suffixes);
+  if (g_hash_table_lookup_extended (matches->lists, list, NULL, &found))
+    return GPOINTER_TO_UINT (found);
 
-  *offset += 8;
-  child_offset = *offset + 12 * n_entries;
-  depth = 0;
-  for (s = suffixes; s; s= s->next)
+  first = matches->matches->len;
+  g_hash_table_insert (matches->lists, list, GUINT_TO_POINTER (first));
+  for (i = 0; i < n_matches; i++)
     {
-      SuffixEntry *entry = (SuffixEntry *)s->data;
-      calculate_size (entry);
-      depth = MAX (depth, entry->depth + 1);
+      g_ptr_array_add (matches->matches, &list[i]);
+      g_array_append_val (matches->first_child, none);
     }
 
-  if (!write_card32 (cache, n_entries) || !write_card32 (cache, *offset))
-    return FALSE;
+  for (i = 0; i < n_matches; i++)
+    {  
+      Match *match = &list[i];
+      guint child;
 
-  for (d = 0; d < depth; d++)
-    {
-      for (s = suffixes; s; s = s->next)
-	{
-	  SuffixEntry *entry = (SuffixEntry *)s->data;
-	  
-	  if (!write_suffix_entries (cache,  d, entry, strings, &child_offset))
-	    return FALSE;
-	}
+      child = collect_matches_list (match->matches, match->n_matches, matches);
+      g_array_index (matches->first_child, guint, first + i) = child;
     }
 
-  *offset = child_offset;
+  return first;
+}
 
-  return TRUE;
+static void
+collect_matches (gpointer key, gpointer data)
+{
+  Magic *magic = (Magic *)key;
+  MatchList *matches = (MatchList *)data;
+  guint first;
+
+  first = collect_matches_list (magic->matches, magic->n_matches, matches);
+  g_array_append_val (matches->first_match, first);
 }
 
-typedef struct {
-  FILE       *cache;
-  GHashTable *strings;
-  GList      *matches;
-  guint       offset;
-  gboolean    error;
-} WriteMatchData;
+/* The magic rules are simplified before being written to mime.cache,
+ * without changing what they match:
+ *
+ * - masks are applied to the data, and dropped if they are all 0xff
+ * - sibling matchlets doing the same test are merged
+ * - sibling strings at the same offset with a common prefix test for it
+ *   once, with the rest of each string as a child (and the children of a
+ *   string that is just the prefix as its own)
+ * - identical lists of matchlets are shared
+ *
+ * The magic file still has the rules as they were written.
+ */
 
+/* Shortest common prefix worth testing for once */
+#define MIN_MAGIC_PREFIX 2
 
 static void
-write_match (gpointer key,
-	     gpointer data)
+canonicalize_mask (Match *match)
 {
-  Magic *magic = (Magic *)key;
-  WriteMatchData *mdata = (WriteMatchData *)data;
-  gchar *mimetype;
-  guint offset;
+  gboolean all_set = TRUE;
+  gint i;
 
-  if (!write_card32 (mdata->cache, magic->priority))
-    {
-      mdata->error = TRUE;
-      return;
-    }
+  if (match->mask == NULL)
+    return;
 
-  mimetype = g_strdup_printf ("%s/%s", magic->type->media, magic->type->subtype);
-  offset = GPOINTER_TO_UINT (g_hash_table_lookup (mdata->strings, mimetype));
-  if (offset == 0)
-    {
-      g_warning ("Missing string: '%s'", mimetype);
-      g_free (mimetype);
-      mdata->error = TRUE;
-      return;
-    }
-  g_free (mimetype);
-  
-  if (!write_card32 (mdata->cache, offset))
+  for (i = 0; i < match->data_length; i++)
     {
-      mdata->error = TRUE;
-      return;
+      match->data[i] &= match->mask[i];
+      if ((guchar) match->mask[i] != 0xff)
+	all_set = FALSE;
     }
 
-  if (!write_card32 (mdata->cache, g_list_length (magic->matches)))
-    {
-      mdata->error = TRUE;
-      return;
-    }
+  if (all_set)
+    match->mask = NULL;
+}
+
+static gboolean
+same_magic_test (Match *a, Match *b)
+{
+  if (a->range_start != b->range_start ||
+      a->range_length != b->range_length ||
+      a->word_size != b->word_size ||
+      a->data_length != b->data_length ||
+      memcmp (a->data, b->data, a->data_length) != 0)
+    return FALSE;
+
+  if (a->mask == NULL || b->mask == NULL)
+    return a->mask == b->mask;
 
-    offset = mdata->offset + 32 * g_list_index (mdata->matches, magic->matches->data);
+  return memcmp (a->mask, b->mask, a->data_length) == 0;
+}
+
+/* 'a' matches if either 'a' or 'b' did. A matchlet without children only
+ * depends on its own test.
+ */
+static void
+merge_magic_children (Match *a, Match *b)
+{
+  Match *children;
 
-  if (!write_card32 (mdata->cache, offset))
+  if (a->n_matches == 0 || b->n_matches == 0)
     {
-      mdata->error = TRUE;
+      a->matches = NULL;
+      a->n_matches = 0;
       return;
     }
+
+  children = arena_alloc ((a->n_matches + b->n_matches) * sizeof (Match));
+  memcpy (children, a->matches, a->n_matches * sizeof (Match));
+  memcpy (children + a->n_matches, b->matches, b->n_matches * sizeof (Match));
+  a->matches = children;
+  a->n_matches += b->n_matches;
 }
 
+/* Whether a matchlet can be split into a prefix and the rest: it must
+ * test one offset, for unmasked bytes.
+ */
 static gboolean
-write_matchlet (FILE           *cache,
-		Match          *match,
-		GList          *matches,
-		gint            offset,
-		gint           *offset2)
+is_plain_string (Match *match)
 {
-  if (!write_card32 (cache, match->range_start) ||
-      !write_card32 (cache, match->range_length) ||
-      !write_card32 (cache, match->word_size) ||
-      !write_card32 (cache, match->data_length) ||
-      !write_card32 (cache, *offset2))
-    return FALSE;
-  
-  *offset2 = ALIGN_VALUE (*offset2 + match->data_length, 4);
-      
-  if (match->mask)
-    {
-      if (!write_card32 (cache, *offset2))
-	return FALSE;
-      
-      *offset2 = ALIGN_VALUE (*offset2 + match->data_length, 4);
-    }
-  else
-    {
-      if (!write_card32 (cache, 0))
-	return FALSE;
-    }
+  return match->mask == NULL && match->range_length == 1 &&
+	 match->word_size <= 1 && match->data_length >= MIN_MAGIC_PREFIX;
+}
+
+static gint
+cmp_plain_string (gconstpointer a, gconstpointer b)
+{
+  const Match *aa = *(Match **) a;
+  const Match *bb = *(Match **) b;
+  gint res;
+
+  if (aa->range_start != bb->range_start)
+    return aa->range_start < bb->range_start ? -1 : 1;
+  if (aa->word_size != bb->word_size)
+    return aa->word_size < bb->word_size ? -1 : 1;
+
+  res = memcmp (aa->data, bb->data, MIN (aa->data_length, bb->data_length));
+  if (res != 0)
+    return res;
+
+  return aa->data_length - bb->data_length;
+}
 
-  if (match->matches)
+static gint
+common_prefix (Match *a, Match *b)
+{
+  gint i;
+
+  for (i = 0; i < MIN (a->data_length, b->data_length); i++)
+    if (a->data[i] != b->data[i])
+      break;
+
+  return i;
+}
+
+/* Replaces each group of plain strings in 'matches' with a common prefix
+ * by one matchlet for the prefix, whose children are the rest of each
+ * string. A string that is just the prefix (there is at most one, as the
+ * same tests are already merged) gives it its children instead, or makes
+ * the prefix enough on its own if it has none. Returns the new number of
+ * matchlets.
+ */
+static gint
+factor_magic_prefixes (Match *matches, gint n_matches)
+{
+  GPtrArray *strings;
+  GArray *out;
+  gboolean *grouped;
+  Match *prefixes;
+  gint n_prefixes = 0, i, j, k;
+
+  strings = g_ptr_array_new ();
+  for (i = 0; i < n_matches; i++)
+    if (is_plain_string (&matches[i]))
+      g_ptr_array_add (strings, &matches[i]);
+  g_ptr_array_sort (strings, cmp_plain_string);
+
+  grouped = g_new0 (gboolean, n_matches);
+  prefixes = g_new0 (Match, n_matches);
+
+  for (i = 0; i < strings->len; i = j)
     {
-      if (!write_card32 (cache, g_list_length (match->matches)) ||
-	  !write_card32 (cache, offset + 32 * g_list_index (matches, match->matches->data)))
-	return FALSE;
+      Match *first = strings->pdata[i];
+      Match *children, *prefix;
+      gint length, n_children;
+      gboolean complete = FALSE;
+
+      /* Since the strings are sorted, the ones sharing a prefix with
+       * 'first' follow it, and the prefix they all share is the one
+       * between 'first' and the last of them.
+       */
+      for (j = i + 1; j < strings->len; j++)
+	{
+	  Match *match = strings->pdata[j];
+
+	  if (match->range_start != first->range_start ||
+	      match->word_size != first->word_size ||
+	      common_prefix (first, match) < MIN_MAGIC_PREFIX)
+	    break;
+	}
+
+      if (j - i < 2)
+	continue;
+
+      length = common_prefix (first, strings->pdata[j - 1]);
+
+      /* Only 'first' can be the prefix itself, as it sorts first */
+      n_children = j - i;
+      if (first->data_length == length)
+	n_children += first->n_matches - 1;
+
+      /* The prefix goes where the earliest string of the group was */
+      children = arena_alloc (MAX (n_children, 1) * sizeof (Match));
+      prefix = &prefixes[n_matches - 1];
+      n_children = 0;
+      for (k = i; k < j; k++)
+	{
+	  Match *match = strings->pdata[k];
+
+	  if (match->data_length == length)
+	    {
+	      if (match->n_matches == 0)
+		complete = TRUE;
+	      else
+		memcpy (children + n_children, match->matches,
+			match->n_matches * sizeof (Match));
+	      n_children += match->n_matches;
+	    }
+	  else
+	    {
+	      children[n_children] = *match;
+	      children[n_children].range_start += length;
+	      children[n_children].data += length;
+	      children[n_children].data_length -= length;
+	      n_children++;
+	    }
+	  grouped[match - matches] = TRUE;
+	  prefix = MIN (prefix, &prefixes[match - matches]);
+	}
+
+      *prefix = *first;
+      prefix->data_length = length;
+      prefix->matches = complete ? NULL : children;
+      prefix->n_matches = complete ? 0 : n_children;
+      n_prefixes++;
     }
-  else
+
+  if (n_prefixes > 0)
     {
-      if (!write_card32 (cache, 0) ||
-	  !write_card32 (cache, 0))
-	return FALSE;
+      out = g_array_sized_new (FALSE, FALSE, sizeof (Match), n_matches);
+      for (i = 0; i < n_matches; i++)
+	{
+	  if (prefixes[i].data_length > 0)
+	    g_array_append_val (out, prefixes[i]);
+	  if (!grouped[i])
+	    g_array_append_val (out, matches[i]);
+	}
+      memcpy (matches, out->data, out->len * sizeof (Match));
+      n_matches = out->len;
+      g_array_free (out, TRUE);
     }
 
-  return TRUE;
-}  
+  g_free (grouped);
+  g_free (prefixes);
+  g_ptr_array_free (strings, TRUE);
+
+  return n_matches;
+}
+
+static guint
+magic_list_hash (gconstpointer key)
+{
+  const GString *list = key;
+  guint h = 5381;
+  gsize i;
+
+  for (i = 0; i < list->len; i++)
+    h = h * 33 + (guchar) list->str[i];
+
+  return h;
+}
 
 static gboolean
-write_matchlet_data (FILE           *cache,
-		     Match          *match,
-		     gint           *offset2)
+magic_list_equal (gconstpointer a, gconstpointer b)
 {
-  if (!write_data (cache, match->data, match->data_length))
-    return FALSE;
-  
-  *offset2 = ALIGN_VALUE (*offset2 + match->data_length, 4);
+  const GString *aa = a;
+  const GString *bb = b;
 
-  if (match->mask)
+  return aa->len == bb->len && memcmp (aa->str, bb->str, aa->len) == 0;
+}
+
+static void
+free_magic_list_key (gpointer data)
+{
+  g_string_free ((GString *) data, TRUE);
+}
+
+/* Optimizes the list of sibling matchlets '*list', and their children.
+ * 'lists' maps the contents of each list seen so far to the list itself,
+ * so that identical lists (whose children are already shared) can be
+ * shared too.
+ */
+static void
+optimize_matches (Match     **list,
+		  gint       *n_matches,
+		  GHashTable *lists)
+{
+  Match *matches = *list;
+  gint n = *n_matches, i, j;
+  GString *key;
+  gpointer shared;
+
+  /* So that all empty lists look the same */
+  if (n == 0)
     {
-      if (!write_data (cache, match->mask, match->data_length))
-	return FALSE;
+      *list = NULL;
+      return;
+    }
 
-      *offset2 = ALIGN_VALUE (*offset2 + match->data_length, 4);
+  for (i = 0; i < n; i++)
+    canonicalize_mask (&matches[i]);
+
+  for (i = 0; i < n; i++)
+    for (j = i + 1; j < n; )
+      {
+	if (same_magic_test (&matches[i], &matches[j]))
+	  {
+	    merge_magic_children (&matches[i], &matches[j]);
+	    memmove (&matches[j], &matches[j + 1], (n - j - 1) * sizeof (Match));
+	    n--;
+	  }
+	else
+	  j++;
+      }
+
+  n = factor_magic_prefixes (matches, n);
+  *n_matches = n;
+
+  for (i = 0; i < n; i++)
+    optimize_matches (&matches[i].matches, &matches[i].n_matches, lists);
+
+  key = g_string_new (NULL);
+  for (i = 0; i < n; i++)
+    {
+      Match *match = &matches[i];
+
+      g_string_append_printf (key, "%ld %d %d %d %d %p %d:",
+			      match->range_start, match->range_length,
+			      match->word_size, match->data_length,
+			      match->mask != NULL, (void *) match->matches,
+			      match->n_matches);
+      g_string_append_len (key, match->data, match->data_length);
+      if (match->mask)
+	g_string_append_len (key, match->mask, match->data_length);
     }
 
-  return TRUE;
+  if (g_hash_table_lookup_extended (lists, key, NULL, &shared))
+    {
+      *list = shared;
+      g_string_free (key, TRUE);
+    }
+  else
+    g_hash_table_insert (lists, key, matches);
 }
 
 static void
-collect_matches_list (GList *list, GList **matches)
+optimize_magic_rules (void)
 {
-  GList *l;
+  GHashTable *lists;
+  guint i;
 
-  for (l = list; l; l = l->next)
-    *matches = g_list_prepend (*matches, l->data);
+  lists = g_hash_table_new_full (magic_list_hash, magic_list_equal,
+				 free_magic_list_key, NULL);
 
-  for (l = list; l; l = l->next)
-    {  
-      Match *match = (Match *)l->data;
-      collect_matches_list (match->matches, matches);
+  for (i = 0; i < magic_array->len; i++)
+    {
+      Magic *magic = (Magic *) magic_array->pdata[i];
+
+      optimize_matches (&magic->matches, &magic->n_matches, lists);
     }
+
+  g_hash_table_destroy (lists);
 }
 
-static void
-collect_matches (gpointer key, gpointer data)
+/* How many bytes of data readers need for 'match' (as counted by the
+ * max_extent field of the magic section)
+ */
+static guint
+match_extent (Match *match)
 {
-  Magic *magic = (Magic *)key;
-  GList **matches = (GList **)data;
-
-  collect_matches_list (magic->matches, matches);
+  return match->data_length + match->range_start + match->range_length;
 }
 
-static gboolean
-write_magic_cache (FILE        *cache, 
+static void
+write_magic_cache (GString     *cache, 
 		   GHashTable *strings, 
 		   guint      *offset)
 {
   guint n_entries, max_extent;
   gint offset2;
-  GList *m;
-  WriteMatchData data;
+  guint i;
+  MatchList data;
   
-  data.matches = NULL;
-  g_ptr_array_foreach (magic_array, collect_matches, &data.matches);
-  data.matches = g_list_reverse (data.matches);
+  data.matches = g_ptr_array_new ();
+  data.first_child = g_array_new (FALSE, FALSE, sizeof (guint));
+  data.first_match = g_array_sized_new (FALSE, FALSE, sizeof (guint),
+					magic_array->len);
+  data.lists = g_hash_table_new (g_direct_hash, g_direct_equal);
+  g_ptr_array_foreach (magic_array, collect_matches, &data);
 
   max_extent = 0;
-  for (m = data.matches; m; m = m->next)
+  for (i = 0; i < data.matches->len; i++)
     {
-      Match *match = (Match *)m->data;
-      max_extent = MAX (max_extent, match->data_length + match->range_start + match->range_length);
+      Match *match = (Match *)data.matches->pdata[i];
+      max_extent = MAX (max_extent, match_extent (match));
     }
 
   n_entries = magic_array->len;
 
   *offset += 12;
   
-  if (!write_card32 (cache, n_entries) ||
-      !write_card32 (cache, max_extent) ||
-      !write_card32 (cache, *offset))
-    return FALSE;
+  write_card32 (cache, n_entries);
+  write_card32 (cache, max_extent);
+  write_card32 (cache, *offset);
 
   *offset += 16 * n_entries;
 
-  data.cache = cache;
-  data.strings = strings;
-  data.offset = *offset;
-  data.error = FALSE;
+  for (i = 0; i < magic_array->len; i++)
+    write_match (cache, (Magic *)magic_array->pdata[i],
+		 g_array_index (data.first_match, guint, i), *offset);
 
-  offset2 = *offset + 32 * g_list_length (data.matches);
+  offset2 = *offset + 32 * data.matches->len;
 
-  g_ptr_array_foreach (magic_array, write_match, &data);
-  for (m = data.matches; m; m = m->next)
-    {
-      Match *match = (Match *)m->data;
-      write_matchlet (cache, match, data.matches, *offset, &offset2);
-    }
+  for (i = 0; i < data.matches->len; i++)
+    write_matchlet (cache, (Match *)data.matches->pdata[i],
+		    g_array_index (data.first_child, guint, i),
+		    *offset, &offset2);
 
-  offset2 = *offset + 32 * g_list_length (data.matches);
+  offset2 = *offset + 32 * data.matches->len;
 
-  for (m = data.matches; m; m = m->next)
-    {
-      Match *match = (Match *)m->data;
-      write_matchlet_data (cache, match, &offset2);
-    }
+  for (i = 0; i < data.matches->len; i++)
+    write_matchlet_data (cache, (Match *)data.matches->pdata[i], &offset2);
 
   *offset = offset2;
 
-  g_list_free (data.matches);
-
-  return !data.error;
+  g_ptr_array_free (data.matches, TRUE);
+  g_array_free (data.first_child, TRUE);
+  g_array_free (data.first_match, TRUE);
+  g_hash_table_destroy (data.lists);
 }
 
-static gchar **
-get_namespace_value (gpointer  data, 
-		     gchar    *key)
+static guint
+write_namespace_entry (MapData    *map_data,
+		       GHashTable *map,
+		       gchar      *key)
 {
   Type *type;
-  gchar **result;
   gchar *space;
 
-  type = (Type *)g_hash_table_lookup ((GHashTable *)data, key);
+  type = (Type *)g_hash_table_lookup (map, key);
   
-  result = g_new0 (gchar *, 4);
+  /* The key is "namespaceURI localName" */
   space = strchr (key, ' ');
-  if (*space)
-    {
-      *space = '\0';
-      result[0] = g_strdup (key);
-      result[1] = g_strdup (space + 1);
-      *space = ' ';
-    }
-  else 
-    result[0] = g_strdup (key);
+  *space = '\0';
+  write_string_offset (map_data, key);
+  write_string_offset (map_data, space + 1);
+  *space = ' ';
 
-  result[2] = g_strdup_printf ("%s/%s", type->media, type->subtype);
+  write_card32 (map_data->cache, type->cache_offset);
 
-  return result;
+  return 1;
 }
 
 static gboolean
-write_namespace_cache (FILE       *cache,
+write_namespace_cache (GString    *cache,
 		       GHashTable *strings,
 		       guint      *offset)
 {
   return write_map (cache, strings, namespace_hash, NULL, 
-		    get_namespace_value, FALSE, offset); 
+		    write_namespace_entry, NULL, offset); 
 }
 
-static gchar **
-get_icon_value (gpointer  data, 
-                gchar    *key)
+static guint
+write_icon_entry (MapData    *map_data,
+		  GHashTable *map,
+		  gchar      *key)
 {
-  gchar *iconname;
-  gchar **result;
-
-  iconname = (gchar *)g_hash_table_lookup ((GHashTable *)data, key);
-  
-  result = g_new0 (gchar *, 3);
-  result[0] = g_strdup (key);
-  result[1] = g_strdup (iconname);
-  result[2] = NULL;
+  write_string_offset (map_data, key);
+  write_string_offset (map_data, g_hash_table_lookup (map, key));
 
-  return result;
+  return 1;
 }
 
 static gboolean
-write_icons_cache (FILE       *cache,
+write_icons_cache (GString    *cache,
                    GHashTable *strings,
                    GHashTable *icon_hash,
                    guint      *offset)
 {
   return write_map (cache, strings, icon_hash, NULL, 
-                    get_icon_value, FALSE, offset); 
+                    write_icon_entry, NULL, offset); 
 }
 
-/* Write all the collected types */
-static gboolean
-write_types_cache (FILE       *cache,
-                   GHashTable *strings,
-                   GHashTable *types,
-                   guint      *offset)
+/* Sort the types by name and number them in that order */
+static GPtrArray *
+number_types (void)
 {
-	GPtrArray *lines;
+	GPtrArray *sorted;
+	GHashTableIter iter;
+	gpointer value;
 	int i;
-	char *mimetype;
-	guint mime_offset;
-	
-	lines = g_ptr_array_new();
 
-	g_hash_table_foreach(types, add_type, lines);
+	sorted = g_ptr_array_sized_new(g_hash_table_size(types));
 
-	g_ptr_array_sort(lines, strcmp2);
+	g_hash_table_iter_init(&iter, types);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+		g_ptr_array_add(sorted, value);
 
-  	if (!write_card32 (cache, lines->len))
-    		return FALSE;
+	g_ptr_array_sort(sorted, cmp_type_name);
 
-	for (i = 0; i < lines->len; i++)
+	for (i = 0; i < sorted->len; i++)
+		((Type *) sorted->pdata[i])->id = i;
+
+	return sorted;
+}
+
+/* Write all the collected types, as numbered by number_types() */
+static void
+write_types_cache (GString   *cache,
+                   GPtrArray *sorted,
+                   guint     *offset)
+{
+	int i;
+
+	write_card32 (cache, sorted->len);
+
+	for (i = 0; i < sorted->len; i++)
 	{
-		mimetype = (char *) lines->pdata[i];
-		mime_offset = GPOINTER_TO_UINT (g_hash_table_lookup (strings, mimetype));
-		if (!write_card32 (cache, mime_offset))
-			return FALSE;
+		Type *type = (Type *) sorted->pdata[i];
 
-		g_free(mimetype);
+		write_card32 (cache, type->cache_offset);
 	}
 
-  	*offset += 4 + 4 * lines->len;
+  	*offset += 4 + 4 * sorted->len;
+}
 
-	g_ptr_array_free(lines, TRUE);
+/* Extra sections that the header has no room for are listed in a
+ * directory at the end of the file. The header is followed by
+ * EXTENSIONS_MAGIC (which can't start a string) and the offset of the
+ * directory: a count, then a (tag, offset) pair for each section.
+ * Readers skip any tags they don't know.
+ */
+#define EXTENSIONS_MAGIC 0xFF455854
+#define EXTENSION_TAG(a, b, c, d) \
+  ((guint32) (a) << 24 | (guint32) (b) << 16 | (guint32) (c) << 8 | (guint32) (d))
 
-	return TRUE;
-}
+/* Perfect hash indexes over the literal glob and alias sections */
+#define EXTENSION_LITERAL_HASH EXTENSION_TAG ('L', 'H', 'S', 'H')
+#define EXTENSION_ALIAS_HASH   EXTENSION_TAG ('A', 'H', 'S', 'H')
 
-static void
-collect_alias (gpointer key,
-	       gpointer value,
-	       gpointer data)
-{
-  GHashTable *strings = (GHashTable *)data;
-  Type *type = (Type *)value;
-  gchar *mimetype;
-  
-  mimetype = g_strdup_printf ("%s/%s", type->media, type->subtype);
-  g_hash_table_insert (strings, key, NULL);
-  g_hash_table_insert (strings, mimetype, NULL);
-}
+/* The transitive <sub-class-of> ancestors of each type, with the
+ * implicit text/plain and application/octet-stream parents
+ */
+#define EXTENSION_ANCESTORS    EXTENSION_TAG ('A', 'N', 'C', 'S')
 
+/* The reverse: all the types that are subclasses of each type, so every
+ * text type for text/plain and every type but the inode ones for
+ * application/octet-stream
+ */
+#define EXTENSION_DESCENDANTS  EXTENSION_TAG ('D', 'E', 'S', 'C')
 
-static void
-collect_parents (gpointer key,
-		 gpointer value,
-		 gpointer data)
-{
-  GList *parents = (GList *)value;
-  GHashTable *strings = (GHashTable *)data;
-  GList *p;
-  
-  g_hash_table_insert (strings, key, NULL);
-  for (p = parents; p; p = p->next)
-    g_hash_table_insert (strings, p->data, NULL);
-}
+/* The direct <sub-class-of> parents of each type */
+#define EXTENSION_PARENTS      EXTENSION_TAG ('P', 'R', 'N', 'T')
+
+/* The type IDs for the records of the standard sections */
+#define EXTENSION_TYPE_IDS     EXTENSION_TAG ('T', 'I', 'D', 'S')
+
+/* An automaton matching all the full globs at once */
+#define EXTENSION_GLOB_DFA     EXTENSION_TAG ('G', 'D', 'F', 'A')
+
+/* The magic entries that can match data starting with each byte value */
+#define EXTENSION_MAGIC_DISPATCH EXTENSION_TAG ('M', 'D', 'S', 'P')
+
+/* An automaton finding the data of all ranged string matchlets at once */
+#define EXTENSION_MAGIC_STRINGS EXTENSION_TAG ('M', 'S', 'T', 'R')
+
+/* The magic entries grouped by how much data they need */
+#define EXTENSION_MAGIC_TIERS  EXTENSION_TAG ('M', 'T', 'I', 'R')
+
+/* The magic rules compiled into programs that need no recursion */
+#define EXTENSION_MAGIC_PROGRAM EXTENSION_TAG ('M', 'P', 'R', 'G')
+
+/* The ID used in the type ID tables for something that isn't a type */
+#define NO_TYPE 0xFFFFFFFF
+
+typedef struct
+{
+  guint32 tag;
+  guint32 offset;
+} Extension;
 
 static void
-collect_glob (gpointer key,
-	      gpointer value,
-	      gpointer data)
+add_extension (GArray *extensions, guint32 tag, guint32 offset)
 {
-  GList *list = (GList *)value;
-  GHashTable *strings = (GHashTable *)data;
-  gchar *mimetype;
-  Glob *glob;
-  Type *type;
+  Extension extension = { tag, offset };
 
-  switch (glob_type ((char *)key))
-    {
-      case GLOB_LITERAL:
-      case GLOB_FULL:
-        g_hash_table_insert (strings, key, NULL);
-        break;
-     default:
-        break;
-   }
+  g_array_append_val (extensions, extension);
+}
 
-  for (; list; list = list->next)
-    {
-      glob = (Glob *)list->data;
-      type = glob->type;
-      mimetype = g_strdup_printf ("%s/%s", type->media, type->subtype);
+/* The hash function used by the perfect hash indexes. Readers must use
+ * exactly the same one: 32-bit FNV-1a starting from the seed, followed
+ * by the MurmurHash3 finaliser.
+ */
+static guint32
+cache_hash (const gchar *str, guint32 seed)
+{
+  guint32 h = 2166136261u ^ seed;
 
-     g_hash_table_insert (strings, mimetype, NULL);
+  for (; *str; str++)
+    {
+      h ^= (guchar) *str;
+      h *= 16777619u;
     }
+
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+
+  return h;
 }
 
-static void
-collect_magic (gpointer key,
-	       gpointer data)
+typedef struct
 {
-  Magic *magic = (Magic *)key;
-  GHashTable *strings = (GHashTable *)data;
-  gchar *mimetype;
-  
-  mimetype = g_strdup_printf ("%s/%s", magic->type->media, magic->type->subtype);
-  g_hash_table_insert (strings, mimetype, NULL);
+  guint bucket;
+  guint n_keys;
+  guint first_key;	/* in the 'by_bucket' array */
+} HashBucket;
+
+static gint
+cmp_bucket_size (gconstpointer a, gconstpointer b)
+{
+  const HashBucket *aa = a;
+  const HashBucket *bb = b;
+
+  if (aa->n_keys != bb->n_keys)
+    return bb->n_keys - aa->n_keys;
+
+  return aa->bucket - bb->bucket;
 }
 
-static void
-collect_namespace (gpointer key,
-		   gpointer value,
-		   gpointer data)
+/* Find a displacement for every bucket, so that each key gets a slot
+ * of its own. Returns FALSE if some bucket can't be placed.
+ */
+static gboolean
+place_buckets (GPtrArray *keys,
+	       guint32    seed,
+	       guint      n_buckets,
+	       guint32   *displacements,
+	       guint32   *slots)
 {
-  gchar *ns = (gchar *)key;
-  Type *type = (Type *)value;
-  GHashTable *strings = (GHashTable *)data;
-  gchar *mimetype;
-  gchar *space;
+  HashBucket *buckets;
+  guint *by_bucket, *fill;
+  guint n_keys = keys->len;
+  gboolean *used;
+  guint *tried;
+  guint i, j = 0;
+  gboolean ok = TRUE;
+
+  buckets = g_new0 (HashBucket, n_buckets);
+  by_bucket = g_new (guint, n_keys);
+  fill = g_new0 (guint, n_buckets);
+  used = g_new0 (gboolean, n_keys);
+  tried = g_new (guint, n_keys);
+
+  for (i = 0; i < n_buckets; i++)
+    buckets[i].bucket = i;
+  for (i = 0; i < n_keys; i++)
+    buckets[cache_hash (keys->pdata[i], seed) % n_buckets].n_keys++;
+  for (i = 1; i < n_buckets; i++)
+    buckets[i].first_key = buckets[i - 1].first_key + buckets[i - 1].n_keys;
+  for (i = 0; i < n_keys; i++)
+    {
+      guint b = cache_hash (keys->pdata[i], seed) % n_buckets;
 
-  mimetype = g_strdup_printf ("%s/%s", type->media, type->subtype);
-  g_hash_table_insert (strings, mimetype, NULL);
-  
-  space = strchr (ns, ' ');
+      by_bucket[buckets[b].first_key + fill[b]++] = i;
+    }
 
-  if (space)
+  /* The biggest buckets are the hardest to place, so do them first */
+  qsort (buckets, n_buckets, sizeof (HashBucket), cmp_bucket_size);
+
+  for (i = 0; i < n_buckets && ok; i++)
     {
-      *space = '\0';
-      g_hash_table_insert (strings, g_strdup (ns), NULL);
-      g_hash_table_insert (strings, space + 1, NULL);
-      *space = ' ';
+      HashBucket *bucket = &buckets[i];
+      guint32 d;
+
+      if (bucket->n_keys == 0)
+	{
+	  displacements[bucket->bucket] = 0;
+	  continue;
+	}
+
+      for (d = 1; d < 64 * n_keys + 1024; d++)
+	{
+	  for (j = 0; j < bucket->n_keys; j++)
+	    {
+	      guint key = by_bucket[bucket->first_key + j];
+	      guint slot = cache_hash (keys->pdata[key], d) % n_keys;
+
+	      if (used[slot])
+		break;
+	      used[slot] = TRUE;
+	      tried[j] = slot;
+	    }
+
+	  if (j == bucket->n_keys)
+	    break;
+
+	  /* Undo the partial placement */
+	  while (j > 0)
+	    used[tried[--j]] = FALSE;
+	}
+
+      if (j != bucket->n_keys)
+	{
+	  ok = FALSE;
+	  break;
+	}
+
+      displacements[bucket->bucket] = d;
+      for (j = 0; j < bucket->n_keys; j++)
+	slots[tried[j]] = by_bucket[bucket->first_key + j];
     }
-  else     
-    g_hash_table_insert (strings, ns, NULL);
+
+  g_free (buckets);
+  g_free (by_bucket);
+  g_free (fill);
+  g_free (used);
+  g_free (tried);
+
+  return ok;
 }
 
-static void 
-collect_icons(gpointer key, 
-              gpointer value, 
-              gpointer data)
+/* Write a minimal perfect hash index over the keys of a map section:
+ *
+ *   CARD32 seed
+ *   CARD32 n_buckets
+ *   CARD32 n_keys
+ *   CARD32 displacement[n_buckets]
+ *   CARD32 first_record[n_keys]
+ *
+ * A key is looked up by taking bucket = hash (key, seed) % n_buckets,
+ * then slot = hash (key, displacement[bucket]) % n_keys. first_record[slot]
+ * is the index in the map section of the only record that can match, so a
+ * single string comparison tells whether the key is there (any other
+ * records for the same key follow it).
+ */
+static gboolean
+write_hash_index (GString *cache,
+		  MapKeys *map_keys,
+		  guint   *offset)
 {
-  gchar *mimetype = (gchar *)key;
-  gchar *iconname = (gchar *)value;
-  GHashTable *strings = (GHashTable *)data;
+  guint n_keys = map_keys->keys->len;
+  guint n_buckets = n_keys ? n_keys / 4 + 1 : 0;
+  guint32 *displacements, *slots;
+  guint32 seed = 0;
+  gboolean placed;
+  guint i;
+
+  displacements = g_new0 (guint32, n_buckets);
+  slots = g_new0 (guint32, n_keys);
+
+  /* Another seed gives a different split into buckets */
+  placed = n_keys == 0 ||
+	   place_buckets (map_keys->keys, seed, n_buckets, displacements, slots);
+  while (!placed && ++seed < 32)
+    placed = place_buckets (map_keys->keys, seed, n_buckets,
+			    displacements, slots);
+
+  if (placed)
+    {
+      write_card32 (cache, seed);
+      write_card32 (cache, n_buckets);
+      write_card32 (cache, n_keys);
+      for (i = 0; i < n_buckets; i++)
+	write_card32 (cache, displacements[i]);
+      for (i = 0; i < n_keys; i++)
+	write_card32 (cache, g_array_index (map_keys->first, guint,
+					    slots[i]));
+      *offset += 12 + 4 * (n_buckets + n_keys);
+    }
+  else
+    g_warning ("Failed to build a perfect hash for %u keys", n_keys);
 
-  g_hash_table_insert (strings, mimetype, NULL);
-  g_hash_table_insert (strings, iconname, NULL);
-}
+  g_free (displacements);
+  g_free (slots);
 
+  return placed;
+}
 
-static void
-collect_strings (GHashTable *strings)
+/* The Type for a name used in <sub-class-of>, which may be an alias.
+ * NULL if there's no such type.
+ */
+static Type *
+find_type (const gchar *name)
 {
-  g_hash_table_foreach (alias_hash, collect_alias, strings); 
-  g_hash_table_foreach (subclass_hash, collect_parents, strings); 
-  g_hash_table_foreach (globs_hash, collect_glob, strings); 
-  g_ptr_array_foreach (magic_array, collect_magic, strings); 
-  g_hash_table_foreach (namespace_hash, collect_namespace, strings); 
-  g_hash_table_foreach (generic_icon_hash, collect_icons, strings); 
-  g_hash_table_foreach (icon_hash, collect_icons, strings); 
+  Type *type;
+
+  type = g_hash_table_lookup (types, name);
+  if (type == NULL)
+    type = g_hash_table_lookup (alias_hash, name);
+
+  return type;
 }
 
-typedef struct 
+static void add_ancestors (Type *type, guchar *seen, GArray *ids);
+
+static void
+add_ancestor (Type   *ancestor,
+	      guchar *seen,
+	      GArray *ids)
 {
-  FILE       *cache;
-  GHashTable *strings;
-  guint       offset;
-  gboolean    error;
-} StringData;
+  if (ancestor == NULL || seen[ancestor->id])
+    return;
 
+  seen[ancestor->id] = TRUE;
+  g_array_append_val (ids, ancestor->id);
+  add_ancestors (ancestor, seen, ids);
+}
+
+/* Adds the parents of 'type' and their ancestors. As for readers, every
+ * text type is a subclass of text/plain and every type apart from the
+ * inode ones one of application/octet-stream, including those that
+ * only inherit from such a type.
+ */
 static void
-write_one_string (gpointer key,
-		  gpointer value,
-		  gpointer data)
+add_ancestors (Type   *type,
+	       guchar *seen,
+	       GArray *ids)
 {
-  gchar *str = (gchar *)key;
-  StringData *sdata = (StringData *)data;
+  GSList *p;
 
-  if (!write_string (sdata->cache, str))
-    sdata->error = TRUE;
+  for (p = g_hash_table_lookup (subclass_hash, type->name); p; p = p->next)
+    add_ancestor (find_type ((gchar *) p->data), seen, ids);
 
-  g_hash_table_insert (sdata->strings, str, GUINT_TO_POINTER (sdata->offset));
-  
-  sdata->offset = ALIGN_VALUE (sdata->offset + strlen (str) + 1, 4);
+  if (strcmp (type->media, "text") == 0)
+    add_ancestor (find_type ("text/plain"), seen, ids);
+  if (strcmp (type->media, "inode") != 0)
+    add_ancestor (find_type ("application/octet-stream"), seen, ids);
 }
 
-static gboolean
-write_strings (FILE       *cache, 
-	       GHashTable *strings,       
-	       guint      *offset)
+static gint
+cmp_id (gconstpointer a, gconstpointer b)
+{
+  guint aa = *(const guint *) a;
+  guint bb = *(const guint *) b;
+
+  return aa < bb ? -1 : aa > bb;
+}
+
+/* Returns a GArray for each type in 'sorted', holding the IDs of all its
+ * ancestors in increasing order, including the implicit ones (see
+ * add_ancestors()). Parents that aren't known types are left out.
+ */
+static GArray **
+get_ancestors (GPtrArray *sorted)
 {
-  StringData data;
+  GArray **ancestors;
+  guchar *seen;
+  guint i;
+
+  ancestors = g_new (GArray *, sorted->len);
+  seen = g_new (guchar, sorted->len);
 
-  data.cache = cache;
-  data.strings = strings;
-  data.offset = *offset;
-  data.error = FALSE;
+  for (i = 0; i < sorted->len; i++)
+    {
+      Type *type = (Type *) sorted->pdata[i];
+
+      memset (seen, 0, sorted->len);
+      seen[type->id] = TRUE;
 
-  g_hash_table_foreach (strings, write_one_string, &data);
+      ancestors[i] = g_array_new (FALSE, FALSE, sizeof (guint));
+      add_ancestors (type, seen, ancestors[i]);
+      g_array_sort (ancestors[i], cmp_id);
+    }
 
-  *offset = data.offset;
+  g_free (seen);
 
-  return !data.error;
+  return ancestors;
 }
 
-static gboolean 
-write_cache (FILE *cache)
+/* Returns a GArray for each type in 'sorted', holding the IDs of its
+ * direct parents in increasing order.
+ */
+static GArray **
+get_parents (GPtrArray *sorted)
 {
-  guint strings_offset;
-  guint alias_offset;
-  guint parent_offset;
-  guint literal_offset;
-  guint suffix_offset;
-  guint glob_offset;
-  guint magic_offset;
-  guint namespace_offset;
-  guint icons_list_offset;
-  guint generic_icons_list_offset;
-  guint type_offset;
-  guint offset;
-  GHashTable *strings;
+  GArray **parents;
+  guint i;
 
-  offset = 0;
-  if (!write_header (cache, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, &offset))
+  parents = g_new (GArray *, sorted->len);
+
+  for (i = 0; i < sorted->len; i++)
     {
-      g_warning ("Failed to write header");
-      return FALSE;
+      Type *type = (Type *) sorted->pdata[i];
+      GSList *p;
+
+      parents[i] = g_array_new (FALSE, FALSE, sizeof (guint));
+      for (p = g_hash_table_lookup (subclass_hash, type->name); p; p = p->next)
+	{
+	  Type *parent = find_type ((gchar *) p->data);
+	  guint j;
+
+	  if (parent == NULL || parent == type)
+	    continue;
+
+	  for (j = 0; j < parents[i]->len; j++)
+	    if (g_array_index (parents[i], guint, j) == parent->id)
+	      break;
+	  if (j == parents[i]->len)
+	    g_array_append_val (parents[i], parent->id);
+	}
+      g_array_sort (parents[i], cmp_id);
     }
 
-  strings = g_hash_table_new (g_str_hash, g_str_equal);
-  collect_strings (strings);
-  strings_offset = offset;
+  return parents;
+}
+
+/* Turns the ancestor sets into descendant sets. Since the types are
+ * visited in order, the IDs in each set come out sorted. The implicit
+ * parents are in the ancestor sets, so text/plain and
+ * application/octet-stream get their implicit descendants too.
+ */
+static GArray **
+get_descendants (GArray **ancestors, guint n)
+{
+  GArray **descendants;
+  guint i, j;
+
+  descendants = g_new (GArray *, n);
+  for (i = 0; i < n; i++)
+    descendants[i] = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  for (i = 0; i < n; i++)
+    for (j = 0; j < ancestors[i]->len; j++)
+      g_array_append_val (descendants[g_array_index (ancestors[i], guint, j)],
+			  i);
+
+  return descendants;
+}
+
+static void
+free_id_sets (GArray **sets, guint n)
+{
+  guint i;
+
+  for (i = 0; i < n; i++)
+    g_array_free (sets[i], TRUE);
+  g_free (sets);
+}
+
+/* Write a set of type IDs for each of the 'n' types: the count, then the
+ * index in 'ids' where the set of each type starts (with an extra entry
+ * for the end of the last set), then 'ids' itself. The IDs in each set
+ * are in increasing order, so a reader can test for one with a binary
+ * search.
+ */
+static void
+write_id_sets (GString *cache,
+	       GArray **sets,
+	       guint    n,
+	       guint   *offset)
+{
+  guint i, j, first = 0;
 
-  if (!write_strings (cache, strings, &offset))
+  write_card32 (cache, n);
+  for (i = 0; i < n; i++)
     {
-      g_warning ("Failed to write strings");
-      return FALSE;
+      write_card32 (cache, first);
+      first += sets[i]->len;
     }
-  g_message ("Wrote %d strings at %x - %x",
-	   g_hash_table_size (strings), strings_offset, offset);
+  write_card32 (cache, first);
 
-  alias_offset = offset;
-  if (!write_alias_cache (cache, strings, &offset))
+  for (i = 0; i < n; i++)
+    for (j = 0; j < sets[i]->len; j++)
+      write_card32 (cache, g_array_index (sets[i], guint, j));
+
+  *offset += 4 + 4 * (n + 1) + 4 * first;
+}
+
+/* The ID of the type whose name is at 'offset' in the string pool, or
+ * NO_TYPE. The pool is sorted, so the names are in the same order as the
+ * types themselves.
+ */
+static guint32
+type_id_at (GPtrArray *sorted, guint32 offset)
+{
+  guint lo = 0, hi = sorted->len;
+
+  while (lo < hi)
     {
-      g_warning ("Failed to write alias list");
-      return FALSE;
+      guint mid = (lo + hi) / 2;
+      Type *type = (Type *) sorted->pdata[mid];
+
+      if (type->cache_offset == offset)
+	return type->id;
+      if (type->cache_offset < offset)
+	lo = mid + 1;
+      else
+	hi = mid;
     }
-  g_message ("Wrote aliases at %x - %x", alias_offset, offset);
 
-  parent_offset = offset;
-  if (!write_parent_cache (cache, strings, &offset))
+  return NO_TYPE;
+}
+
+/* Where the type names are in the records of one standard section */
+typedef struct
+{
+  guint32 first;        /* offset of the first record */
+  guint32 n;            /* number of records */
+  guint record_size;
+  guint field;          /* offset of the type name in a record */
+  gboolean leaves_only; /* only records starting with 0 name a type */
+} TypeIdTable;
+
+/* The type IDs section lets readers compare and merge the results of
+ * lookups as integers. It holds the number of tables, the offset of each,
+ * then the tables: for each standard section that names types, in the
+ * order of the header, the number of records followed by the ID of the
+ * type named by each record. The tables are:
+ *
+ * - aliases, parents and literal globs, one ID for each record (the type
+ *   that is the subclass, for the parents)
+ * - the suffix tree, one ID for each of the 'n_suffix_nodes' nodes in the
+ *   order they are written, NO_TYPE for the nodes that aren't leaves
+ * - full globs, then the magic matches (not the matchlets)
+ * - namespaces, icons and generic icons
+ *
+ * The sections are read back from 'cache' rather than having every
+ * writer keep track of the types it wrote.
+ */
+static void
+write_type_ids (GString   *cache,
+		GPtrArray *sorted,
+		guint      alias_offset,
+		guint      parent_offset,
+		guint      literal_offset,
+		guint      suffix_offset,
+		guint      n_suffix_nodes,
+		guint      glob_offset,
+		guint      magic_offset,
+		guint      namespace_offset,
+		guint      icons_list_offset,
+		guint      generic_icons_list_offset,
+		guint     *offset)
+{
+  TypeIdTable tables[9];
+  gsize tables_pos;
+  guint i, j;
+
+#define MAP_TABLE(table, section, size, type_field) \
+  (table).first = (section) + 4; \
+  (table).n = get_card32 (cache, (section)); \
+  (table).record_size = (size); \
+  (table).field = (type_field); \
+  (table).leaves_only = FALSE
+
+  MAP_TABLE (tables[0], alias_offset, 8, 4);
+  MAP_TABLE (tables[1], parent_offset, 8, 0);
+  MAP_TABLE (tables[2], literal_offset, 12, 4);
+  MAP_TABLE (tables[4], glob_offset, 12, 4);
+  MAP_TABLE (tables[6], namespace_offset, 12, 8);
+  MAP_TABLE (tables[7], icons_list_offset, 8, 0);
+  MAP_TABLE (tables[8], generic_icons_list_offset, 8, 0);
+
+#undef MAP_TABLE
+
+  /* All the nodes of the suffix tree are written together */
+  tables[3].first = get_card32 (cache, suffix_offset + 4);
+  tables[3].n = n_suffix_nodes;
+  tables[3].record_size = 12;
+  tables[3].field = 4;
+  tables[3].leaves_only = TRUE;
+
+  tables[5].first = get_card32 (cache, magic_offset + 8);
+  tables[5].n = get_card32 (cache, magic_offset);
+  tables[5].record_size = 16;
+  tables[5].field = 4;
+  tables[5].leaves_only = FALSE;
+
+  write_card32 (cache, G_N_ELEMENTS (tables));
+  tables_pos = cache->len;
+  for (i = 0; i < G_N_ELEMENTS (tables); i++)
+    write_card32 (cache, 0);
+  *offset += 4 + 4 * G_N_ELEMENTS (tables);
+
+  for (i = 0; i < G_N_ELEMENTS (tables); i++)
     {
-      g_warning ("Failed to write parent list");
-      return FALSE;
+      TypeIdTable *table = &tables[i];
+
+      set_card32 (cache, tables_pos + 4 * i, *offset);
+      write_card32 (cache, table->n);
+
+      for (j = 0; j < table->n; j++)
+	{
+	  guint32 record = table->first + j * table->record_size;
+	  guint32 id = NO_TYPE;
+
+	  if (!table->leaves_only || get_card32 (cache, record) == 0)
+	    id = type_id_at (sorted, get_card32 (cache, record + table->field));
+
+	  write_card32 (cache, id);
+	}
+
+      *offset += 4 + 4 * table->n;
     }
-  g_message ("Wrote parents at %x - %x", parent_offset, offset);
+}
 
-  literal_offset = offset;
-  if (!write_literal_cache (cache, strings, &offset))
+/* One step of a compiled glob: a set of bytes, matched either once or
+ * any number of times.
+ */
+typedef struct
+{
+  guint32 bytes[8];
+  gboolean repeat;
+} GlobAtom;
+
+#define GLOB_ATOM_HAS(atom, b) (((atom)->bytes[(b) >> 5] >> ((b) & 31)) & 1)
+#define GLOB_ATOM_ADD(atom, b) ((atom)->bytes[(b) >> 5] |= 1u << ((b) & 31))
+
+/* Stop building the automaton if it gets bigger than this */
+#define MAX_GLOB_DFA_STATES 4096
+
+static GlobAtom *
+add_glob_atom (GArray *atoms, gboolean repeat)
+{
+  GlobAtom atom = { { 0, }, FALSE };
+
+  atom.repeat = repeat;
+  g_array_append_val (atoms, atom);
+
+  return &g_array_index (atoms, GlobAtom, atoms->len - 1);
+}
+
+static void
+add_glob_byte (GlobAtom *atom, guchar c, gboolean case_sensitive)
+{
+  GLOB_ATOM_ADD (atom, c);
+  if (!case_sensitive)
     {
-      g_warning ("Failed to write literal list");
-      return FALSE;
+      GLOB_ATOM_ADD (atom, g_ascii_tolower (c));
+      GLOB_ATOM_ADD (atom, g_ascii_toupper (c));
     }
-  g_message ("Wrote literal globs at %x - %x", literal_offset, offset);
+}
 
-  suffix_offset = offset;
-  if (!write_suffix_cache (cache, strings, &offset))
+/* Matches the rest of a UTF-8 character, after its first byte */
+static void
+add_glob_continuation (GArray *atoms)
+{
+  GlobAtom *atom;
+  guint c;
+
+  atom = add_glob_atom (atoms, TRUE);
+  for (c = 0x80; c < 0xc0; c++)
+    GLOB_ATOM_ADD (atom, c);
+}
+
+/* Parses a bracket expression starting at 'p' (just after the '[') into
+ * 'atoms'. Returns a pointer after the closing ']', 'p' if there isn't
+ * one (so the '[' is an ordinary character), or NULL if the expression
+ * uses something we can't compile.
+ */
+static const gchar *
+compile_glob_bracket (const gchar *p,
+		      gboolean     case_sensitive,
+		      GArray      *atoms)
+{
+  GlobAtom class = { { 0, }, FALSE };
+  const gchar *start = p;
+  gboolean negate = FALSE;
+  guint c;
+
+  if (*p == '!' || *p == '^')
     {
-      g_warning ("Failed to write suffix list");
-      return FALSE;
+      negate = TRUE;
+      p++;
     }
-  g_message ("Wrote suffix globs at %x - %x", suffix_offset, offset);
 
-  glob_offset = offset;
-  if (!write_glob_cache (cache, strings, &offset))
-    {
-      g_warning ("Failed to write glob list");
-      return FALSE;
-    }
-  g_message ("Wrote full globs at %x - %x", glob_offset, offset);
+  do
+    {
+      guchar first, last;
+
+      if (*p == '\0')
+	return start;
+      if (*p == '[' && p[1] == ':')
+	return NULL;
+      if (*p == '\\' && p[1] != '\0')
+	p++;
+      first = last = *p++;
+
+      if (*p == '-' && p[1] != ']' && p[1] != '\0')
+	{
+	  p++;
+	  if (*p == '\\' && p[1] != '\0')
+	    p++;
+	  last = *p++;
+	}
+
+      if (first >= 0x80 || last >= 0x80)
+	return NULL;
+
+      for (c = first; c <= last; c++)
+	add_glob_byte (&class, c, case_sensitive);
+    }
+  while (*p != ']');
+
+  if (negate)
+    {
+      for (c = 0; c < 8; c++)
+	class.bytes[c] = ~class.bytes[c];
+      for (c = 0x80; c < 0xc0; c++)
+	class.bytes[c >> 5] &= ~(1u << (c & 31));
+    }
+
+  g_array_append_val (atoms, class);
+  if (negate)
+    add_glob_continuation (atoms);
+
+  return p + 1;
+}
+
+/* Turns a glob into atoms, with the meaning fnmatch() gives it, one byte
+ * at a time. Case-insensitive globs are already in lower case, and match
+ * either case of ASCII letters. Returns FALSE if the glob uses a bracket
+ * expression we can't compile (character classes and non-ASCII
+ * characters).
+ */
+static gboolean
+compile_glob (const gchar *glob,
+	      gboolean     case_sensitive,
+	      GArray      *atoms)
+{
+  const gchar *p = glob;
+  GlobAtom *atom;
+  guint c;
+
+  while (*p)
+    {
+      switch (*p)
+	{
+	case '*':
+	  atom = add_glob_atom (atoms, TRUE);
+	  memset (atom->bytes, 0xff, sizeof (atom->bytes));
+	  p++;
+	  break;
+	case '?':
+	  atom = add_glob_atom (atoms, FALSE);
+	  for (c = 0; c < 256; c++)
+	    if (c < 0x80 || c >= 0xc0)
+	      GLOB_ATOM_ADD (atom, c);
+	  add_glob_continuation (atoms);
+	  p++;
+	  break;
+	case '[':
+	  {
+	    const gchar *end = compile_glob_bracket (p + 1, case_sensitive,
+						     atoms);
+
+	    if (end == NULL)
+	      return FALSE;
+	    if (end != p + 1)
+	      {
+		p = end;
+		break;
+	      }
+	  }
+	  /* No closing ']' */
+	  add_glob_byte (add_glob_atom (atoms, FALSE), *p++, case_sensitive);
+	  break;
+	case '\\':
+	  if (p[1] != '\0')
+	    p++;
+	  /* Fall through */
+	default:
+	  add_glob_byte (add_glob_atom (atoms, FALSE), *p++, case_sensitive);
+	  break;
+	}
+    }
+
+  return TRUE;
+}
+
+/* Adds 'position' to 'state' (a sorted set of positions), and the
+ * positions after any atoms that can match nothing.
+ */
+static void
+add_glob_position (GArray  *state,
+		   GArray  *atoms,
+		   guint32 *ends,
+		   guint    position)
+{
+  guint lo = 0, hi = state->len;
+
+  for (;;)
+    {
+      while (lo < hi)
+	{
+	  guint mid = (lo + hi) / 2;
+
+	  if (g_array_index (state, guint, mid) < position)
+	    lo = mid + 1;
+	  else
+	    hi = mid;
+	}
+
+      if (lo < state->len && g_array_index (state, guint, lo) == position)
+	return;
+      g_array_insert_val (state, lo, position);
+
+      if (ends[position] != 0 ||
+	  !g_array_index (atoms, GlobAtom, position).repeat)
+	return;
+
+      position++;
+      hi = state->len;
+    }
+}
+
+static guint
+glob_state_hash (gconstpointer key)
+{
+  const GArray *state = key;
+  guint h = 5381, i;
+
+  for (i = 0; i < state->len; i++)
+    h = h * 33 + g_array_index (state, guint, i);
+
+  return h;
+}
+
+static gboolean
+glob_state_equal (gconstpointer a, gconstpointer b)
+{
+  const GArray *aa = a;
+  const GArray *bb = b;
+
+  return aa->len == bb->len &&
+	 memcmp (aa->data, bb->data, aa->len * sizeof (guint)) == 0;
+}
+
+/* Write a deterministic automaton that finds all the full globs matching
+ * a file name in one pass over its bytes, in place of calling fnmatch()
+ * for each glob. The globs are read back from the full globs section at
+ * 'glob_offset'.
+ *
+ * The section holds the number of globs, the number of states, the number
+ * of byte classes, a class for each of the 256 byte values (one byte
+ * each), then for each state the next state for each class. State 0 is
+ * the dead state and state 1 the start. Then comes the index in the
+ * accept list of the first entry for each state (plus one for the end),
+ * and the accept list, whose entries are the index of the glob in the
+ * full globs section, its type ID and its weight and flags.
+ *
+ * Returns FALSE if a glob can't be compiled or the automaton gets too
+ * big, in which case nothing is written and readers use the full globs
+ * section as before.
+ */
+static gboolean
+write_glob_dfa (GString   *cache,
+		GPtrArray *sorted,
+		guint      glob_offset,
+		guint     *offset)
+{
+  GArray *atoms, *starts, *states, *next, *transitions;
+  GHashTable *state_ids;
+  guint32 *ends, *glob_ids, *weights;
+  guchar classes[256];
+  guint n_globs, n_classes, i, j, c;
+  gboolean ok = TRUE;
+
+  n_globs = get_card32 (cache, glob_offset);
+  atoms = g_array_new (FALSE, FALSE, sizeof (GlobAtom));
+  ends = NULL;
+  glob_ids = g_new (guint32, n_globs);
+  weights = g_new (guint32, n_globs);
+
+  /* The atoms of all the globs are stored one after another. The end of
+   * each glob is marked by an extra atom that matches nothing.
+   */
+  starts = g_array_new (FALSE, FALSE, sizeof (guint));
+  for (i = 0; i < n_globs && ok; i++)
+    {
+      guint32 record = glob_offset + 4 + 12 * i;
+      const gchar *pattern = cache->str + get_card32 (cache, record);
+
+      glob_ids[i] = type_id_at (sorted, get_card32 (cache, record + 4));
+      weights[i] = get_card32 (cache, record + 8);
+
+      g_array_append_val (starts, atoms->len);
+      ok = compile_glob (pattern, weights[i] & 0x100, atoms);
+      if (!ok)
+	g_message ("Not writing the full globs automaton: "
+		   "can't compile '%s'", pattern);
+      add_glob_atom (atoms, FALSE);
+    }
+
+  if (ok)
+    {
+      ends = g_new0 (guint32, atoms->len);
+      for (i = 0; i < n_globs; i++)
+	{
+	  guint end = i + 1 < n_globs ? g_array_index (starts, guint, i + 1)
+				      : atoms->len;
+
+	  ends[end - 1] = i + 1;
+	}
+    }
+
+  /* Bytes that every atom treats the same way are put in one class */
+  memset (classes, 0, sizeof (classes));
+  n_classes = 1;
+  for (i = 0; i < atoms->len && ok; i++)
+    {
+      GlobAtom *atom = &g_array_index (atoms, GlobAtom, i);
+      gint split[512];
+      guint n = 0;
+
+      for (j = 0; j < 2 * n_classes; j++)
+	split[j] = -1;
+      for (c = 0; c < 256; c++)
+	{
+	  guint key = classes[c] * 2 + GLOB_ATOM_HAS (atom, c);
+
+	  if (split[key] < 0)
+	    split[key] = n++;
+	  classes[c] = split[key];
+	}
+      n_classes = n;
+    }
+
+  /* The states are sets of positions in 'atoms', built breadth first */
+  states = g_array_new (FALSE, FALSE, sizeof (GArray *));
+  state_ids = g_hash_table_new (glob_state_hash, glob_state_equal);
+  transitions = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+  if (ok)
+    {
+      GArray *dead = g_array_new (FALSE, FALSE, sizeof (guint));
+      GArray *start = g_array_new (FALSE, FALSE, sizeof (guint));
+
+      for (i = 0; i < n_globs; i++)
+	add_glob_position (start, atoms, ends, g_array_index (starts, guint, i));
+
+      g_array_append_val (states, dead);
+      g_hash_table_insert (state_ids, dead, GUINT_TO_POINTER (0));
+      g_array_append_val (states, start);
+      g_hash_table_insert (state_ids, start, GUINT_TO_POINTER (1));
+    }
+  g_array_free (starts, TRUE);
+
+  for (i = 0; i < states->len && ok; i++)
+    {
+      GArray *from = g_array_index (states, GArray *, i);
+
+      for (j = 0; j < n_classes; j++)
+	{
+	  gpointer id;
+	  guint32 target;
+	  guint k;
+
+	  for (c = 0; classes[c] != j; c++)
+	    ;
+
+	  next = g_array_new (FALSE, FALSE, sizeof (guint));
+	  for (k = 0; k < from->len; k++)
+	    {
+	      guint position = g_array_index (from, guint, k);
+	      GlobAtom *atom = &g_array_index (atoms, GlobAtom, position);
+
+	      if (ends[position] != 0 || !GLOB_ATOM_HAS (atom, c))
+		continue;
+	      add_glob_position (next, atoms, ends,
+				 atom->repeat ? position : position + 1);
+	    }
+
+	  if (!g_hash_table_lookup_extended (state_ids, next, NULL, &id))
+	    {
+	      id = GUINT_TO_POINTER (states->len);
+	      g_array_append_val (states, next);
+	      g_hash_table_insert (state_ids, next, id);
+	    }
+	  else
+	    g_array_free (next, TRUE);
+
+	  target = GPOINTER_TO_UINT (id);
+	  g_array_append_val (transitions, target);
+	}
+
+      if (states->len > MAX_GLOB_DFA_STATES)
+	{
+	  g_message ("Not writing the full globs automaton: "
+		     "more than %d states", MAX_GLOB_DFA_STATES);
+	  ok = FALSE;
+	}
+    }
+
+  if (ok)
+    {
+      guint32 n_accepts = 0;
+
+      write_card32 (cache, n_globs);
+      write_card32 (cache, states->len);
+      write_card32 (cache, n_classes);
+      write_data (cache, (gchar *) classes, 256);
+      for (i = 0; i < transitions->len; i++)
+	write_card32 (cache, g_array_index (transitions, guint32, i));
+
+      for (i = 0; i < states->len; i++)
+	{
+	  GArray *accepting = g_array_index (states, GArray *, i);
+
+	  write_card32 (cache, n_accepts);
+	  for (j = 0; j < accepting->len; j++)
+	    if (ends[g_array_index (accepting, guint, j)] != 0)
+	      n_accepts++;
+	}
+      write_card32 (cache, n_accepts);
+
+      for (i = 0; i < states->len; i++)
+	{
+	  GArray *accepting = g_array_index (states, GArray *, i);
+
+	  for (j = 0; j < accepting->len; j++)
+	    {
+	      guint glob = ends[g_array_index (accepting, guint, j)];
+
+	      if (glob == 0)
+		continue;
+
+	      write_card32 (cache, glob - 1);
+	      write_card32 (cache, glob_ids[glob - 1]);
+	      write_card32 (cache, weights[glob - 1]);
+	    }
+	}
+
+      *offset += 12 + 256 + 4 * transitions->len + 4 * (states->len + 1) +
+		 12 * n_accepts;
+    }
+
+  for (i = 0; i < states->len; i++)
+    g_array_free (g_array_index (states, GArray *, i), TRUE);
+  g_array_free (states, TRUE);
+  g_hash_table_destroy (state_ids);
+  g_array_free (transitions, TRUE);
+  g_array_free (atoms, TRUE);
+  g_free (ends);
+  g_free (glob_ids);
+  g_free (weights);
+
+  return ok;
+}
+
+/* Whether 'match' could match data whose first byte is 'c'. Only a
+ * matchlet at exactly offset 0 says anything about the first byte; ones
+ * with a word size are compared in the host's byte order, so they are
+ * assumed to match anything too.
+ */
+static gboolean
+match_allows_first_byte (Match *match, guint c)
+{
+  guchar mask = 0xff;
+
+  if (match->range_start != 0 || match->range_length != 1 ||
+      match->word_size > 1 || match->data_length < 1)
+    return TRUE;
+
+  if (match->mask)
+    mask = match->mask[0];
+
+  return (c & mask) == ((guchar) match->data[0] & mask);
+}
+
+/* Write an index of the entries in the magic section by the first byte
+ * of the data, so that readers only need to try the entries that can
+ * match. An entry is a candidate for a byte if any of its top-level
+ * matchlets can match data starting with it.
+ *
+ * The section holds the number of magic entries, then the entries that
+ * are candidates for every byte (the count, then their indexes), then
+ * for each of the 256 byte values the position in the list that follows
+ * of its first candidate (plus one for the end), then the list itself.
+ * Indexes are in the order of the magic section, so a reader merges the
+ * two lists for the first byte of the data to try them by priority.
+ * Readers with no data at all must use the whole magic section.
+ */
+static void
+write_magic_dispatch (GString *cache,
+		      guint   *offset)
+{
+  GArray *always, *by_byte[256];
+  guint32 first = 0;
+  guint i, c;
+
+  always = g_array_new (FALSE, FALSE, sizeof (guint32));
+  for (c = 0; c < 256; c++)
+    by_byte[c] = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+  for (i = 0; i < magic_array->len; i++)
+    {
+      Magic *magic = (Magic *) magic_array->pdata[i];
+      gboolean allowed[256];
+      guint n_allowed = 0;
+      gint j;
+
+      for (c = 0; c < 256; c++)
+	{
+	  allowed[c] = FALSE;
+	  for (j = 0; j < magic->n_matches && !allowed[c]; j++)
+	    allowed[c] = match_allows_first_byte (&magic->matches[j], c);
+	  if (allowed[c])
+	    n_allowed++;
+	}
+
+      if (n_allowed == 256)
+	g_array_append_val (always, i);
+      else
+	for (c = 0; c < 256; c++)
+	  if (allowed[c])
+	    g_array_append_val (by_byte[c], i);
+    }
+
+  write_card32 (cache, magic_array->len);
+  write_card32 (cache, always->len);
+  for (i = 0; i < always->len; i++)
+    write_card32 (cache, g_array_index (always, guint32, i));
+
+  for (c = 0; c < 256; c++)
+    {
+      write_card32 (cache, first);
+      first += by_byte[c]->len;
+    }
+  write_card32 (cache, first);
+
+  for (c = 0; c < 256; c++)
+    {
+      for (i = 0; i < by_byte[c]->len; i++)
+	write_card32 (cache, g_array_index (by_byte[c], guint32, i));
+      g_array_free (by_byte[c], TRUE);
+    }
+
+  *offset += 8 + 4 * always->len + 4 * 257 + 4 * first;
+
+  g_array_free (always, TRUE);
+}
+
+/* A matchlet whose data is found by the magic strings automaton. The
+ * offsets are in the cache.
+ */
+typedef struct
+{
+  guint32 matchlet;
+  guint32 data;
+  guint32 length;
+} RangedString;
+
+/* Collects the matchlets at 'first' (and their children) that look for a
+ * plain string over a range of offsets: no mask, no word size.
+ */
+static void
+collect_ranged_strings (GString *cache,
+			guint32  first,
+			guint32  n_matchlets,
+			GArray  *strings)
+{
+  guint32 i;
+
+  for (i = 0; i < n_matchlets; i++)
+    {
+      guint32 matchlet = first + 32 * i;
+      RangedString string;
+
+      string.matchlet = matchlet;
+      string.length = get_card32 (cache, matchlet + 12);
+      string.data = get_card32 (cache, matchlet + 16);
+
+      if (get_card32 (cache, matchlet + 4) > 1 &&
+	  get_card32 (cache, matchlet + 8) <= 1 &&
+	  get_card32 (cache, matchlet + 20) == 0 &&
+	  string.length > 0)
+	g_array_append_val (strings, string);
+
+      collect_ranged_strings (cache, get_card32 (cache, matchlet + 28),
+			      get_card32 (cache, matchlet + 24), strings);
+    }
+}
+
+static gint
+cmp_ranged_string (gconstpointer a, gconstpointer b, gpointer data)
+{
+  const RangedString *aa = a;
+  const RangedString *bb = b;
+  GString *cache = data;
+  gint res;
+
+  if (aa->length != bb->length)
+    return aa->length < bb->length ? -1 : 1;
+
+  res = memcmp (cache->str + aa->data, cache->str + bb->data, aa->length);
+  if (res != 0)
+    return res;
+
+  return aa->matchlet < bb->matchlet ? -1 : aa->matchlet > bb->matchlet;
+}
+
+/* An edge of the automaton's trie, from 'node' on 'c' */
+typedef struct
+{
+  guint32 node;
+  guint32 c;
+  guint32 target;
+} StringEdge;
+
+static gint
+cmp_string_edge (gconstpointer a, gconstpointer b)
+{
+  const StringEdge *aa = a;
+  const StringEdge *bb = b;
+
+  if (aa->node != bb->node)
+    return aa->node < bb->node ? -1 : 1;
+  return aa->c < bb->c ? -1 : aa->c > bb->c;
+}
+
+#define STRING_EDGE_KEY(node, c) GUINT_TO_POINTER ((node) * 256 + (c) + 1)
+
+/* Each edge keeps its target node in 24 bits */
+#define MAX_MAGIC_STRING_NODES 0xFFFFFF
+
+/* Write an Aho-Corasick automaton over the data of the matchlets that
+ * look for a string anywhere in a range of offsets, so that readers can
+ * find all of them with one scan of the data instead of searching for
+ * each one in turn. The matchlets with the same data share a pattern.
+ *
+ * The section holds the number of nodes, edges, patterns and matchlets,
+ * and how far into the data the scan needs to go. Then for each node of
+ * the trie (0 is the root): its failure link, the pattern that ends
+ * there or NO_TYPE, the next node on its failure chain where a pattern
+ * ends (0 if none), and the index of its first edge and how many there
+ * are. Each edge is the byte in the top 8 bits and the target node in
+ * the rest, sorted by byte. Then for each pattern its length, the index
+ * of its first matchlet in the list that follows (plus one entry for the
+ * end), and the list: the offsets of the matchlets in the cache.
+ *
+ * A matchlet matches (ignoring its children) if its pattern ends at an
+ * offset 'end' such that end + 1 - length is within its range.
+ *
+ * Returns FALSE, having written nothing, if the trie has too many nodes.
+ */
+static gboolean
+write_magic_strings (GString *cache,
+		     guint    magic_offset,
+		     guint   *offset)
+{
+  GArray *strings, *edges, *patterns, *ends;
+  GHashTable *goto_table;
+  guint32 *fail, *output, *dict, *first_edge, *queue;
+  guint32 n_nodes = 1, scan_extent = 0, i, j, head, tail;
+  guint32 entries, n_entries;
+
+  strings = g_array_new (FALSE, FALSE, sizeof (RangedString));
+  entries = get_card32 (cache, magic_offset + 8);
+  n_entries = get_card32 (cache, magic_offset);
+  for (i = 0; i < n_entries; i++)
+    collect_ranged_strings (cache,
+			    get_card32 (cache, entries + 16 * i + 12),
+			    get_card32 (cache, entries + 16 * i + 8),
+			    strings);
+  g_array_sort_with_data (strings, cmp_ranged_string, cache);
+
+  /* A shared list of matchlets is collected once for each parent */
+  for (i = j = 0; i < strings->len; i++)
+    if (j == 0 ||
+	g_array_index (strings, RangedString, i).matchlet !=
+	g_array_index (strings, RangedString, j - 1).matchlet)
+      g_array_index (strings, RangedString, j++) =
+	g_array_index (strings, RangedString, i);
+  g_array_set_size (strings, j);
+
+  /* Build the trie, with a pattern for each distinct string */
+  edges = g_array_new (FALSE, FALSE, sizeof (StringEdge));
+  patterns = g_array_new (FALSE, FALSE, sizeof (guint32));
+  ends = g_array_new (FALSE, FALSE, sizeof (guint32));
+  goto_table = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  for (i = 0; i < strings->len; i++)
+    {
+      RangedString *string = &g_array_index (strings, RangedString, i);
+      const guchar *data = (const guchar *) cache->str + string->data;
+      guint32 node = 0;
+
+      scan_extent = MAX (scan_extent,
+			 get_card32 (cache, string->matchlet) +
+			 get_card32 (cache, string->matchlet + 4) - 1 +
+			 string->length);
+
+      if (i > 0 && string[-1].length == string->length &&
+	  memcmp (cache->str + string[-1].data, data, string->length) == 0)
+	continue;
+
+      g_array_append_val (patterns, i);
+
+      for (j = 0; j < string->length; j++)
+	{
+	  gpointer target;
+
+	  if (!g_hash_table_lookup_extended (goto_table,
+					     STRING_EDGE_KEY (node, data[j]),
+					     NULL, &target))
+	    {
+	      StringEdge edge;
+
+	      edge.node = node;
+	      edge.c = data[j];
+	      edge.target = n_nodes++;
+	      g_array_append_val (edges, edge);
+
+	      target = GUINT_TO_POINTER (edge.target);
+	      g_hash_table_insert (goto_table, STRING_EDGE_KEY (node, data[j]),
+				   target);
+	    }
+	  node = GPOINTER_TO_UINT (target);
+	}
+
+      g_array_append_val (ends, node);
+    }
+
+  if (n_nodes > MAX_MAGIC_STRING_NODES)
+    {
+      g_message ("Not writing the magic strings automaton: "
+		 "more than %d nodes", MAX_MAGIC_STRING_NODES);
+      g_hash_table_destroy (goto_table);
+      g_array_free (edges, TRUE);
+      g_array_free (patterns, TRUE);
+      g_array_free (ends, TRUE);
+      g_array_free (strings, TRUE);
+      return FALSE;
+    }
+
+  g_array_sort (edges, cmp_string_edge);
+
+  fail = g_new0 (guint32, n_nodes);
+  dict = g_new0 (guint32, n_nodes);
+  first_edge = g_new0 (guint32, n_nodes + 1);
+  queue = g_new (guint32, n_nodes);
+
+  /* The pattern ending at each node, plus one */
+  output = g_new0 (guint32, n_nodes);
+  for (i = 0; i < ends->len; i++)
+    output[g_array_index (ends, guint32, i)] = i + 1;
+
+  for (i = 0; i < edges->len; i++)
+    first_edge[g_array_index (edges, StringEdge, i).node + 1]++;
+  for (i = 0; i < n_nodes; i++)
+    first_edge[i + 1] += first_edge[i];
+
+  /* Failure links, breadth first */
+  head = tail = 0;
+  queue[tail++] = 0;
+  while (head < tail)
+    {
+      guint32 node = queue[head++];
+
+      for (i = first_edge[node]; i < first_edge[node + 1]; i++)
+	{
+	  StringEdge *edge = &g_array_index (edges, StringEdge, i);
+	  guint32 f = fail[node];
+	  gpointer target = NULL;
+
+	  if (node != 0)
+	    {
+	      while (!g_hash_table_lookup_extended (goto_table,
+						    STRING_EDGE_KEY (f, edge->c),
+						    NULL, &target) && f != 0)
+		f = fail[f];
+	      if (target != NULL)
+		fail[edge->target] = GPOINTER_TO_UINT (target);
+	    }
+
+	  f = fail[edge->target];
+	  dict[edge->target] = output[f] ? f : dict[f];
+	  queue[tail++] = edge->target;
+	}
+    }
+
+  write_card32 (cache, n_nodes);
+  write_card32 (cache, edges->len);
+  write_card32 (cache, patterns->len);
+  write_card32 (cache, strings->len);
+  write_card32 (cache, scan_extent);
+
+  for (i = 0; i < n_nodes; i++)
+    {
+      write_card32 (cache, fail[i]);
+      write_card32 (cache, output[i] ? output[i] - 1 : NO_TYPE);
+      write_card32 (cache, dict[i]);
+      write_card32 (cache, first_edge[i]);
+      write_card32 (cache, first_edge[i + 1] - first_edge[i]);
+    }
+
+  for (i = 0; i < edges->len; i++)
+    {
+      StringEdge *edge = &g_array_index (edges, StringEdge, i);
+
+      write_card32 (cache, edge->c << 24 | edge->target);
+    }
+
+  for (i = 0; i < patterns->len; i++)
+    write_card32 (cache, g_array_index (strings, RangedString,
+					g_array_index (patterns, guint32, i)).length);
+  for (i = 0; i < patterns->len; i++)
+    write_card32 (cache, g_array_index (patterns, guint32, i));
+  write_card32 (cache, strings->len);
+
+  for (i = 0; i < strings->len; i++)
+    write_card32 (cache, g_array_index (strings, RangedString, i).matchlet);
+
+  *offset += 20 + 20 * n_nodes + 4 * edges->len +
+	     4 * (2 * patterns->len + 1) + 4 * strings->len;
+
+  g_free (fail);
+  g_free (output);
+  g_free (dict);
+  g_free (first_edge);
+  g_free (queue);
+  g_hash_table_destroy (goto_table);
+  g_array_free (edges, TRUE);
+  g_array_free (patterns, TRUE);
+  g_array_free (ends, TRUE);
+  g_array_free (strings, TRUE);
+
+  return TRUE;
+}
+
+/* The most data that 'matches' or any of their children need */
+static guint
+matches_extent (Match *matches, gint n_matches)
+{
+  guint extent = 0;
+  gint i;
+
+  for (i = 0; i < n_matches; i++)
+    {
+      extent = MAX (extent, match_extent (&matches[i]));
+      extent = MAX (extent, matches_extent (matches[i].matches,
+					    matches[i].n_matches));
+    }
+
+  return extent;
+}
+
+/* Write how much data each magic entry needs, and the entries grouped
+ * into tiers by that, so readers can start with a small read and only
+ * read more while an entry in a deeper tier could still match.
+ *
+ * The section holds the number of entries and the extent of each (as for
+ * max_extent, in the order of the magic section). Then the number of
+ * tiers, and for each, the largest extent of its entries, how many
+ * entries it has and the index of the first in the list that follows.
+ * The list holds the indexes of the entries of each tier in turn, in the
+ * order of the magic section. Tiers without entries are left out.
+ */
+static void
+write_magic_tiers (GString *cache,
+		   guint   *offset)
+{
+  static const guint bounds[] = { 64, 256, 512, 4096, G_MAXUINT };
+  guint *extents, tier_extent[G_N_ELEMENTS (bounds)];
+  GArray *tiers[G_N_ELEMENTS (bounds)];
+  guint n_tiers = 0, first = 0, i, t;
+
+  extents = g_new (guint, magic_array->len);
+  for (t = 0; t < G_N_ELEMENTS (bounds); t++)
+    {
+      tiers[t] = g_array_new (FALSE, FALSE, sizeof (guint32));
+      tier_extent[t] = 0;
+    }
+
+  for (i = 0; i < magic_array->len; i++)
+    {
+      Magic *magic = (Magic *) magic_array->pdata[i];
+
+      extents[i] = matches_extent (magic->matches, magic->n_matches);
+      for (t = 0; extents[i] > bounds[t]; t++)
+	;
+      g_array_append_val (tiers[t], i);
+      tier_extent[t] = MAX (tier_extent[t], extents[i]);
+    }
+
+  write_card32 (cache, magic_array->len);
+  for (i = 0; i < magic_array->len; i++)
+    write_card32 (cache, extents[i]);
+
+  for (t = 0; t < G_N_ELEMENTS (bounds); t++)
+    if (tiers[t]->len > 0)
+      n_tiers++;
+
+  write_card32 (cache, n_tiers);
+  for (t = 0; t < G_N_ELEMENTS (bounds); t++)
+    {
+      if (tiers[t]->len == 0)
+	continue;
+
+      write_card32 (cache, tier_extent[t]);
+      write_card32 (cache, tiers[t]->len);
+      write_card32 (cache, first);
+      first += tiers[t]->len;
+    }
+
+  for (t = 0; t < G_N_ELEMENTS (bounds); t++)
+    {
+      for (i = 0; i < tiers[t]->len; i++)
+	write_card32 (cache, g_array_index (tiers[t], guint32, i));
+      g_array_free (tiers[t], TRUE);
+    }
+
+  *offset += 8 + 4 * magic_array->len + 12 * n_tiers + 4 * first;
+
+  g_free (extents);
+}
+
+/* The instructions of the magic programs. Each starts with a word
+ * holding the opcode in the top 8 bits and the length of the data in the
+ * rest. MAGIC_OP_FAIL is the whole instruction; the others are
+ * MAGIC_OP_TEST plus any of the flags, and are followed by:
+ *
+ * - the first offset to look at
+ * - the number of offsets to look at, if MAGIC_OP_RANGE is set
+ * - the word size, if MAGIC_OP_WORD is set
+ * - the data: up to 4 bytes in the word itself (first byte in the top 8
+ *   bits) if MAGIC_OP_INLINE is set, otherwise its offset in the cache
+ * - the mask, in the same way as the data, if MAGIC_OP_MASK is set
+ * - the index of the instruction to go to if the data isn't found
+ */
+#define MAGIC_OP_FAIL   0x00
+#define MAGIC_OP_TEST   0x80
+#define MAGIC_OP_RANGE  0x01
+#define MAGIC_OP_MASK   0x02
+#define MAGIC_OP_INLINE 0x04
+#define MAGIC_OP_ACCEPT 0x08  /* finding the data means the entry matches */
+#define MAGIC_OP_WORD   0x10  /* the data is made of host-order words */
+
+#define MAGIC_INLINE_LENGTH 4
+
+/* The data at 'pos' in the cache, as an inline data word */
+static guint32
+inline_magic_data (GString *cache, guint32 pos, guint32 length)
+{
+  guint32 word = 0, i;
+
+  for (i = 0; i < length; i++)
+    word |= (guint32) (guchar) cache->str[pos + i] << (24 - 8 * i);
+
+  return word;
+}
+
+/* Compile the matchlets at 'first' in the cache, and their children.
+ * Each one is tested in turn, going on to its children if its data is
+ * found and to its next sibling if not. The words of 'code' that should
+ * hold the target for when none of them match are added to 'pending'.
+ */
+static void
+compile_matchlets (GString *cache,
+		   guint32  first,
+		   guint32  n_matchlets,
+		   GArray  *code,
+		   GArray  *pending)
+{
+  guint mark = pending->len, i, j;
+
+  for (i = 0; i < n_matchlets; i++)
+    {
+      guint32 matchlet = first + 32 * i;
+      guint32 range_length, word_size, data_length, data, mask, n_children;
+      guint32 op = MAGIC_OP_TEST, word, pos;
+
+      /* The previous sibling failing leads here */
+      for (j = mark; j < pending->len; j++)
+	g_array_index (code, guint32, g_array_index (pending, guint32, j)) =
+	  code->len;
+      g_array_set_size (pending, mark);
+
+      range_length = get_card32 (cache, matchlet + 4);
+      word_size = get_card32 (cache, matchlet + 8);
+      data_length = get_card32 (cache, matchlet + 12);
+      data = get_card32 (cache, matchlet + 16);
+      mask = get_card32 (cache, matchlet + 20);
+      n_children = get_card32 (cache, matchlet + 24);
+
+      if (range_length > 1)
+	op |= MAGIC_OP_RANGE;
+      if (word_size > 1)
+	op |= MAGIC_OP_WORD;
+      if (mask)
+	op |= MAGIC_OP_MASK;
+      if (data_length <= MAGIC_INLINE_LENGTH)
+	op |= MAGIC_OP_INLINE;
+      if (n_children == 0)
+	op |= MAGIC_OP_ACCEPT;
+
+      word = op << 24 | data_length;
+      g_array_append_val (code, word);
+      word = get_card32 (cache, matchlet);
+      g_array_append_val (code, word);
+      if (op & MAGIC_OP_RANGE)
+	g_array_append_val (code, range_length);
+      if (op & MAGIC_OP_WORD)
+	g_array_append_val (code, word_size);
+      word = (op & MAGIC_OP_INLINE) ?
+	inline_magic_data (cache, data, data_length) : data;
+      g_array_append_val (code, word);
+      if (op & MAGIC_OP_MASK)
+	{
+	  word = (op & MAGIC_OP_INLINE) ?
+	    inline_magic_data (cache, mask, data_length) : mask;
+	  g_array_append_val (code, word);
+	}
+
+      pos = code->len;
+      word = 0;
+      g_array_append_val (code, word);
+      g_array_append_val (pending, pos);
+
+      compile_matchlets (cache, get_card32 (cache, matchlet + 28),
+			 n_children, code, pending);
+    }
+}
+
+/* Write each magic entry as a program that readers can run with a
+ * simple loop, instead of walking the matchlets: the instructions for
+ * the matchlets of an entry are laid out in the order they are tried,
+ * and each says where to go next if its data isn't found. The data of
+ * short matchlets is in the instruction itself.
+ *
+ * The section holds the number of entries (in the order of the magic
+ * section) and the number of words of code, then the index in the code
+ * of the first instruction of each entry, then the code.
+ *
+ * To run a program, start at its first instruction. A MAGIC_OP_FAIL
+ * means the entry doesn't match. For a test, look for the data (with
+ * the mask applied to both, if there is one) at each offset in turn, as
+ * for the magic section, treating the word size as the matchlet's. If it is found and MAGIC_OP_ACCEPT is set, the
+ * entry matches; if it is found otherwise, go to the next instruction;
+ * if not, go to the instruction given. Instruction 0 is MAGIC_OP_FAIL,
+ * and all the others only ever go forwards.
+ */
+static void
+write_magic_program (GString *cache,
+		     guint    magic_offset,
+		     guint   *offset)
+{
+  GArray *code, *pending;
+  guint32 *start;
+  guint32 n_entries, entries, i, j, word = MAGIC_OP_FAIL << 24;
+
+  n_entries = get_card32 (cache, magic_offset);
+  entries = get_card32 (cache, magic_offset + 8);
+
+  code = g_array_new (FALSE, FALSE, sizeof (guint32));
+  pending = g_array_new (FALSE, FALSE, sizeof (guint32));
+  g_array_append_val (code, word);
+
+  start = g_new (guint32, n_entries);
+  for (i = 0; i < n_entries; i++)
+    {
+      guint32 entry = entries + 16 * i;
+
+      if (get_card32 (cache, entry + 8) == 0)
+	{
+	  start[i] = 0;
+	  continue;
+	}
+
+      start[i] = code->len;
+      compile_matchlets (cache, get_card32 (cache, entry + 12),
+			 get_card32 (cache, entry + 8), code, pending);
+
+      /* Failing the last matchlet fails the entry */
+      for (j = 0; j < pending->len; j++)
+	g_array_index (code, guint32, g_array_index (pending, guint32, j)) = 0;
+      g_array_set_size (pending, 0);
+    }
+
+  write_card32 (cache, n_entries);
+  write_card32 (cache, code->len);
+  for (i = 0; i < n_entries; i++)
+    write_card32 (cache, start[i]);
+  for (i = 0; i < code->len; i++)
+    write_card32 (cache, g_array_index (code, guint32, i));
+
+  *offset += 8 + 4 * n_entries + 4 * code->len;
+
+  g_free (start);
+  g_array_free (pending, TRUE);
+  g_array_free (code, TRUE);
+}
+
+static void
+collect_alias (gpointer key,
+	       gpointer value,
+	       gpointer data)
+{
+  GHashTable *strings = (GHashTable *)data;
+  Type *type = (Type *)value;
+  
+  g_hash_table_insert (strings, key, NULL);
+  g_hash_table_insert (strings, type->name, NULL);
+}
+
+
+static void
+collect_parents (gpointer key,
+		 gpointer value,
+		 gpointer data)
+{
+  GList *parents = (GList *)value;
+  GHashTable *strings = (GHashTable *)data;
+  GList *p;
+  
+  g_hash_table_insert (strings, key, NULL);
+  for (p = parents; p; p = p->next)
+    g_hash_table_insert (strings, p->data, NULL);
+}
+
+static void
+collect_glob (gpointer key,
+	      gpointer value,
+	      gpointer data)
+{
+  GArray *globs = (GArray *)value;
+  GHashTable *strings = (GHashTable *)data;
+  Glob *glob;
+  guint i;
+
+  switch (glob_type ((char *)key))
+    {
+      case GLOB_LITERAL:
+      case GLOB_FULL:
+        g_hash_table_insert (strings, key, NULL);
+        break;
+     default:
+        break;
+   }
+
+  for (i = 0; i < globs->len; i++)
+    {
+      glob = &g_array_index (globs, Glob, i);
+
+      g_hash_table_insert (strings, glob->type->name, NULL);
+    }
+}
+
+static void
+collect_magic (gpointer key,
+	       gpointer data)
+{
+  Magic *magic = (Magic *)key;
+  GHashTable *strings = (GHashTable *)data;
+  
+  g_hash_table_insert (strings, magic->type->name, NULL);
+}
+
+static void
+collect_namespace (gpointer key,
+		   gpointer value,
+		   gpointer data)
+{
+  gchar *ns = (gchar *)key;
+  Type *type = (Type *)value;
+  GHashTable *strings = (GHashTable *)data;
+  gchar *space;
+
+  g_hash_table_insert (strings, type->name, NULL);
+  
+  space = strchr (ns, ' ');
+
+  if (space)
+    {
+      *space = '\0';
+      g_hash_table_insert (strings, g_strdup (ns), NULL);
+      g_hash_table_insert (strings, space + 1, NULL);
+      *space = ' ';
+    }
+  else     
+    g_hash_table_insert (strings, ns, NULL);
+}
+
+static void 
+collect_icons(gpointer key, 
+              gpointer value, 
+              gpointer data)
+{
+  gchar *mimetype = (gchar *)key;
+  gchar *iconname = (gchar *)value;
+  GHashTable *strings = (GHashTable *)data;
+
+  g_hash_table_insert (strings, mimetype, NULL);
+  g_hash_table_insert (strings, iconname, NULL);
+}
+
+
+static void
+collect_type (gpointer key,
+	      gpointer value,
+	      gpointer data)
+{
+  Type *type = (Type *)value;
+  GHashTable *strings = (GHashTable *)data;
+
+  g_hash_table_insert (strings, type->name, NULL);
+}
+
+static void
+collect_strings (GHashTable *strings)
+{
+  g_hash_table_foreach (types, collect_type, strings); 
+  g_hash_table_foreach (alias_hash, collect_alias, strings); 
+  g_hash_table_foreach (subclass_hash, collect_parents, strings); 
+  g_hash_table_foreach (globs_hash, collect_glob, strings); 
+  g_ptr_array_foreach (magic_array, collect_magic, strings); 
+  g_hash_table_foreach (namespace_hash, collect_namespace, strings); 
+  g_hash_table_foreach (generic_icon_hash, collect_icons, strings); 
+  g_hash_table_foreach (icon_hash, collect_icons, strings); 
+}
+
+/* Write the strings in sorted order, so that the same database always
+ * gives the same cache, and record the offset of each one in 'strings'.
+ */
+static void
+write_strings (GString    *cache, 
+	       GHashTable *strings,       
+	       guint      *offset)
+{
+  GPtrArray *keys;
+  FilterData filter_data;
+  guint i;
+
+  keys = g_ptr_array_new ();
+
+  filter_data.keys = keys;
+  filter_data.filter = NULL;
+  g_hash_table_foreach (strings, add_key, &filter_data);
+
+  g_ptr_array_sort (keys, strcmp2);
+
+  for (i = 0; i < keys->len; i++)
+    {
+      gchar *str = (gchar *) keys->pdata[i];
+
+      write_string (cache, str);
+
+      g_hash_table_insert (strings, str, GUINT_TO_POINTER (*offset));
+
+      *offset = ALIGN_VALUE (*offset + strlen (str) + 1, 4);
+    }
+
+  g_ptr_array_free (keys, TRUE);
+}
+
+static void
+set_cache_offset (gpointer key,
+		  gpointer value,
+		  gpointer data)
+{
+  Type *type = (Type *)value;
+  GHashTable *strings = (GHashTable *)data;
+
+  type->cache_offset = GPOINTER_TO_UINT (g_hash_table_lookup (strings, type->name));
+}
+
+static gboolean 
+write_cache (GString *cache)
+{
+  guint strings_offset;
+  guint alias_offset;
+  guint parent_offset;
+  guint literal_offset;
+  guint suffix_offset;
+  guint n_suffix_nodes;
+  guint glob_offset;
+  guint magic_offset;
+  guint namespace_offset;
+  guint icons_list_offset;
+  guint generic_icons_list_offset;
+  guint type_offset;
+  guint extensions_offset;
+  guint offset;
+  GHashTable *strings;
+  GString *header;
+  GArray *extensions;
+  gsize extensions_pos;
+  MapKeys alias_keys, literal_keys;
+  GPtrArray *sorted_types;
+  GArray **ancestors, **descendants, **parents;
+  guint i;
+
+  offset = 0;
+  write_header (cache, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, &offset);
+
+  /* The offset of the extension directory is filled in at the end */
+  write_card32 (cache, EXTENSIONS_MAGIC);
+  extensions_pos = cache->len;
+  write_card32 (cache, 0);
+  offset += 8;
+  extensions = g_array_new (FALSE, FALSE, sizeof (Extension));
+
+  alias_keys.keys = g_ptr_array_new ();
+  alias_keys.first = g_array_new (FALSE, FALSE, sizeof (guint));
+  literal_keys.keys = g_ptr_array_new ();
+  literal_keys.first = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  strings = g_hash_table_new (g_str_hash, g_str_equal);
+  collect_strings (strings);
+  strings_offset = offset;
+
+  write_strings (cache, strings, &offset);
+  g_message ("Wrote %d strings at %x - %x",
+	   g_hash_table_size (strings), strings_offset, offset);
+  g_hash_table_foreach (types, set_cache_offset, strings);
+
+  alias_offset = offset;
+  if (!write_alias_cache (cache, strings, &alias_keys, &offset))
+    {
+      g_warning ("Failed to write alias list");
+      return FALSE;
+    }
+  g_message ("Wrote aliases at %x - %x", alias_offset, offset);
+
+  parent_offset = offset;
+  if (!write_parent_cache (cache, strings, &offset))
+    {
+      g_warning ("Failed to write parent list");
+      return FALSE;
+    }
+  g_message ("Wrote parents at %x - %x", parent_offset, offset);
+
+  literal_offset = offset;
+  if (!write_literal_cache (cache, strings, &literal_keys, &offset))
+    {
+      g_warning ("Failed to write literal list");
+      return FALSE;
+    }
+  g_message ("Wrote literal globs at %x - %x", literal_offset, offset);
+
+  suffix_offset = offset;
+  n_suffix_nodes = write_suffix_cache (cache, strings, &offset);
+  g_message ("Wrote suffix globs at %x - %x", suffix_offset, offset);
+
+  glob_offset = offset;
+  if (!write_glob_cache (cache, strings, &offset))
+    {
+      g_warning ("Failed to write glob list");
+      return FALSE;
+    }
+  g_message ("Wrote full globs at %x - %x", glob_offset, offset);
+
+  magic_offset = offset;
+  write_magic_cache (cache, strings, &offset);
+  g_message ("Wrote magic at %x - %x", magic_offset, offset);
+
+  namespace_offset = offset;
+  if (!write_namespace_cache (cache, strings, &offset))
+    {
+      g_warning ("Failed to write namespace list");
+      return FALSE;
+    }
+  g_message ("Wrote namespace list at %x - %x", namespace_offset, offset);
+
+  icons_list_offset = offset;
+  if (!write_icons_cache (cache, strings, icon_hash, &offset))
+    {
+      g_warning ("Failed to write icons list");
+      return FALSE;
+    }
+  g_message ("Wrote icons list at %x - %x", icons_list_offset, offset);
+
+  generic_icons_list_offset = offset;
+  if (!write_icons_cache (cache, strings, generic_icon_hash, &offset))
+    {
+      g_warning ("Failed to write generic icons list");
+      return FALSE;
+    }
+  g_message ("Wrote generic icons list at %x - %x", generic_icons_list_offset, offset);
+
+  sorted_types = number_types ();
+  type_offset = offset;
+  write_types_cache (cache, sorted_types, &offset);
+  g_message ("Wrote types list at %x - %x", type_offset, offset);
+
+  add_extension (extensions, EXTENSION_ALIAS_HASH, offset);
+  if (!write_hash_index (cache, &alias_keys, &offset))
+    g_array_set_size (extensions, extensions->len - 1);
+
+  add_extension (extensions, EXTENSION_LITERAL_HASH, offset);
+  if (!write_hash_index (cache, &literal_keys, &offset))
+    g_array_set_size (extensions, extensions->len - 1);
+
+  ancestors = get_ancestors (sorted_types);
+  add_extension (extensions, EXTENSION_ANCESTORS, offset);
+  write_id_sets (cache, ancestors, sorted_types->len, &offset);
+
+  descendants = get_descendants (ancestors, sorted_types->len);
+  add_extension (extensions, EXTENSION_DESCENDANTS, offset);
+  write_id_sets (cache, descendants, sorted_types->len, &offset);
+  free_id_sets (descendants, sorted_types->len);
+  free_id_sets (ancestors, sorted_types->len);
+
+  parents = get_parents (sorted_types);
+  add_extension (extensions, EXTENSION_PARENTS, offset);
+  write_id_sets (cache, parents, sorted_types->len, &offset);
+  free_id_sets (parents, sorted_types->len);
+
+  add_extension (extensions, EXTENSION_TYPE_IDS, offset);
+  write_type_ids (cache, sorted_types,
+		  alias_offset, parent_offset, literal_offset,
+		  suffix_offset, n_suffix_nodes, glob_offset, magic_offset,
+		  namespace_offset, icons_list_offset,
+		  generic_icons_list_offset, &offset);
+
+  add_extension (extensions, EXTENSION_MAGIC_DISPATCH, offset);
+  write_magic_dispatch (cache, &offset);
+
+  add_extension (extensions, EXTENSION_MAGIC_TIERS, offset);
+  write_magic_tiers (cache, &offset);
+
+  add_extension (extensions, EXTENSION_MAGIC_STRINGS, offset);
+  if (!write_magic_strings (cache, magic_offset, &offset))
+    g_array_set_size (extensions, extensions->len - 1);
+
+  add_extension (extensions, EXTENSION_MAGIC_PROGRAM, offset);
+  write_magic_program (cache, magic_offset, &offset);
+
+  add_extension (extensions, EXTENSION_GLOB_DFA, offset);
+  if (!write_glob_dfa (cache, sorted_types, glob_offset, &offset))
+    g_array_set_size (extensions, extensions->len - 1);
+
+  g_ptr_array_free (sorted_types, TRUE);
+  g_ptr_array_free (alias_keys.keys, TRUE);
+  g_array_free (alias_keys.first, TRUE);
+  g_ptr_array_free (literal_keys.keys, TRUE);
+  g_array_free (literal_keys.first, TRUE);
+
+  extensions_offset = offset;
+  write_card32 (cache, extensions->len);
+  for (i = 0; i < extensions->len; i++)
+    {
+      Extension *extension = &g_array_index (extensions, Extension, i);
+
+      write_card32 (cache, extension->tag);
+      write_card32 (cache, extension->offset);
+    }
+  offset += 4 + 8 * extensions->len;
+  set_card32 (cache, extensions_pos, extensions_offset);
+  g_message ("Wrote %u extensions at %x - %x",
+	     extensions->len, extensions_offset, offset);
+  g_array_free (extensions, TRUE);
+
+  header = g_string_sized_new (44);
+  offset = 0; 
+
+  write_header (header, 
+		alias_offset, parent_offset, literal_offset,
+		suffix_offset, glob_offset, magic_offset, 
+		namespace_offset, icons_list_offset,
+		generic_icons_list_offset, type_offset, 
+		&offset);
+
+  memcpy (cache->str, header->str, header->len);
+  g_string_free (header, TRUE);
+
+  g_hash_table_destroy (strings);
+
+  return TRUE;
+}
+
+
+static FILE *
+fopen_gerror(const char *filename, GError **error)
+{
+	FILE *stream = fopen(filename, "wb");
+
+	if (!stream)
+		set_error_from_errno(error);
+
+	return stream;
+}
+
+static gboolean
+fclose_gerror(FILE *f, GError **error)
+{
+	int err = ferror(f);
+	if (err != 0)
+	{
+		set_error_from_errno(error);
+		return FALSE;
+	}
+	if (fclose(f) != 0)
+	{
+		set_error_from_errno(error);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void free_package_stat(gpointer data)
+{
+	PackageStat *stat = (PackageStat *) data;
+
+	g_free(stat->digest);
+	g_free(stat);
+}
+
+/* Return the SHA-256 digest of the contents of 'path' as a hex string,
+ * or NULL if it can't be read.
+ */
+static gchar *digest_file(const char *path)
+{
+	GChecksum *checksum;
+	FILE *stream;
+	guchar buffer[65536];
+	size_t len;
+	gchar *digest = NULL;
+
+	stream = fopen(path, "rb");
+	if (!stream)
+		return NULL;
+
+	checksum = g_checksum_new(G_CHECKSUM_SHA256);
+	while ((len = fread(buffer, 1, sizeof(buffer), stream)) > 0)
+		g_checksum_update(checksum, buffer, len);
+
+	if (!ferror(stream))
+		digest = g_strdup(g_checksum_get_string(checksum));
+
+	g_checksum_free(checksum);
+	fclose(stream);
+
+	return digest;
+}
+
+/* Stat and digest every source file in 'packagedir', returning a table
+ * mapping leafnames to PackageStats. If a file's stat data matches its
+ * entry in 'old' (which may be NULL), the digest is taken from there
+ * instead of reading the file again.
+ */
+static GHashTable *scan_package_stats(const char *packagedir, GHashTable *old)
+{
+	GHashTable *stats;
+	GDir *dir;
+	const char *name;
+
+	stats = g_hash_table_new_full(g_str_hash, g_str_equal,
+				      g_free, free_package_stat);
+
+	dir = g_dir_open(packagedir, 0, NULL);
+	if (!dir)
+		return stats;
+
+	while ((name = g_dir_read_name(dir)))
+	{
+		GStatBuf statbuf;
+		PackageStat *stat, *old_stat;
+		char *path;
+
+		if (!g_str_has_suffix(name, ".xml"))
+			continue;
+
+		path = g_build_filename(packagedir, name, NULL);
+		if (g_stat(path, &statbuf) < 0)
+		{
+			g_free(path);
+			continue;
+		}
+
+		stat = g_new0(PackageStat, 1);
+		stat->size = statbuf.st_size;
+		stat->mtime = statbuf.st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+		stat->mtime_nsec = statbuf.st_mtim.tv_nsec;
+#endif
+		stat->inode = statbuf.st_ino;
+
+		old_stat = old ? g_hash_table_lookup(old, name) : NULL;
+		if (old_stat &&
+		    old_stat->size == stat->size &&
+		    old_stat->mtime == stat->mtime &&
+		    old_stat->mtime_nsec == stat->mtime_nsec &&
+		    old_stat->inode == stat->inode)
+			stat->digest = g_strdup(old_stat->digest);
+		else
+			stat->digest = digest_file(path);
+		g_free(path);
+
+		if (!stat->digest)
+		{
+			free_package_stat(stat);
+			continue;
+		}
+
+		g_hash_table_insert(stats, g_strdup(name), stat);
+	}
+
+	g_dir_close(dir);
+
+	return stats;
+}
+
+/* Read the manifest written by the last run for 'mimedir'. Returns NULL if
+ * there isn't one, or it was written by a different version.
+ */
+static GHashTable *read_manifest(const char *mimedir)
+{
+	GHashTable *stats = NULL;
+	char *path, *contents;
+	char **lines;
+	int i;
+
+	path = g_build_filename(mimedir, "packages.manifest", NULL);
+	if (!g_file_get_contents(path, &contents, NULL, NULL))
+	{
+		g_free(path);
+		return NULL;
+	}
+	g_free(path);
+
+	lines = g_strsplit(contents, "\n", -1);
+	g_free(contents);
+
+	for (i = 0; lines[i]; i++)
+	{
+		PackageStat *stat;
+		char *line = lines[i];
+		char *end;
+
+		if (line[0] == '#' || line[0] == '\0')
+			continue;
+
+		if (!stats)
+		{
+			/* The first line identifies the writer */
+			if (strcmp(line, "version " VERSION) != 0)
+				break;
+			stats = g_hash_table_new_full(g_str_hash, g_str_equal,
+						      g_free,
+						      free_package_stat);
+			continue;
+		}
+
+		/* <digest> <size> <mtime>.<nsec> <inode> <leafname> */
+		end = strchr(line, ' ');
+		if (!end)
+			goto invalid;
+		stat = g_new0(PackageStat, 1);
+		stat->digest = g_strndup(line, end - line);
+		stat->size = g_ascii_strtoll(end + 1, &end, 10);
+		if (*end == ' ')
+			stat->mtime = g_ascii_strtoll(end + 1, &end, 10);
+		if (*end == '.')
+			stat->mtime_nsec = g_ascii_strtoll(end + 1, &end, 10);
+		if (*end == ' ')
+			stat->inode = g_ascii_strtoull(end + 1, &end, 10);
+		if (*end != ' ' || end[1] == '\0')
+		{
+			free_package_stat(stat);
+			goto invalid;
+		}
+
+		g_hash_table_insert(stats, g_strdup(end + 1), stat);
+	}
+
+	g_strfreev(lines);
+	return stats;
+invalid:
+	g_warning("Ignoring invalid packages.manifest in '%s'", mimedir);
+	g_hash_table_destroy(stats);
+	g_strfreev(lines);
+	return NULL;
+}
+
+/* Write 'stats', as returned by scan_package_stats(), to 'out' */
+static void write_manifest(GString *out, GHashTable *stats)
+{
+	GHashTableIter iter;
+	gpointer key;
+	GPtrArray *names;
+	int i;
+
+	names = g_ptr_array_new();
+	g_hash_table_iter_init(&iter, stats);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+		g_ptr_array_add(names, key);
+	g_ptr_array_sort(names, strcmp2);
+
+	g_string_append_printf(out,
+		  "# This file was automatically generated by the\n"
+		  "# update-mime-database command. DO NOT EDIT!\n"
+		  "version " VERSION "\n");
+
+	for (i = 0; i < names->len; i++)
+	{
+		char *name = (char *) names->pdata[i];
+		PackageStat *stat = g_hash_table_lookup(stats, name);
+
+		g_string_append_printf(out, "%s %" G_GINT64_FORMAT " %" G_GINT64_FORMAT
+			  ".%09ld %" G_GUINT64_FORMAT " %s\n",
+			  stat->digest, stat->size, stat->mtime,
+			  stat->mtime_nsec, stat->inode, name);
+	}
+
+	g_ptr_array_free(names, TRUE);
+}
+
+static gboolean
+save_manifest(const char *mimedir, GHashTable *stats, GError **error)
+{
+	GString *out;
+
+	out = g_string_new(NULL);
+	write_manifest(out, stats);
+
+	return save_generated_file(mimedir, "packages.manifest", out, error);
+}
+
+/* The files generated in the MIME directory, apart from the XML file for
+ * each type.
+ */
+static const char *const generated_files[] = {
+	"globs", "globs2", "magic", "XMLnamespaces", "subclasses", "aliases",
+	"types", "generic-icons", "icons", "treemagic", "mime.cache", "version"
+};
+
+/* Compare the package files found now ('stats') with the ones recorded in
+ * the manifest of the last run ('old'). The cache is up to date if the
+ * same set of files exists, with the same contents, and the files
+ * generated from them are all in 'mimedir'.
+ */
+static gboolean
+is_cache_up_to_date(const char *mimedir, GHashTable *old, GHashTable *stats)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	int i;
+
+	if (!old || g_hash_table_size(old) != g_hash_table_size(stats))
+		return FALSE;
+
+	for (i = 0; i < G_N_ELEMENTS(generated_files); i++)
+	{
+		char *path;
+		gboolean exists;
+
+		path = g_build_filename(mimedir, generated_files[i], NULL);
+		exists = access(path, F_OK) == 0;
+		g_free(path);
+		if (!exists)
+			return FALSE;
+	}
+
+	g_hash_table_iter_init(&iter, stats);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+	{
+		PackageStat *stat = (PackageStat *) value;
+		PackageStat *old_stat = g_hash_table_lookup(old, key);
+
+		if (!old_stat || old_stat->size != stat->size ||
+		    strcmp(old_stat->digest, stat->digest) != 0)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Returns TRUE if any file's stat data differs from 'old', even though the
+ * contents are the same.
+ */
+static gboolean
+manifest_stat_changed(GHashTable *old, GHashTable *stats)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+
+	g_hash_table_iter_init(&iter, stats);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+	{
+		PackageStat *stat = (PackageStat *) value;
+		PackageStat *old_stat = g_hash_table_lookup(old, key);
+
+		if (old_stat->mtime != stat->mtime ||
+		    old_stat->mtime_nsec != stat->mtime_nsec ||
+		    old_stat->inode != stat->inode)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* The package cache (packages.cache) remembers, for each source file that
+ * was loaded without errors, everything it added to the database. It is
+ * keyed by the digest of the file's contents, so a later run only needs to
+ * parse the files that have changed; the others are loaded by replaying
+ * their entries in the same order. All numbers are big-endian.
+ */
+#define PACKAGE_CACHE_MAGIC "MIME-PackageCache\n" VERSION "\n"
+
+/* A string is stored as its length and then its bytes (without the nul).
+ * Strings are numbered in the order they appear in an entry, and a string
+ * that appeared before is stored as STRING_REF plus its number instead.
+ * This length marks a NULL string.
+ */
+#define NULL_STRING 0xffffffff
+#define STRING_REF 0x80000000
+
+static void record_card32(guint32 n)
+{
+	n = GUINT32_TO_BE(n);
+	g_string_append_len(recording, (char *) &n, 4);
+}
+
+static void record_data(const char *data, guint32 len)
+{
+	record_card32(len);
+	g_string_append_len(recording, data, len);
+}
+
+static void record_string(const char *str)
+{
+	gpointer index;
+
+	if (!str)
+	{
+		record_card32(NULL_STRING);
+		return;
+	}
+
+	if (g_hash_table_lookup_extended(recorded_strings, str, NULL, &index))
+	{
+		record_card32(STRING_REF | GPOINTER_TO_UINT(index));
+		return;
+	}
+
+	g_hash_table_insert(recorded_strings, g_strdup(str),
+		GUINT_TO_POINTER(g_hash_table_size(recorded_strings)));
+	record_data(str, strlen(str));
+}
+
+/* Record 'node' and its attributes and children. Only nodes that the
+ * parser can produce for a well-formed file without entity references
+ * can be recorded; for anything else, the file isn't cached.
+ */
+static void record_node_tree(xmlNode *node)
+{
+	xmlNs *ns;
+	xmlAttr *attr;
+	xmlNode *child;
+	int n;
+
+	record_card32(node->type);
+
+	switch (node->type)
+	{
+		case XML_ELEMENT_NODE:
+			break;
+		case XML_TEXT_NODE:
+		case XML_COMMENT_NODE:
+		case XML_CDATA_SECTION_NODE:
+			record_string((char *) node->content);
+			return;
+		default:
+			recording_failed = TRUE;
+			return;
+	}
+
+	record_string((char *) node->name);
+	record_string(node->ns ? (char *) node->ns->prefix : NULL);
+	record_string(node->ns ? (char *) node->ns->href : NULL);
+
+	for (n = 0, ns = node->nsDef; ns; ns = ns->next)
+		n++;
+	record_card32(n);
+	for (ns = node->nsDef; ns; ns = ns->next)
+	{
+		record_string((char *) ns->prefix);
+		record_string((char *) ns->href);
+	}
+
+	for (n = 0, attr = node->properties; attr; attr = attr->next)
+		n++;
+	record_card32(n);
+	for (attr = node->properties; attr; attr = attr->next)
+	{
+		xmlNode *value = attr->children;
+
+		if (value && (value->type != XML_TEXT_NODE || value->next))
+			recording_failed = TRUE;
+
+		record_string((char *) attr->name);
+		record_string(attr->ns ? (char *) attr->ns->prefix : NULL);
+		record_string(attr->ns ? (char *) attr->ns->href : NULL);
+		record_string(value ? (char *) value->content : "");
+	}
+
+	for (n = 0, child = node->children; child; child = child->next)
+		n++;
+	record_card32(n);
+	for (child = node->children; child; child = child->next)
+		record_node_tree(child);
+}
+
+/* Record that 'node' is added to the XML file for the current type */
+static void record_node(guint32 tag, xmlNode *node)
+{
+	record_card32(tag);
+	record_node_tree(node);
+}
+
+static void record_matches(Match *matches, int n_matches)
+{
+	int i;
+
+	record_card32(n_matches);
+	for (i = 0; i < n_matches; i++)
+	{
+		Match *match = &matches[i];
+		guint64 start = match->range_start;
+
+		record_card32(start >> 32);
+		record_card32(start & 0xffffffff);
+		record_card32(match->range_length);
+		record_card32(match->word_size);
+		record_data(match->data, match->data_length);
+		if (match->mask)
+			record_data(match->mask, match->data_length);
+		else
+			record_card32(NULL_STRING);
+		record_matches(match->matches, match->n_matches);
+	}
+}
+
+static void record_magic(Magic *magic)
+{
+	record_card32(RECORD_MAGIC);
+	record_card32(magic->priority);
+	record_card32(magic->nomagic);
+	record_matches(magic->matches, magic->n_matches);
+}
+
+static void record_tree_matches(TreeMatch *matches, int n_matches)
+{
+	int i;
+
+	record_card32(n_matches);
+	for (i = 0; i < n_matches; i++)
+	{
+		TreeMatch *match = &matches[i];
+
+		record_string(match->path);
+		record_card32(match->match_case);
+		record_card32(match->executable);
+		record_card32(match->non_empty);
+		record_card32(match->type);
+		record_string(match->mimetype);
+		record_tree_matches(match->matches, match->n_matches);
+	}
+}
+
+static void record_tree_magic(TreeMagic *magic)
+{
+	record_card32(RECORD_TREE_MAGIC);
+	record_card32(magic->priority);
+	record_tree_matches(magic->matches, magic->n_matches);
+}
+
+/* Reads records back from a cache entry. Any attempt to read past the end
+ * sets 'error', and returns zero or NULL.
+ */
+typedef struct
+{
+	const guchar *p;
+	const guchar *end;
+	gboolean error;
+	GPtrArray *strings;	/* The strings read so far */
+} CacheReader;
+
+static guint32 read_card32(CacheReader *reader)
+{
+	guint32 n;
+
+	if (reader->error || reader->end - reader->p < 4)
+	{
+		reader->error = TRUE;
+		return 0;
+	}
+
+	memcpy(&n, reader->p, 4);
+	reader->p += 4;
+
+	return GUINT32_FROM_BE(n);
+}
+
+/* Returns the data in place, storing its length in 'len' */
+static const char *read_bytes(CacheReader *reader, guint32 *len)
+{
+	const char *data;
+
+	*len = read_card32(reader);
+	if (reader->error || *len == NULL_STRING)
+		return NULL;
+
+	if (reader->end - reader->p < *len)
+	{
+		reader->error = TRUE;
+		return NULL;
+	}
+
+	data = (const char *) reader->p;
+	reader->p += *len;
+
+	return data;
+}
+
+/* Returns a nul-terminated copy of the data, storing its length in 'len' */
+static char *read_data(CacheReader *reader, guint32 *len)
+{
+	const char *data;
+	char *copy;
+
+	data = read_bytes(reader, len);
+	if (!data)
+		return NULL;
+
+	/* Not g_strndup(), which would stop at the first nul */
+	copy = g_malloc(*len + 1);
+	memcpy(copy, data, *len);
+	copy[*len] = '\0';
+
+	return copy;
+}
+
+/* Like read_data(), but the copy is allocated from the arena */
+static char *read_arena_data(CacheReader *reader, guint32 *len)
+{
+	const char *data;
+
+	data = read_bytes(reader, len);
+
+	return data ? arena_dup0(data, *len) : NULL;
+}
+
+static char *read_string(CacheReader *reader)
+{
+	const guchar *start = reader->p;
+	guint32 n;
+	char *str;
+
+	n = read_card32(reader);
+	if (reader->error || n == NULL_STRING)
+		return NULL;
+
+	if (n & STRING_REF)
+	{
+		n &= ~STRING_REF;
+		if (n >= reader->strings->len)
+		{
+			reader->error = TRUE;
+			return NULL;
+		}
+		return g_strdup(reader->strings->pdata[n]);
+	}
+
+	reader->p = start;
+	str = read_data(reader, &n);
+	if (str)
+		g_ptr_array_add(reader->strings, g_strdup(str));
+
+	return str;
+}
+
+/* Read a count of items which each need at least 'size' more bytes */
+static guint32 read_count(CacheReader *reader, guint32 size)
+{
+	guint32 n;
+
+	n = read_card32(reader);
+	if (n > (reader->end - reader->p) / size)
+	{
+		reader->error = TRUE;
+		return 0;
+	}
+
+	return n;
+}
+
+/* Find the namespace to use for a node or attribute with this prefix and
+ * URI, in the same way that xmlDocCopyNode() did when the node was first
+ * copied. If 'node' isn't in the tree yet, 'scope' is where it will go.
+ */
+static xmlNs *find_ns(xmlNode *node, xmlNode *scope,
+		      const char *prefix, const char *href)
+{
+	xmlNode *n;
+	xmlNs *ns;
+
+	for (n = node; n && n->type == XML_ELEMENT_NODE;
+	     n = n->parent ? n->parent : scope)
+	{
+		for (ns = n->nsDef; ns; ns = ns->next)
+		{
+			if (xmlStrEqual(ns->prefix, (xmlChar *) prefix) &&
+			    xmlStrEqual(ns->href, (xmlChar *) href))
+				return ns;
+		}
+		if (n == scope)
+			break;
+	}
+
+	if (prefix && strcmp(prefix, "xml") == 0)
+		return xmlSearchNs(node->doc, node, (xmlChar *) prefix);
+
+	/* Declared outside the node that was copied. The copy got its own
+	 * declaration, which was removed again (and leaked) by load_type().
+	 */
+	return xmlNewNs(NULL, (xmlChar *) href, (xmlChar *) prefix);
+}
+
+/* Read a node recorded by record_node_tree() and add it to 'parent' (if
+ * not NULL). Namespaces are only set up if 'scope' is given (see find_ns()).
+ * Returns the new node, or NULL on error.
+ */
+static xmlNode *read_node(CacheReader *reader, xmlDoc *doc,
+			  xmlNode *parent, xmlNode *scope)
+{
+	xmlNode *node;
+	guint32 node_type, n, i;
+	char *name, *prefix, *href;
+
+	node_type = read_card32(reader);
+	if (node_type == XML_ELEMENT_NODE)
+	{
+		name = read_string(reader);
+		prefix = read_string(reader);
+		href = read_string(reader);
+		if (!name)
+			reader->error = TRUE;
+		if (reader->error)
+		{
+			g_free(name);
+			g_free(prefix);
+			g_free(href);
+			return NULL;
+		}
+		node = xmlNewDocNode(doc, NULL, (xmlChar *) name, NULL);
+		g_free(name);
+	}
+	else
+	{
+		char *content;
+
+		content = read_string(reader);
+		if (!content)
+		{
+			reader->error = TRUE;
+			return NULL;
+		}
+
+		if (node_type == XML_TEXT_NODE)
+			node = xmlNewDocText(doc, (xmlChar *) content);
+		else if (node_type == XML_COMMENT_NODE)
+			node = xmlNewDocComment(doc, (xmlChar *) content);
+		else if (node_type == XML_CDATA_SECTION_NODE)
+			node = xmlNewCDataBlock(doc, (xmlChar *) content,
+						strlen(content));
+		else
+		{
+			reader->error = TRUE;
+			node = NULL;
+		}
+		g_free(content);
+
+		if (node && parent)
+			node = xmlAddChild(parent, node);
+		return node;
+	}
+
+	if (parent)
+		xmlAddChild(parent, node);
+
+	n = read_count(reader, 8);
+	for (i = 0; i < n; i++)
+	{
+		char *ns_prefix, *ns_href;
+
+		ns_prefix = read_string(reader);
+		ns_href = read_string(reader);
+		if (!reader->error)
+			xmlNewNs(node, (xmlChar *) ns_href,
+				 (xmlChar *) ns_prefix);
+		g_free(ns_prefix);
+		g_free(ns_href);
+	}
+
+	if (href && scope && !reader->error)
+		xmlSetNs(node, find_ns(node, scope, prefix, href));
+	g_free(prefix);
+	g_free(href);
+
+	n = read_count(reader, 16);
+	for (i = 0; i < n && !reader->error; i++)
+	{
+		char *value;
+		xmlNs *ns = NULL;
+
+		name = read_string(reader);
+		prefix = read_string(reader);
+		href = read_string(reader);
+		value = read_string(reader);
+		if (!name || !value)
+			reader->error = TRUE;
+
+		if (!reader->error)
+		{
+			if (href && scope)
+				ns = find_ns(node, scope, prefix, href);
+			xmlNewNsProp(node, ns, (xmlChar *) name,
+				     (xmlChar *) value);
+		}
+
+		g_free(name);
+		g_free(prefix);
+		g_free(href);
+		g_free(value);
+	}
+
+	n = read_count(reader, 8);
+	for (i = 0; i < n && !reader->error; i++)
+		read_node(reader, doc, node, scope);
+
+	if (reader->error)
+	{
+		if (parent)
+			xmlUnlinkNode(node);
+		xmlFreeNode(node);
+		return NULL;
+	}
+
+	return node;
+}
 
-  magic_offset = offset;
-  if (!write_magic_cache (cache, strings, &offset))
-    {
-      g_warning ("Failed to write magic list");
-      return FALSE;
-    }
-  g_message ("Wrote magic at %x - %x", magic_offset, offset);
+static Match *read_matches(CacheReader *reader, int *n_matches)
+{
+	Match *matches;
+	guint32 n, i;
 
-  namespace_offset = offset;
-  if (!write_namespace_cache (cache, strings, &offset))
-    {
-      g_warning ("Failed to write namespace list");
-      return FALSE;
-    }
-  g_message ("Wrote namespace list at %x - %x", namespace_offset, offset);
+	n = read_count(reader, 28);
+	matches = arena_alloc(n * sizeof(Match));
+	for (i = 0; i < n && !reader->error; i++)
+	{
+		Match *match = &matches[i];
+		guint64 start;
+		guint32 len;
+		const char *mask;
+
+		match_init(match);
+		start = read_card32(reader);
+		start = (start << 32) | read_card32(reader);
+		match->range_start = (gint64) start;
+		match->range_length = read_card32(reader);
+		match->word_size = read_card32(reader);
+		match->data = read_arena_data(reader, &len);
+		match->data_length = match->data ? len : 0;
+		mask = read_bytes(reader, &len);
+		if (mask && len != match->data_length)
+			reader->error = TRUE;
+		else if (mask)
+			match->mask = arena_memdup(mask, len);
+		match->matches = read_matches(reader, &match->n_matches);
+	}
+	*n_matches = i;
 
-  icons_list_offset = offset;
-  if (!write_icons_cache (cache, strings, icon_hash, &offset))
-    {
-      g_warning ("Failed to write icons list");
-      return FALSE;
-    }
-  g_message ("Wrote icons list at %x - %x", icons_list_offset, offset);
+	return matches;
+}
 
-  generic_icons_list_offset = offset;
-  if (!write_icons_cache (cache, strings, generic_icon_hash, &offset))
-    {
-      g_warning ("Failed to write generic icons list");
-      return FALSE;
-    }
-  g_message ("Wrote generic icons list at %x - %x", generic_icons_list_offset, offset);
+static Magic *read_magic(CacheReader *reader, Type *type)
+{
+	Magic *magic;
 
-  type_offset = offset;
-  if (!write_types_cache (cache, strings, types, &offset))
-    {
-      g_warning ("Failed to write types list");
-      return FALSE;
-    }
-  g_message ("Wrote types list at %x - %x", type_offset, offset);
+	magic = arena_alloc(sizeof(Magic));
+	magic->type = type;
+	magic->priority = read_card32(reader);
+	magic->nomagic = read_card32(reader);
+	magic->matches = read_matches(reader, &magic->n_matches);
 
-  rewind (cache);
-  offset = 0; 
+	return magic;
+}
 
-  if (!write_header (cache, 
-		     alias_offset, parent_offset, literal_offset,
-		     suffix_offset, glob_offset, magic_offset, 
-		     namespace_offset, icons_list_offset,
-		     generic_icons_list_offset, type_offset, 
-		     &offset))
-    {
-      g_warning ("Failed to rewrite header");
-      return FALSE;
-    }
+static TreeMatch *read_tree_matches(CacheReader *reader, int *n_matches)
+{
+	TreeMatch *matches;
+	guint32 n, i;
 
-  g_hash_table_destroy (strings);
+	n = read_count(reader, 28);
+	matches = arena_alloc(n * sizeof(TreeMatch));
+	for (i = 0; i < n && !reader->error; i++)
+	{
+		TreeMatch *match = &matches[i];
+		char *str;
+
+		tree_match_init(match);
+		str = read_string(reader);
+		match->path = arena_strdup(str);
+		g_free(str);
+		match->match_case = read_card32(reader);
+		match->executable = read_card32(reader);
+		match->non_empty = read_card32(reader);
+		match->type = read_card32(reader);
+		str = read_string(reader);
+		match->mimetype = arena_strdup(str);
+		g_free(str);
+		match->matches = read_tree_matches(reader, &match->n_matches);
+		if (!match->path)
+			reader->error = TRUE;
+	}
+	*n_matches = i;
 
-  return TRUE;
+	return matches;
 }
 
+static TreeMagic *read_tree_magic(CacheReader *reader, Type *type)
+{
+	TreeMagic *magic;
 
-static FILE *
-fopen_gerror(const char *filename, GError **error)
+	magic = arena_alloc(sizeof(TreeMagic));
+	magic->type = type;
+	magic->priority = read_card32(reader);
+	magic->matches = read_tree_matches(reader, &magic->n_matches);
+
+	return magic;
+}
+
+/* Check that 'name' will be accepted by get_type() */
+static gboolean valid_type_name(const char *name)
 {
-	FILE *stream = fopen(filename, "wb");
+	const char *slash;
 
-	if (!stream)
-		set_error_from_errno(error);
+	slash = name ? strchr(name, '/') : NULL;
 
-	return stream;
+	return slash && !strchr(slash + 1, '/');
 }
 
-static gboolean
-fclose_gerror(FILE *f, GError **error)
+/* Read all the records in a cache entry. If 'apply' is FALSE, the entry is
+ * only checked, without changing the database; check 'reader->error' for
+ * the result.
+ */
+static void replay_records(CacheReader *reader, gboolean apply)
 {
-	int err = ferror(f);
-	if (err != 0)
+	Type *type = NULL;
+	gboolean have_type = FALSE;
+	xmlDoc *scratch = NULL;
+
+	if (!apply)
+		scratch = xmlNewDoc((xmlChar *) "1.0");
+
+	while (reader->p < reader->end && !reader->error)
 	{
-		set_error_from_errno(error);
-		return FALSE;
+		guint32 tag;
+		char *str, *str2;
+
+		tag = read_card32(reader);
+
+		if (tag != RECORD_TYPE && !have_type)
+		{
+			reader->error = TRUE;
+			break;
+		}
+
+		switch (tag)
+		{
+			case RECORD_TYPE:
+				str = read_string(reader);
+				if (!valid_type_name(str))
+					reader->error = TRUE;
+				else if (apply)
+					type = get_type(str, NULL);
+				have_type = TRUE;
+				g_free(str);
+				break;
+			case RECORD_GLOB:
+			{
+				int weight;
+				gboolean case_sensitive;
+
+				str = read_string(reader);
+				weight = read_card32(reader);
+				case_sensitive = read_card32(reader);
+				if (!str)
+					reader->error = TRUE;
+				if (apply && !reader->error)
+					add_glob(type, str, weight,
+						 case_sensitive, FALSE);
+				else
+					g_free(str);
+				break;
+			}
+			case RECORD_GLOB_DELETEALL:
+				if (apply)
+					add_glob(type, g_strdup(NOGLOBS),
+						 0, FALSE, TRUE);
+				break;
+			case RECORD_MAGIC:
+			{
+				Magic *magic;
+
+				magic = read_magic(reader, type);
+				if (apply && !reader->error)
+					add_magic(magic);
+				break;
+			}
+			case RECORD_TREE_MAGIC:
+			{
+				TreeMagic *magic;
+
+				magic = read_tree_magic(reader, type);
+				if (apply && !reader->error)
+					add_tree_magic(magic);
+				break;
+			}
+			case RECORD_ALIAS:
+			case RECORD_SUBCLASS:
+			case RECORD_ICON:
+			case RECORD_GENERIC_ICON:
+				str = read_string(reader);
+				if (!str)
+					reader->error = TRUE;
+				if (apply && !reader->error)
+				{
+					if (tag == RECORD_ALIAS)
+						add_type_alias(type, str);
+					else if (tag == RECORD_SUBCLASS)
+						add_subclass(type, str);
+					else
+						add_icon(type, str,
+						 tag == RECORD_GENERIC_ICON);
+				}
+				g_free(str);
+				break;
+			case RECORD_NAMESPACE:
+				str = read_string(reader);
+				str2 = read_string(reader);
+				if (!str || !str2)
+					reader->error = TRUE;
+				if (apply && !reader->error)
+					add_namespace(type, str, str2, NULL);
+				g_free(str);
+				g_free(str2);
+				break;
+			case RECORD_FIELD:
+			{
+				xmlNode *node;
+
+				if (apply)
+				{
+					node = read_node(reader, type->output,
+						NULL,
+						xmlDocGetRootElement(type->output));
+					if (node)
+						add_field(type, node);
+				}
+				else
+				{
+					node = read_node(reader, scratch,
+							 NULL, NULL);
+					if (node)
+						xmlFreeNode(node);
+				}
+				break;
+			}
+			default:
+				reader->error = TRUE;
+				break;
+		}
 	}
-	if (fclose(f) != 0)
+
+	if (scratch)
+		xmlFreeDoc(scratch);
+}
+
+/* Load the cached entry 'data' for 'filename' into the database. Returns
+ * FALSE, without changing anything, if the entry is invalid.
+ */
+static gboolean replay_package(const char *filename, GString *data)
+{
+	CacheReader reader;
+	ArenaMark mark;
+
+	reader.p = (guchar *) data->str;
+	reader.end = reader.p + data->len;
+	reader.error = FALSE;
+	reader.strings = g_ptr_array_new_with_free_func(g_free);
+	/* Nothing read while checking the entry is kept */
+	arena_mark(&mark);
+	replay_records(&reader, FALSE);
+	arena_reset(&mark);
+	g_ptr_array_set_size(reader.strings, 0);
+	if (reader.error)
 	{
-		set_error_from_errno(error);
+		g_message("Ignoring invalid package cache entry for %s",
+			  filename);
+		g_ptr_array_free(reader.strings, TRUE);
 		return FALSE;
 	}
+
+	g_message("Loading source file %s from the package cache...",
+		  filename);
+
+	reader.p = (guchar *) data->str;
+	replay_records(&reader, TRUE);
+	g_ptr_array_free(reader.strings, TRUE);
+
 	return TRUE;
 }
 
-static gint64
-newest_mtime(const char *packagedir)
+/* Check that 'filename' still has the stat data in 'stat' */
+static gboolean package_unchanged(const char *filename, PackageStat *stat)
 {
-	GDir *dir;
-#if !GLIB_CHECK_VERSION(2,26,0)
-	struct stat GStatBuf;
-#else
 	GStatBuf statbuf;
-#endif
-	gint64 mtime = G_MININT64;
-	const char *name;
-	int retval;
 
-	retval = g_stat(packagedir, &statbuf);
-	if (retval < 0)
-		return mtime;
-	mtime = statbuf.st_mtime;
+	if (g_stat(filename, &statbuf) < 0)
+		return FALSE;
 
-	dir = g_dir_open(packagedir, 0, NULL);
-	if (!dir)
-		return mtime;
+	return statbuf.st_size == stat->size &&
+	       statbuf.st_mtime == stat->mtime &&
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	       statbuf.st_mtim.tv_nsec == stat->mtime_nsec &&
+#endif
+	       statbuf.st_ino == stat->inode;
+}
 
-	while ((name = g_dir_read_name(dir))) {
-		char *path;
+static void free_cache_entry(gpointer data)
+{
+	g_string_free((GString *) data, TRUE);
+}
 
-		path = g_build_filename(packagedir, name, NULL);
-		retval = g_stat(path, &statbuf);
+/* Read the package cache for 'mimedir'. Returns a table mapping digests to
+ * entries, or NULL if there is no valid cache.
+ */
+static GHashTable *read_package_cache(const char *mimedir)
+{
+	GHashTable *cache;
+	CacheReader reader;
+	char *path, *contents;
+	gsize length;
+
+	path = g_build_filename(mimedir, "packages.cache", NULL);
+	if (!g_file_get_contents(path, &contents, &length, NULL))
+	{
 		g_free(path);
-		if (retval < 0)
-			continue;
-		if (statbuf.st_mtime > mtime)
-			mtime = statbuf.st_mtime;
+		return NULL;
 	}
+	g_free(path);
 
-	g_dir_close(dir);
-	return mtime;
+	if (length < strlen(PACKAGE_CACHE_MAGIC) ||
+	    memcmp(contents, PACKAGE_CACHE_MAGIC,
+		   strlen(PACKAGE_CACHE_MAGIC)) != 0)
+	{
+		/* Not ours, or written by a different version */
+		g_free(contents);
+		return NULL;
+	}
+
+	cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+				      g_free, free_cache_entry);
+
+	reader.p = (guchar *) contents + strlen(PACKAGE_CACHE_MAGIC);
+	reader.end = (guchar *) contents + length;
+	reader.error = FALSE;
+	while (reader.p < reader.end && !reader.error)
+	{
+		char *digest, *data;
+		guint32 len;
+
+		digest = read_data(&reader, &len);
+		data = read_data(&reader, &len);
+		if (!digest || !data)
+		{
+			reader.error = TRUE;
+			g_free(digest);
+			g_free(data);
+			break;
+		}
+
+		g_hash_table_replace(cache, digest, g_string_new_len(data, len));
+		g_free(data);
+	}
+
+	g_free(contents);
+
+	if (reader.error)
+	{
+		g_warning("Ignoring invalid packages.cache in '%s'", mimedir);
+		g_hash_table_destroy(cache);
+		return NULL;
+	}
+
+	return cache;
 }
 
-static gboolean
-is_cache_up_to_date (const char *mimedir, const char *packagedir)
+/* Append 'cache', as returned by scan_source_dir(), to 'out' */
+static void write_package_cache(GString *out, GHashTable *cache)
 {
-	GStatBuf version_stat;
-	gint64 package_mtime;
-	char *mimeversion;
-	int retval;
+	GHashTableIter iter;
+	gpointer key;
+	GPtrArray *digests;
+	int i;
 
-	mimeversion = g_build_filename(mimedir, "/version", NULL);
-	retval = g_stat(mimeversion, &version_stat);
-	g_free(mimeversion);
-	if (retval < 0)
-		return FALSE;
+	digests = g_ptr_array_new();
+	g_hash_table_iter_init(&iter, cache);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+		g_ptr_array_add(digests, key);
+	g_ptr_array_sort(digests, strcmp2);
 
-	package_mtime = newest_mtime(packagedir);
-	if (package_mtime < 0)
-		return FALSE;
+	g_string_append(out, PACKAGE_CACHE_MAGIC);
+
+	for (i = 0; i < digests->len; i++)
+	{
+		char *digest = (char *) digests->pdata[i];
+		GString *data = g_hash_table_lookup(cache, digest);
+
+		write_card32(out, strlen(digest));
+		g_string_append(out, digest);
+		write_card32(out, data->len);
+		g_string_append_len(out, data->str, data->len);
+	}
 
-	return version_stat.st_mtime >= package_mtime;
+	g_ptr_array_free(digests, TRUE);
+}
+
+static gboolean
+save_package_cache(const char *mimedir, GHashTable *cache, GError **error)
+{
+	GString *out;
+	char *path;
+	gboolean ret;
+
+	out = g_string_new(NULL);
+	write_package_cache(out, cache);
+	path = g_strconcat(mimedir, "/packages.cache", NULL);
+	ret = update_file(path, out->str, out->len, error);
+	g_free(path);
+	g_string_free(out, TRUE);
+
+	return ret;
 }
 
 int main(int argc, char **argv)
@@ -3645,11 +7488,24 @@ int main(int argc, char **argv)
 	GError *local_error = NULL;
 	GError **error = &local_error;
 	gboolean if_newer = FALSE;
+	int n_jobs = 1;
+	GHashTable *old_manifest, *package_stats;
+	GHashTable *package_cache;
+	static const struct option long_options[] = {
+		{ "help", no_argument, NULL, 'h' },
+		{ "version", no_argument, NULL, 'v' },
+		{ "verbose", no_argument, NULL, 'V' },
+		{ "if-newer", no_argument, NULL, 'n' },
+		{ "jobs", required_argument, NULL, 'j' },
+		{ "no-optimize-magic", no_argument, NULL, 'O' },
+		{ NULL, 0, NULL, 0 }
+	};
 
 	/* Install the filtering log handler */
 	g_log_set_default_handler(g_log_handler, NULL);
 
-	while ((opt = getopt(argc, argv, "hvVn")) != -1)
+	while ((opt = getopt_long(argc, argv, "hvVnj:",
+				  long_options, NULL)) != -1)
 	{
 		switch (opt)
 		{
@@ -3671,6 +7527,27 @@ int main(int argc, char **argv)
 			case 'n':
 				if_newer = TRUE;
 				break;
+			case 'O':
+				optimize_magic = FALSE;
+				break;
+			case 'j':
+			{
+				char *end;
+				long jobs;
+
+				errno = 0;
+				jobs = strtol(optarg, &end, 10);
+				if (*optarg == '\0' || *end != '\0' ||
+				    errno == ERANGE || jobs < 1 || jobs > MAX_JOBS)
+				{
+					g_fprintf(stderr,
+						_("Invalid number of jobs '%s'\n"),
+						optarg);
+					return EXIT_FAILURE;
+				}
+				n_jobs = jobs;
+				break;
+			}
 			default:
 				return EXIT_FAILURE;
 		}
@@ -3713,15 +7590,25 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	if (if_newer && is_cache_up_to_date(mime_dir, package_dir)) {
+	old_manifest = read_manifest(mime_dir);
+	package_stats = scan_package_stats(package_dir, old_manifest);
+
+	if (if_newer && is_cache_up_to_date(mime_dir, old_manifest, package_stats)) {
 		g_message ("Skipping mime update as the cache is up-to-date");
+		/* Record the new stat data, so the files that were touched
+		 * don't need to be read again next time.
+		 */
+		if (manifest_stat_changed(old_manifest, package_stats) &&
+		    (!save_manifest(mime_dir, package_stats, error) ||
+		     !flush_updates(mime_dir, error)))
+			fatal_gerror(local_error);
 		return EXIT_SUCCESS;
 	}
 
 	types = g_hash_table_new_full(g_str_hash, g_str_equal,
-					g_free, free_type);
+					NULL, free_type);
 	globs_hash = g_hash_table_new_full(g_str_hash, g_str_equal,
-					g_free, NULL);
+					g_free, free_glob_array);
 	namespace_hash = g_hash_table_new_full(g_str_hash, g_str_equal,
 					g_free, NULL);
 	magic_array = g_ptr_array_new();
@@ -3735,60 +7622,53 @@ int main(int argc, char **argv)
 	generic_icon_hash = g_hash_table_new_full(g_str_hash, g_str_equal,
 						  g_free, NULL);
 
-	scan_source_dir(package_dir);
+	{
+		GHashTable *old_cache;
+
+		old_cache = read_package_cache(mime_dir);
+		package_cache = scan_source_dir(package_dir, n_jobs,
+						package_stats, old_cache);
+		if (old_cache)
+			g_hash_table_destroy(old_cache);
+	}
 	g_free(package_dir);
 
 	delete_old_types(mime_dir);
 
-	g_hash_table_foreach(types, write_out_type, (gpointer) mime_dir);
+	write_out_types(mime_dir, n_jobs);
 
 	{
-		FILE *globs;
-		char *globs_path;
-		GList *glob_list = NULL;
+		GString *globs;
+		GPtrArray *glob_list;
 
-		g_hash_table_foreach(globs_hash, collect_glob2, &glob_list);
-		glob_list = g_list_sort(glob_list, (GCompareFunc)compare_glob_by_weight);
-		globs_path = g_strconcat(mime_dir, "/globs.new", NULL);
-		globs = fopen_gerror(globs_path, error);
-		if (!globs)
-			goto out;
-		g_fprintf(globs,
+		glob_list = g_ptr_array_new();
+		g_hash_table_foreach(globs_hash, collect_glob2, glob_list);
+		/* Stable, so equal weights keep their order */
+		g_ptr_array_sort(glob_list, compare_glob_by_weight);
+
+		globs = g_string_new(
 			  "# This file was automatically generated by the\n"
 			  "# update-mime-database command. DO NOT EDIT!\n");
 		write_out_glob(glob_list, globs);
-		if (!fclose_gerror(globs, error))
+		if (!save_generated_file(mime_dir, "globs", globs, error))
 			goto out;
-		if (!atomic_update(globs_path, error))
-			goto out;
-		g_free(globs_path);
 
-		globs_path = g_strconcat(mime_dir, "/globs2.new", NULL);
-		globs = fopen_gerror(globs_path, error);
-		if (!globs)
-			goto out;
-		g_fprintf(globs,
+		globs = g_string_new(
 			  "# This file was automatically generated by the\n"
 			  "# update-mime-database command. DO NOT EDIT!\n");
 		write_out_glob2 (glob_list, globs);
-		if (!fclose_gerror(globs, error))
+		if (!save_generated_file(mime_dir, "globs2", globs, error))
 			goto out;
-		if (!atomic_update(globs_path, error))
-			goto out;
-		g_free(globs_path);
 
-		g_list_free (glob_list);
+		g_ptr_array_free (glob_list, TRUE);
 	}
 
 	{
-		FILE *stream;
-		char *magic_path;
+		GString *contents;
 		int i;
-		magic_path = g_strconcat(mime_dir, "/magic.new", NULL);
-		stream = fopen_gerror(magic_path, error);
-		if (!stream)
-			goto out;
-		fwrite("MIME-Magic\0\n", 1, 12, stream);
+
+		contents = g_string_sized_new(64 * 1024);
+		g_string_append_len(contents, "MIME-Magic\0\n", 12);
 
 		if (magic_array->len)
 			g_ptr_array_sort(magic_array, cmp_magic);
@@ -3796,120 +7676,69 @@ int main(int argc, char **argv)
 		{
 			Magic *magic = (Magic *) magic_array->pdata[i];
 
-			write_magic(stream, magic);
+			write_magic(contents, magic);
 		}
-		if (!fclose_gerror(stream, error))
-			goto out;
-		if (!atomic_update(magic_path, error))
+		if (!save_generated_file(mime_dir, "magic", contents, error))
 			goto out;
-		g_free(magic_path);
 	}
 
 	{
-		FILE *stream;
-		char *ns_path;
+		GString *contents = g_string_new(NULL);
 
-		ns_path = g_strconcat(mime_dir, "/XMLnamespaces.new", NULL);
-		stream = fopen_gerror(ns_path, error);
-		if (!stream)
-			goto out;
-		write_namespaces(stream);
-		if (!fclose_gerror(stream, error))
-			goto out;
-		if (!atomic_update(ns_path, error))
+		write_namespaces(contents);
+		if (!save_generated_file(mime_dir, "XMLnamespaces", contents,
+					 error))
 			goto out;
-		g_free(ns_path);
 	}
 	
 	{
-		FILE *stream;
-		char *path;
-		
-		path = g_strconcat(mime_dir, "/subclasses.new", NULL);
-		stream = fopen_gerror(path, error);
-		if (!stream)
-			goto out;
-		write_subclasses(stream);
-		if (!fclose_gerror(stream, error))
-			goto out;
-		if (!atomic_update(path, error))
+		GString *contents = g_string_new(NULL);
+
+		write_subclasses(contents);
+		if (!save_generated_file(mime_dir, "subclasses", contents,
+					 error))
 			goto out;
-		g_free(path);
 	}
 
 	{
-		FILE *stream;
-		char *path;
-		
-		path = g_strconcat(mime_dir, "/aliases.new", NULL);
-		stream = fopen_gerror(path, error);
-		if (!stream)
-			goto out;
-		write_aliases(stream);
-		if (!fclose_gerror(stream, error))
-			goto out;
-		if (!atomic_update(path, error))
+		GString *contents = g_string_new(NULL);
+
+		write_aliases(contents);
+		if (!save_generated_file(mime_dir, "aliases", contents, error))
 			goto out;
-		g_free(path);
 	}
 
 	{
-		FILE *stream;
-		char *path;
-		
-		path = g_strconcat(mime_dir, "/types.new", NULL);
-		stream = fopen_gerror(path, error);
-		if (!stream)
-			goto out;
-		write_types(stream);
-		if (!fclose_gerror(stream, error))
-			goto out;
-		if (!atomic_update(path, error))
+		GString *contents = g_string_new(NULL);
+
+		write_types(contents);
+		if (!save_generated_file(mime_dir, "types", contents, error))
 			goto out;
-		g_free(path);
 	}
 
 	{
-		FILE *stream;
-		char *icon_path;
+		GString *contents = g_string_new(NULL);
 
-		icon_path = g_strconcat(mime_dir, "/generic-icons.new", NULL);
-		stream = fopen_gerror(icon_path, error);
-		if (!stream)
-			goto out;
-		write_icons(generic_icon_hash, stream);
-		if (!fclose_gerror(stream, error))
-			goto out;
-		if (!atomic_update(icon_path, error))
+		write_icons(generic_icon_hash, contents);
+		if (!save_generated_file(mime_dir, "generic-icons", contents,
+					 error))
 			goto out;
-		g_free(icon_path);
 	}
 
 	{
-		FILE *stream;
-		char *icon_path;
+		GString *contents = g_string_new(NULL);
 
-		icon_path = g_strconcat(mime_dir, "/icons.new", NULL);
-		stream = fopen_gerror(icon_path, error);
-		if (!stream)
+		write_icons(icon_hash, contents);
+		if (!save_generated_file(mime_dir, "icons", contents, error))
 			goto out;
-		write_icons(icon_hash, stream);
-		if (!fclose_gerror(stream, error))
-			goto out;
-		if (!atomic_update(icon_path, error))
-			goto out;
-		g_free(icon_path);
 	}
 
 	{
-		FILE *stream;
-		char *path;
+		GString *contents;
 		int i;
-		path = g_strconcat(mime_dir, "/treemagic.new", NULL);
-		stream = fopen_gerror(path, error);
-		if (!stream)
-			goto out;
-		fwrite("MIME-TreeMagic\0\n", 1, 16, stream);
+
+		contents = g_string_new(NULL);
+		g_string_append_len(contents, "MIME-TreeMagic\0\n", 16);
 
 		if (tree_magic_array->len)
 			g_ptr_array_sort(tree_magic_array, cmp_tree_magic);
@@ -3917,52 +7746,50 @@ int main(int argc, char **argv)
 		{
 			TreeMagic *magic = (TreeMagic *) tree_magic_array->pdata[i];
 
-			write_tree_magic(stream, magic);
+			write_tree_magic(contents, magic);
 		}
-		if (!fclose_gerror(stream, error))
-			goto out;
-		if (!atomic_update(path, error))
+		if (!save_generated_file(mime_dir, "treemagic", contents,
+					 error))
 			goto out;
-		g_free(path);
 	}
 
 	{
-		FILE *stream;
-		char *path;
-		
-		path = g_strconcat(mime_dir, "/mime.cache.new", NULL);
-		stream = fopen_gerror(path, error);
-		if (!stream)
-			goto out;
-		write_cache(stream);
-		if (!fclose_gerror(stream, error))
-			goto out;
-		if (!atomic_update(path, error))
-			goto out;
-		g_free(path);
-	}
+		GString *cache;
 
-	{
-		FILE *stream;
-		char *path;
+		if (optimize_magic)
+			optimize_magic_rules();
 
-		path = g_strconcat(mime_dir, "/version.new", NULL);
-		stream = fopen_gerror(path, error);
-		if (!stream)
+		cache = g_string_sized_new(256 * 1024);
+		write_cache(cache);
+		if (!save_generated_file(mime_dir, "mime.cache", cache, error))
 			goto out;
-		g_fprintf(stream,
-			  VERSION "\n");
-		if (!fclose_gerror(stream, error))
-			goto out;
-		if (!atomic_update(path, error))
-			goto out;
-		g_free(path);
 	}
 
-	g_ptr_array_foreach(magic_array, (GFunc)magic_free, NULL);
+	if (!save_generated_file(mime_dir, "version",
+				 g_string_new(VERSION "\n"), error))
+		goto out;
+
+	if (!save_package_cache(mime_dir, package_cache, error))
+		goto out;
+	g_hash_table_destroy(package_cache);
+
+	/* Written last, so that an interrupted run is never considered
+	 * up-to-date. With PKGSYSTEM_ENABLE_FSYNC=batch, that means only
+	 * after everything else is on disk.
+	 */
+	if (!flush_updates(mime_dir, error))
+		goto out;
+	if (!save_manifest(mime_dir, package_stats, error))
+		goto out;
+	if (!flush_updates(mime_dir, error))
+		goto out;
+	if (old_manifest)
+		g_hash_table_destroy(old_manifest);
+	g_hash_table_destroy(package_stats);
+
 	g_ptr_array_free(magic_array, TRUE);
-	g_ptr_array_foreach(tree_magic_array, (GFunc)tree_magic_free, NULL);
 	g_ptr_array_free(tree_magic_array, TRUE);
+	arena_free_all();
 
 	g_hash_table_destroy(types);
 	g_hash_table_destroy(globs_hash);
@@ -0,0 +1,49 @@
+#!/usr/bin/env bash
+set -e
+
+source_root="${1}"
+xml_db_file="${2}"
+update_mime_database="${3}"
+
+tmp_dir=`mktemp -d`
+
+for mode in default batch; do
+    mkdir -p "${tmp_dir}/mime-${mode}/packages"
+    cp -a "${xml_db_file}" "${tmp_dir}/mime-${mode}/packages/"
+    cp -a "${source_root}"/tests/mime-db-tests/packages/*.xml "${tmp_dir}/mime-${mode}/packages/"
+done
+
+"${update_mime_database}" "${tmp_dir}/mime-default"
+PKGSYSTEM_ENABLE_FSYNC=batch "${update_mime_database}" "${tmp_dir}/mime-batch"
+
+# Batching the syncs must not change the output (the manifest records
+# inode numbers, so it differs anyway)
+diff -r -x packages.manifest "${tmp_dir}/mime-default" "${tmp_dir}/mime-batch"
+
+check_no_new_files() {
+    leftover=`find "${tmp_dir}/mime-batch" -name '*.new'`
+    if [ -n "${leftover}" ]; then
+        echo "Files left behind (line ${BASH_LINENO[0]}):"
+        echo "${leftover}"
+        exit 1
+    fi
+}
+
+check_skipped() {
+    if ! PKGSYSTEM_ENABLE_FSYNC=batch "${update_mime_database}" -V -n "${tmp_dir}/mime-batch" 2>&1 | grep -q "Skipping mime update"; then
+        echo "Expected database to be skipped (line ${BASH_LINENO[0]})"
+        exit 1
+    fi
+}
+
+check_no_new_files
+# The manifest written last must be in place
+check_skipped
+check_no_new_files
+# Timestamps changed, so only the manifest is written again
+touch -d "2000-01-01" "${tmp_dir}"/mime-batch/packages/*.xml
+check_skipped
+check_no_new_files
+check_skipped
+
+rm -rf "${tmp_dir}"
@@ -0,0 +1,52 @@
+#!/usr/bin/env bash
+set -e
+
+source_root="${1}"
+update_mime_database="${2}"
+
+tmp_dir=`mktemp -d`
+export PKGSYSTEM_ENABLE_FSYNC=0
+
+mkdir -p "${tmp_dir}/mime/packages"
+cp -a "${source_root}"/tests/mime-db-tests/packages/*.xml "${tmp_dir}/mime/packages/"
+
+run() {
+    if "${update_mime_database}" -V -n "${tmp_dir}/mime" 2>&1 | grep -q "Skipping mime update"; then
+        result=skipped
+    else
+        result=updated
+    fi
+    if [ "${result}" != "${1}" ]; then
+        echo "Expected database to be ${1}, but it was ${result} (line ${BASH_LINENO[0]})"
+        exit 1
+    fi
+}
+
+# No manifest yet
+run updated
+# Nothing changed
+run skipped
+# Timestamps changed, but not the contents
+touch -d "2000-01-01" "${tmp_dir}"/mime/packages/*.xml
+run skipped
+# Contents changed, with the old size and timestamp
+file=`ls "${tmp_dir}"/mime/packages/*.xml | head -n 1`
+sed -i -e 's/PHP script/PHP Script/' "${file}"
+touch -d "2000-01-01" "${file}"
+run updated
+run skipped
+# File added and removed
+cp "${file}" "${tmp_dir}/mime/packages/copy.xml"
+run updated
+rm "${tmp_dir}/mime/packages/copy.xml"
+run updated
+run skipped
+# Generated file missing
+rm "${tmp_dir}/mime/mime.cache"
+run updated
+run skipped
+rm "${tmp_dir}/mime/version"
+run updated
+run skipped
+
+rm -rf "${tmp_dir}"
@@ -0,0 +1,63 @@
+#!/usr/bin/env bash
+set -e
+
+source_root="${1}"
+xml_db_file="${2}"
+update_mime_database="${3}"
+test_mime_cache="${4}"
+
+tmp_dir=`mktemp -d`
+export PKGSYSTEM_ENABLE_FSYNC=0
+
+mkdir -p "${tmp_dir}/mime/packages" "${tmp_dir}/unoptimized/packages"
+cp -a "${xml_db_file}" "${tmp_dir}/mime/packages/"
+cp -a "${xml_db_file}" "${tmp_dir}/unoptimized/packages/"
+
+# Rules that the optimizer can simplify, and a type inheriting from a text
+# type, in ways the database doesn't need
+cat > "${tmp_dir}/mime/packages/test.xml" <<EOT
+<?xml version="1.0" encoding="utf-8"?>
+<mime-info xmlns="http://www.freedesktop.org/standards/shared-mime-info">
+  <mime-type type="application/x-optimize-test">
+    <comment>Test file</comment>
+    <magic priority="50">
+      <match type="string" value="OPTTEST" offset="0"/>
+      <match type="string" value="OPTTEST" offset="0">
+        <match type="string" value="child" offset="8"/>
+      </match>
+      <match type="string" value="OPTIMAL" offset="4:6"/>
+      <match type="string" value="OPTIMAL" offset="4:6" mask="0xffffffffffffff">
+        <match type="string" value="OPT" offset="16"/>
+        <match type="string" value="OPTIMUM" offset="16"/>
+        <match type="string" value="OPTIMIST" offset="16"/>
+      </match>
+      <match type="string" value="PRE" offset="24">
+        <match type="string" value="X" offset="30"/>
+      </match>
+      <match type="string" value="PREFIX" offset="24"/>
+      <match type="string" value="PREFAB" offset="24"/>
+      <match type="big16" value="0x1234" mask="0xff0f" offset="32"/>
+      <match type="host16" value="0x1234" mask="0xff0f" offset="36"/>
+      <match type="string" value="RANGE" offset="40:41"/>
+    </magic>
+  </mime-type>
+  <mime-type type="text/x-ancestor-test">
+    <comment>Test file</comment>
+  </mime-type>
+  <mime-type type="application/x-ancestor-test">
+    <comment>Test file</comment>
+    <sub-class-of type="text/x-ancestor-test"/>
+  </mime-type>
+</mime-info>
+EOT
+cp -a "${tmp_dir}/mime/packages/test.xml" "${tmp_dir}/unoptimized/packages/"
+
+"${update_mime_database}" "${tmp_dir}/mime"
+"${update_mime_database}" --no-optimize-magic "${tmp_dir}/unoptimized"
+
+# The extra sections must agree with the ones they index, and the
+# optimized magic rules with the ones as written
+"${test_mime_cache}" --reference "${tmp_dir}/unoptimized/mime.cache" \
+    "${tmp_dir}/mime/mime.cache" "${source_root}"/tests/mime-detection/*
+
+rm -rf "${tmp_dir}"
@@ -0,0 +1,30 @@
+#!/usr/bin/env bash
+set -e
+
+source_root="${1}"
+xml_db_file="${2}"
+update_mime_database="${3}"
+
+tmp_dir=`mktemp -d`
+export PKGSYSTEM_ENABLE_FSYNC=0
+
+mkdir -p "${tmp_dir}/mime/packages"
+cp -a "${xml_db_file}" "${tmp_dir}/mime/packages/"
+cp -a "${source_root}"/tests/mime-db-tests/packages/*.xml "${tmp_dir}/mime/packages/"
+
+# First run: everything is parsed, and the package cache is written
+"${update_mime_database}" "${tmp_dir}/mime"
+test -f "${tmp_dir}/mime/packages.cache"
+cp -a "${tmp_dir}/mime" "${tmp_dir}/parsed"
+
+# Second run: the files are loaded from the package cache instead
+"${update_mime_database}" -V "${tmp_dir}/mime" > "${tmp_dir}/log" 2>&1
+grep -q "from the package cache" "${tmp_dir}/log"
+diff -r -x "packages.*" "${tmp_dir}/parsed" "${tmp_dir}/mime"
+
+# A damaged cache is ignored
+head -c 100 "${tmp_dir}/parsed/packages.cache" > "${tmp_dir}/mime/packages.cache"
+"${update_mime_database}" "${tmp_dir}/mime"
+diff -r -x "packages.*" "${tmp_dir}/parsed" "${tmp_dir}/mime"
+
+rm -rf "${tmp_dir}"
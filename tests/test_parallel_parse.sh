@@ -0,0 +1,21 @@
+#!/usr/bin/env bash
+set -e
+
+source_root="${1}"
+xml_db_file="${2}"
+update_mime_database="${3}"
+
+tmp_dir=`mktemp -d`
+
+for jobs in 1 4; do
+    mkdir -p "${tmp_dir}/mime-${jobs}/packages"
+    cp -a "${xml_db_file}" "${tmp_dir}/mime-${jobs}/packages/"
+    cp -a "${source_root}"/tests/mime-db-tests/packages/*.xml "${tmp_dir}/mime-${jobs}/packages/"
+    PKGSYSTEM_ENABLE_FSYNC=0 "${update_mime_database}" -j ${jobs} "${tmp_dir}/mime-${jobs}"
+done
+
+# The output must not depend on the number of threads (the manifest
+# records inode numbers, so it differs anyway)
+diff -r -x packages.manifest "${tmp_dir}/mime-1" "${tmp_dir}/mime-4"
+
+rm -rf "${tmp_dir}"
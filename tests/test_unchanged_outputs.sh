@@ -0,0 +1,43 @@
+#!/usr/bin/env bash
+set -e
+
+source_root="${1}"
+xml_db_file="${2}"
+update_mime_database="${3}"
+
+tmp_dir=`mktemp -d`
+export PKGSYSTEM_ENABLE_FSYNC=0
+
+mkdir -p "${tmp_dir}/mime/packages"
+cp -a "${xml_db_file}" "${tmp_dir}/mime/packages/"
+cat > "${tmp_dir}/mime/packages/test.xml" <<EOT
+<?xml version="1.0" encoding="utf-8"?>
+<mime-info xmlns="http://www.freedesktop.org/standards/shared-mime-info">
+  <mime-type type="application/x-unchanged-test">
+    <comment>Test file</comment>
+    <glob pattern="*.unchanged-test"/>
+  </mime-type>
+</mime-info>
+EOT
+
+list_inodes() {
+    (cd "${tmp_dir}/mime" && find . -type f ! -path "./packages/*" -printf '%i %p\n' | sort -k 2)
+}
+
+"${update_mime_database}" "${tmp_dir}/mime"
+list_inodes > "${tmp_dir}/before"
+
+# Nothing changed, so no file may be replaced
+"${update_mime_database}" "${tmp_dir}/mime"
+list_inodes > "${tmp_dir}/after"
+diff "${tmp_dir}/before" "${tmp_dir}/after"
+
+# Only the outputs that depend on the changed comment may be replaced
+sed -i -e 's/Test file/Test document/' "${tmp_dir}/mime/packages/test.xml"
+"${update_mime_database}" "${tmp_dir}/mime"
+list_inodes > "${tmp_dir}/after"
+diff "${tmp_dir}/before" "${tmp_dir}/after" | grep '^>' | cut -d ' ' -f 3 | sort > "${tmp_dir}/changed"
+printf '%s\n' ./application/x-unchanged-test.xml ./packages.cache ./packages.manifest > "${tmp_dir}/expected"
+diff "${tmp_dir}/expected" "${tmp_dir}/changed"
+
+rm -rf "${tmp_dir}"